@@ -0,0 +1,38 @@
+#!/bin/sh
+# Per-row formatting cost of each output mode, for one or more ls builds:
+#
+#   sh bench/rows.sh [LS...]        (default: bin/ls; N=entries, RUNS=tries)
+#
+# A directory of N empty files is exported once, and every mode then lists
+# it back with --read-export, which formats rows without reading the
+# directory or taking any stats. Best of RUNS wall times, per row.
+N=${N:-200000}
+RUNS=${RUNS:-7}
+[ $# -gt 0 ] || set -- bin/ls
+
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT INT TERM
+mkdir "$work/t"
+(cd "$work/t" && seq -f 'f%07g' "$N" | xargs touch) || exit 1
+"$1" --export="$work/rows.lsx" "$work/t" >/dev/null || exit 1
+
+now() {
+    date +%s%N
+}
+
+for ls in "$@"; do
+    for mode in "-l" "-l --color=always" "" "--color=always" "-x" "-x --color=always" \
+                "--format=tsv" "--format=jsonl" "--format=null"; do
+        best=
+        i=0
+        while [ $i -lt "$RUNS" ]; do
+            t0=$(now)
+            # shellcheck disable=SC2086
+            "$ls" $mode --read-export="$work/rows.lsx" >/dev/null
+            t=$(($(now) - t0))
+            if [ -z "$best" ] || [ $t -lt $best ]; then best=$t; fi
+            i=$((i + 1))
+        done
+        printf '%-24s %-20s %6d ns/row\n' "$ls" "${mode:-(columns)}" $((best / N))
+    done
+done
@@ -0,0 +1,656 @@
+/*
+ * Feature 8: Listing Engine (v1.7.0)
+ * Retains previous features: -l (long), -x (horizontal), default (columns), colorized output, -R
+ * Adds name filters for -R: --include/--exclude globs, --prune, --one-file-system
+ * Adds metadata predicates (--type, --size, --newer, --uid) with lazy stat
+ * Adds a parallel -R traversal (--threads) and du-style totals (--sizes)
+ * Adds symlink following (-L, -H) with cycle detection, and --stats
+ * Adds machine-readable output (--format=null|jsonl|tsv) and a buffered writer
+ * Moves the listing engine into liblsscan (lsscan.c); this file is the CLI
+ * Adds a resident listing daemon (--serve) and its client (--socket, $LS_SOCKET)
+ * Adds an on-disk directory index for repeated listings (--index)
+ * Adds --watch: the listing is kept current from inotify events
+ * Adds listing snapshots (--snapshot) and change reports against them (--since)
+ * Adds --memory-limit: huge directories are sorted externally through temp files
+ * Adds --deadline and --stat-timeout for listings on hung filesystems
+ * Adds LS_COLORS support and --color=always|auto|never (auto by default)
+ * Lays out columns by display width (UTF-8); unprintable characters show as '?'
+ * Sizes each column to its own names, GNU-style, fitting as many as the line holds
+ * Picks a stat strategy per filesystem type; $LS_FS_PROFILES adjusts the profiles
+ * Adds a content digest column (--hash=xxh3|sha256) with an on-disk cache (--hash-cache)
+ * Adds --xattrs: -l marks files with an ACL ('+') or a security context ('.')
+ * Adds a columnar export of the listing (--export) and listing one back (--read-export)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pwd.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "lsscan.h"
+#include "lsd.h"
+
+void print_stats(int fd, const struct ls_stats *st) {
+    dprintf(fd, "stats: %ld directories, %ld entries read, %ld stat calls\n",
+            st->dirs, st->entries, st->stat_calls);
+    if (st->xattr_calls)
+        dprintf(fd, "stats: %ld listxattr calls\n", st->xattr_calls);
+    dprintf(fd, "stats: visited set %zu directories in %zu bytes, %ld revisits skipped\n",
+            st->visited_count, st->visited_bytes, st->revisits);
+    if (st->cache_hits || st->cache_misses)
+        dprintf(fd, "stats: directory cache %ld hits, %ld misses\n",
+                st->cache_hits, st->cache_misses);
+    if (st->stat_timeouts || st->late_dirs)
+        dprintf(fd, "stats: %ld stats timed out, %ld directories past the deadline\n",
+                st->stat_timeouts, st->late_dirs);
+    if (st->hashed || st->hash_hits)
+        dprintf(fd, "stats: %ld files hashed (%lld bytes read), %ld digests cached\n",
+                st->hashed, st->hash_bytes, st->hash_hits);
+}
+
+// -------------------- Option Parsing --------------------
+// --type=f,d,l: any of the find(1) letters, commas optional
+int parse_type_list(const char *arg, unsigned *mask) {
+    *mask = 0;
+    for (const char *p = arg; *p; p++) {
+        switch (*p) {
+            case 'f': *mask |= LS_TYPE_FILE; break;
+            case 'd': *mask |= LS_TYPE_DIR; break;
+            case 'l': *mask |= LS_TYPE_LINK; break;
+            case 'p': *mask |= LS_TYPE_FIFO; break;
+            case 's': *mask |= LS_TYPE_SOCK; break;
+            case 'c': *mask |= LS_TYPE_CHR; break;
+            case 'b': *mask |= LS_TYPE_BLK; break;
+            case ',': break;
+            default:  return -1;
+        }
+    }
+    return 0;
+}
+
+// --color=WHEN in GNU's spellings; a bare --color means always. Returns
+// 1, 0, or -1 for auto.
+int parse_color(const char *arg) {
+    if (!arg || strcmp(arg, "always") == 0 || strcmp(arg, "yes") == 0 ||
+        strcmp(arg, "force") == 0)
+        return 1;
+    if (strcmp(arg, "never") == 0 || strcmp(arg, "no") == 0 || strcmp(arg, "none") == 0)
+        return 0;
+    if (strcmp(arg, "auto") == 0 || strcmp(arg, "tty") == 0 || strcmp(arg, "if-tty") == 0)
+        return -1;
+    return -2;
+}
+
+// N[kMGT] (or Nc) as a byte count
+int parse_bytes(const char *arg, long long *bytes) {
+    char *end;
+    errno = 0;
+    long long n = strtoll(arg, &end, 10);
+    if (errno || end == arg || n < 0) return -1;
+    switch (*end) {
+        case '\0': break;
+        case 'c': end++; break;
+        case 'k': case 'K': n <<= 10; end++; break;
+        case 'M': n <<= 20; end++; break;
+        case 'G': n <<= 30; end++; break;
+        case 'T': n <<= 40; end++; break;
+        default:  return -1;
+    }
+    if (*end) return -1;
+    *bytes = n;
+    return 0;
+}
+
+// N[.N][ms|s|m|h] as nanoseconds; a bare number is seconds
+int parse_duration(const char *arg, long long *ns) {
+    char *end;
+    errno = 0;
+    double n = strtod(arg, &end);
+    if (errno || end == arg || !(n >= 0)) return -1;
+    double unit = 1e9;
+    if (strcmp(end, "ms") == 0) unit = 1e6;
+    else if (strcmp(end, "m") == 0) unit = 60e9;
+    else if (strcmp(end, "h") == 0) unit = 3600e9;
+    else if (*end && strcmp(end, "s") != 0) return -1;
+    if (n * unit >= 9e18) return -1;
+    *ns = (long long)(n * unit);
+    return 0;
+}
+
+// --size=[+|>|-|<]N[kMGT]; a bare N means exactly N bytes
+int parse_size_pred(const char *arg, struct ls_opts *opts) {
+    opts->size_cmp = '=';
+    if (*arg == '+' || *arg == '>') { opts->size_cmp = '>'; arg++; }
+    else if (*arg == '-' || *arg == '<') { opts->size_cmp = '<'; arg++; }
+
+    long long n;
+    if (parse_bytes(arg, &n) == -1) return -1;
+    opts->size = (off_t)n;
+    return 0;
+}
+
+// --uid accepts a number or a user name
+int parse_uid(const char *arg, uid_t *uid) {
+    char *end;
+    unsigned long n = strtoul(arg, &end, 10);
+    if (*arg && !*end) { *uid = (uid_t)n; return 0; }
+    struct passwd *pw = getpwnam(arg);
+    if (!pw) return -1;
+    *uid = pw->pw_uid;
+    return 0;
+}
+
+// -------------------- Main Function --------------------
+// Long options without a short form get codes above the char range
+enum { OPT_INCLUDE = 256, OPT_EXCLUDE, OPT_PRUNE, OPT_ONE_FS,
+       OPT_TYPE, OPT_SIZE, OPT_NEWER, OPT_UID, OPT_SIZES, OPT_THREADS, OPT_STATS,
+       OPT_FORMAT, OPT_SERVE, OPT_SOCKET, OPT_INDEX,
+       OPT_WATCH, OPT_SNAPSHOT, OPT_SINCE, OPT_MEMORY_LIMIT,
+       OPT_DEADLINE, OPT_STAT_TIMEOUT, OPT_COLOR, OPT_HASH, OPT_HASH_CACHE,
+       OPT_XATTRS, OPT_EXPORT, OPT_READ_EXPORT };
+
+static const struct option long_options[] = {
+    {"include",         required_argument, NULL, OPT_INCLUDE},
+    {"exclude",         required_argument, NULL, OPT_EXCLUDE},
+    {"prune",           required_argument, NULL, OPT_PRUNE},
+    {"one-file-system", no_argument,       NULL, OPT_ONE_FS},
+    {"type",            required_argument, NULL, OPT_TYPE},
+    {"size",            required_argument, NULL, OPT_SIZE},
+    {"newer",           required_argument, NULL, OPT_NEWER},
+    {"uid",             required_argument, NULL, OPT_UID},
+    {"sizes",           no_argument,       NULL, OPT_SIZES},
+    {"threads",         required_argument, NULL, OPT_THREADS},
+    {"stats",           no_argument,       NULL, OPT_STATS},
+    {"format",          required_argument, NULL, OPT_FORMAT},
+    {"serve",           required_argument, NULL, OPT_SERVE},
+    {"socket",          required_argument, NULL, OPT_SOCKET},
+    {"index",           required_argument, NULL, OPT_INDEX},
+    {"watch",           no_argument,       NULL, OPT_WATCH},
+    {"snapshot",        required_argument, NULL, OPT_SNAPSHOT},
+    {"since",           required_argument, NULL, OPT_SINCE},
+    {"memory-limit",    required_argument, NULL, OPT_MEMORY_LIMIT},
+    {"deadline",        required_argument, NULL, OPT_DEADLINE},
+    {"stat-timeout",    required_argument, NULL, OPT_STAT_TIMEOUT},
+    {"color",           optional_argument, NULL, OPT_COLOR},
+    {"hash",            required_argument, NULL, OPT_HASH},
+    {"hash-cache",      required_argument, NULL, OPT_HASH_CACHE},
+    {"xattrs",          no_argument,       NULL, OPT_XATTRS},
+    {"export",          required_argument, NULL, OPT_EXPORT},
+    {"read-export",     required_argument, NULL, OPT_READ_EXPORT},
+    {NULL, 0, NULL, 0}
+};
+
+// Options that are not part of struct ls_opts
+struct CliFlags {
+    int stats;                // --stats
+    const char *serve;        // --serve=SOCKET: run as the listing daemon
+    const char *socket;       // --socket=SOCKET: ask that daemon first
+    const char *index;        // --index=FILE: on-disk directory index
+    int watch;                // --watch: keep listing until interrupted
+    const char *snapshot;     // --snapshot=FILE: record this listing
+    const char *since;        // --since=FILE: report changes against one
+    long long deadline;       // --deadline: ns the whole listing may take
+    const char *hash_cache;   // --hash-cache=FILE: digests kept between runs
+    const char *export;       // --export=FILE: record this listing, column-wise
+    const char *read_export;  // --read-export=FILE: list such a file instead
+};
+
+void usage(int fd, const char *prog) {
+    dprintf(fd, "Usage: %s [-l] [-x] [-R] [-H | -L] [--include=GLOB] [--exclude=GLOB]\n"
+                    "          [--prune=GLOB] [--one-file-system] [--type=fdlpscb]\n"
+                    "          [--size=[+-]N[kMGT]] [--newer=FILE] [--uid=USER]\n"
+                    "          [--sizes] [--threads=N] [--stats] [--format=null|jsonl|tsv]\n"
+                    "          [--color[=always|auto|never]] [--hash=xxh3|sha256]\n"
+                    "          [--hash-cache=FILE] [--xattrs]\n"
+                    "          [--memory-limit=N[kMG]] [--deadline=T] [--stat-timeout=T]\n"
+                    "          [--index=FILE] [--watch] [--snapshot=FILE] [--since=FILE]\n"
+                    "          [--export=FILE | --read-export=FILE]\n"
+                    "          [--serve=SOCKET | --socket=SOCKET] [directory]\n", prog);
+}
+
+// Parses argv into opts and cli, reporting errors to opts->err_fd. Returns
+// the index of the first operand, -1 for a bad option (usage should follow)
+// or -2 if the error was reported.
+int parse_args(int argc, char *argv[], int out_fd, struct ls_opts *opts, struct CliFlags *cli) {
+    int opt;
+    struct stat ref;
+    long threads;
+    long long bytes;
+    char *end;
+    int color = -1;
+
+    memset(cli, 0, sizeof(*cli));
+    optind = 0;   // full getopt reset, as the daemon parses once per request
+
+    // -x already means horizontal output, so one-file-system is long-only
+    while ((opt = getopt_long(argc, argv, "lxRHL", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'l': opts->display = LS_LONG; break;
+            case 'x': opts->display = LS_HORIZONTAL; break;
+            case 'R': opts->recursive = 1; break;
+            case 'H': opts->follow = LS_FOLLOW_OPERANDS; break;
+            case 'L': opts->follow = LS_FOLLOW_ALL; break;
+            case OPT_INCLUDE: ls_matcher_add(&opts->include, optarg); break;
+            case OPT_EXCLUDE: ls_matcher_add(&opts->exclude, optarg); break;
+            case OPT_PRUNE:   ls_matcher_add(&opts->prune, optarg); break;
+            case OPT_ONE_FS:  opts->one_fs = 1; break;
+            case OPT_TYPE:
+                if (parse_type_list(optarg, &opts->type_mask) == -1) {
+                    dprintf(opts->err_fd, "%s: invalid --type '%s'\n", argv[0], optarg);
+                    return -1;
+                }
+                break;
+            case OPT_SIZE:
+                if (parse_size_pred(optarg, opts) == -1) {
+                    dprintf(opts->err_fd, "%s: invalid --size '%s'\n", argv[0], optarg);
+                    return -1;
+                }
+                break;
+            case OPT_NEWER:
+                if (stat(optarg, &ref) == -1) {
+                    dprintf(opts->err_fd, "%s: %s\n", optarg, strerror(errno));
+                    return -2;
+                }
+                opts->has_newer = 1;
+                opts->newer = ref.st_mtim;
+                break;
+            case OPT_UID:
+                if (parse_uid(optarg, &opts->uid) == -1) {
+                    dprintf(opts->err_fd, "%s: unknown user '%s'\n", argv[0], optarg);
+                    return -1;
+                }
+                opts->has_uid = 1;
+                break;
+            case OPT_SIZES: opts->sizes = 1; break;
+            case OPT_STATS: cli->stats = 1; break;
+            case OPT_FORMAT:
+                if (strcmp(optarg, "null") == 0) opts->format = LS_FORMAT_NULL;
+                else if (strcmp(optarg, "jsonl") == 0) opts->format = LS_FORMAT_JSONL;
+                else if (strcmp(optarg, "tsv") == 0) opts->format = LS_FORMAT_TSV;
+                else {
+                    dprintf(opts->err_fd, "%s: invalid --format '%s'\n", argv[0], optarg);
+                    return -1;
+                }
+                break;
+            case OPT_MEMORY_LIMIT:
+                if (parse_bytes(optarg, &bytes) == -1 || bytes == 0) {
+                    dprintf(opts->err_fd, "%s: invalid --memory-limit '%s'\n", argv[0], optarg);
+                    return -1;
+                }
+                opts->memory_limit = (size_t)bytes;
+                break;
+            case OPT_DEADLINE:
+                if (parse_duration(optarg, &cli->deadline) == -1 || cli->deadline == 0) {
+                    dprintf(opts->err_fd, "%s: invalid --deadline '%s'\n", argv[0], optarg);
+                    return -1;
+                }
+                break;
+            case OPT_STAT_TIMEOUT:
+                if (parse_duration(optarg, &opts->stat_timeout_ns) == -1 || opts->stat_timeout_ns == 0) {
+                    dprintf(opts->err_fd, "%s: invalid --stat-timeout '%s'\n", argv[0], optarg);
+                    return -1;
+                }
+                break;
+            case OPT_COLOR:
+                if ((color = parse_color(optarg)) == -2) {
+                    dprintf(opts->err_fd, "%s: invalid --color '%s'\n", argv[0], optarg);
+                    return -1;
+                }
+                break;
+            case OPT_HASH:
+                if (strcmp(optarg, "xxh3") == 0) opts->hash = LS_HASH_XXH3;
+                else if (strcmp(optarg, "sha256") == 0) opts->hash = LS_HASH_SHA256;
+                else {
+                    dprintf(opts->err_fd, "%s: invalid --hash '%s'\n", argv[0], optarg);
+                    return -1;
+                }
+                break;
+            case OPT_HASH_CACHE: cli->hash_cache = optarg; break;
+            case OPT_XATTRS:     opts->xattrs = 1; break;
+            case OPT_THREADS:
+                threads = strtol(optarg, &end, 10);
+                if (*end || threads < 0 || threads > 256) {
+                    dprintf(opts->err_fd, "%s: invalid --threads '%s'\n", argv[0], optarg);
+                    return -1;
+                }
+                opts->threads = (int)threads;
+                break;
+            case OPT_SERVE:  cli->serve = optarg; break;
+            case OPT_SOCKET: cli->socket = optarg; break;
+            case OPT_INDEX:  cli->index = optarg; break;
+            case OPT_WATCH:  cli->watch = 1; break;
+            case OPT_SNAPSHOT: cli->snapshot = optarg; break;
+            case OPT_SINCE:    cli->since = optarg; break;
+            case OPT_EXPORT:   cli->export = optarg; break;
+            case OPT_READ_EXPORT: cli->read_export = optarg; break;
+            default:
+                return -1;
+        }
+    }
+    // a digest has a column in -l and a field in the records, nowhere else;
+    // spilled runs, change reports and the live view carry no digests
+    if (opts->hash && opts->display != LS_LONG && opts->format == LS_FORMAT_HUMAN) {
+        dprintf(opts->err_fd, "%s: --hash needs -l or --format\n", argv[0]);
+        return -2;
+    }
+    if (opts->hash && (cli->watch || cli->since || opts->memory_limit)) {
+        dprintf(opts->err_fd, "%s: --hash cannot be combined with --watch, --since or --memory-limit\n",
+                argv[0]);
+        return -2;
+    }
+    // the marks are a suffix of -l's mode column, which a live view redraws
+    // from fresh stats alone and a snapshot does not record
+    if (opts->xattrs && (opts->display != LS_LONG || opts->format != LS_FORMAT_HUMAN)) {
+        dprintf(opts->err_fd, "%s: --xattrs needs -l\n", argv[0]);
+        return -2;
+    }
+    if (opts->xattrs && (cli->watch || cli->since)) {
+        dprintf(opts->err_fd, "%s: --xattrs cannot be combined with --watch or --since\n", argv[0]);
+        return -2;
+    }
+    // an export is listed back from what it recorded, not from the filesystem
+    if (cli->read_export && (cli->export || cli->snapshot || cli->since || cli->watch ||
+                             opts->sizes || opts->hash || opts->xattrs)) {
+        dprintf(opts->err_fd, "%s: --read-export cannot be combined with --export, --snapshot, "
+                        "--since, --watch, --sizes, --hash or --xattrs\n", argv[0]);
+        return -2;
+    }
+    if (cli->read_export && optind < argc) {
+        dprintf(opts->err_fd, "%s: --read-export takes no directory operands\n", argv[0]);
+        return -2;
+    }
+    if (cli->hash_cache && !opts->hash) {
+        dprintf(opts->err_fd, "%s: --hash-cache needs --hash\n", argv[0]);
+        return -2;
+    }
+    // out_fd is the client's in the daemon, so auto asks the right terminal
+    opts->color = color == -1 ? isatty(out_fd) : color;
+    return optind;
+}
+
+static volatile sig_atomic_t watch_stop;
+
+static void on_stop(int sig) {
+    (void)sig;
+    watch_stop = 1;
+}
+
+static void on_winch(int sig) {
+    (void)sig;   // only here to interrupt poll() so the screen is re-laid out
+}
+
+// The daemon's requests load these on threads of their own. The variables
+// only change while none is running (see lsd.c), so a value loaded here is
+// never swapped out from under a listing that uses it.
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Compiles $LS_COLORS unless that value is the one already loaded; the
+// daemon sees each client's value in turn
+void load_colors(void) {
+    static char *loaded;
+    static int have_loaded;
+    const char *spec = getenv("LS_COLORS");
+    if (spec && !*spec) spec = NULL;
+    pthread_mutex_lock(&load_lock);
+    if (!have_loaded || !(spec ? loaded && strcmp(spec, loaded) == 0 : !loaded)) {
+        ls_colors_load(spec);
+        free(loaded);
+        loaded = spec ? strdup(spec) : NULL;
+        have_loaded = 1;
+    }
+    pthread_mutex_unlock(&load_lock);
+}
+
+// Applies $LS_FS_PROFILES in the same way; a malformed value is reported
+// once and leaves the built-in profiles in force
+void load_profiles(int err_fd) {
+    static char *loaded;
+    static int have_loaded;
+    const char *spec = getenv("LS_FS_PROFILES");
+    if (spec && !*spec) spec = NULL;
+    pthread_mutex_lock(&load_lock);
+    if (!have_loaded || !(spec ? loaded && strcmp(spec, loaded) == 0 : !loaded)) {
+        if (ls_fs_profiles_load(spec) == -1) {
+            dprintf(err_fd, "ls: LS_FS_PROFILES: malformed, using the built-in profiles\n");
+            ls_fs_profiles_load(NULL);
+        }
+        free(loaded);
+        loaded = spec ? strdup(spec) : NULL;
+        have_loaded = 1;
+    }
+    pthread_mutex_unlock(&load_lock);
+}
+
+// --watch: runs until SIGINT or SIGTERM, then restores the terminal
+int run_watch(int npaths, char *paths[], struct ls_opts *opts) {
+    if (opts->color) load_colors();
+    load_profiles(STDERR_FILENO);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = on_stop;   // no SA_RESTART: the event loop must wake up
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = on_winch;
+    sigaction(SIGWINCH, &sa, NULL);
+
+    struct ls_out out;
+    ls_out_init_fd(&out, STDOUT_FILENO);
+    opts->sizes = 0;   // totals are a property of one pass, not of a live view
+    int rc = ls_watch((const char *const *)paths, npaths, opts, &out, &watch_stop);
+    if (rc == -1 && !out.err) perror("inotify");
+    ls_out_free(&out);
+    return rc == -1 ? EXIT_FAILURE : 0;
+}
+
+// The library stops starting work at the deadline, but a directory read
+// blocked on a hung mount cannot be interrupted. This backstop fires once
+// the whole budget is spent and leaves without it.
+static void on_deadline(int sig) {
+    static const char msg[] = "ls: deadline passed during a blocked read\n";
+    (void)sig;
+    if (write(STDERR_FILENO, msg, sizeof(msg) - 1)) {}
+    _exit(EXIT_FAILURE);
+}
+
+void arm_deadline(long long ns) {
+    struct itimerval it;
+    memset(&it, 0, sizeof(it));
+    it.it_value.tv_sec = ns / 1000000000;
+    it.it_value.tv_usec = ns % 1000000000 / 1000;
+    if (!it.it_value.tv_sec && !it.it_value.tv_usec) it.it_value.tv_usec = 1;
+    signal(SIGALRM, on_deadline);
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
+// Lists the operands to out_fd and returns the exit status
+int run_listing(int npaths, char *paths[], struct ls_opts *opts, const struct CliFlags *cli,
+                int out_fd) {
+    struct ls_out out;
+    struct ls_stats stats;
+
+    if (opts->color) load_colors();
+    load_profiles(opts->err_fd);
+    if (cli->read_export) {
+        ls_out_init_fd(&out, out_fd);
+        int rc = ls_export_list(cli->read_export, opts, &out);
+        int err = out.err;
+        if (rc == -1 && !err)
+            dprintf(opts->err_fd, "ls: export %s: %s\n", cli->read_export,
+                    errno == EINVAL ? "not a complete export" : strerror(errno));
+        if (rc == 1)
+            dprintf(opts->err_fd, "ls: export %s is partial: the listing that wrote it was cut short\n",
+                    cli->read_export);
+        ls_out_free(&out);
+        if (!rc) return 0;
+        return err == EPIPE ? 128 + SIGPIPE : EXIT_FAILURE;
+    }
+    // unlike the index, a snapshot or an export is output the user asked for
+    if (cli->since && !(opts->since = ls_snapshot_load(cli->since))) {
+        dprintf(opts->err_fd, "ls: snapshot %s: %s\n", cli->since, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (cli->snapshot && !(opts->snapshot = ls_snapshot_create(cli->snapshot))) {
+        dprintf(opts->err_fd, "ls: snapshot %s: %s\n", cli->snapshot, strerror(errno));
+        if (opts->since) ls_snapshot_close(opts->since);
+        opts->since = NULL;
+        return EXIT_FAILURE;
+    }
+    if (cli->export && !(opts->export = ls_export_create(cli->export))) {
+        dprintf(opts->err_fd, "ls: export %s: %s\n", cli->export, strerror(errno));
+        if (opts->snapshot) ls_snapshot_close(opts->snapshot);
+        if (opts->since) ls_snapshot_close(opts->since);
+        opts->snapshot = opts->since = NULL;
+        return EXIT_FAILURE;
+    }
+
+    // an unusable index costs only its speedup, so the listing goes ahead
+    if (cli->index && !(opts->index = ls_index_open(cli->index)))
+        dprintf(opts->err_fd, "ls: index %s: %s\n", cli->index, strerror(errno));
+    if (cli->hash_cache && !(opts->digests = ls_digest_cache_open(cli->hash_cache)))
+        dprintf(opts->err_fd, "ls: hash cache %s: %s\n", cli->hash_cache, strerror(errno));
+
+    if (cli->deadline) {
+        // stop starting work a little early, leaving time to write it out
+        long long margin = cli->deadline / 10 < 1000000000 ? cli->deadline / 10 : 1000000000;
+        long long ns;
+        clock_gettime(CLOCK_MONOTONIC, &opts->deadline);
+        ns = opts->deadline.tv_nsec + cli->deadline - margin;
+        opts->deadline.tv_sec += ns / 1000000000;
+        opts->deadline.tv_nsec = ns % 1000000000;
+    }
+
+    ls_out_init_fd(&out, out_fd);
+    int rc = ls_list((const char *const *)paths, npaths, opts, &out, &stats);
+    if (cli->stats) print_stats(opts->err_fd, &stats);
+    int err = out.err;
+    ls_out_free(&out);
+
+    if (opts->index && ls_index_close(opts->index) == -1)
+        dprintf(opts->err_fd, "ls: cannot write index %s\n", cli->index);
+    opts->index = NULL;
+    if (opts->digests && ls_digest_cache_close(opts->digests) == -1)
+        dprintf(opts->err_fd, "ls: cannot write hash cache %s\n", cli->hash_cache);
+    opts->digests = NULL;
+    if (opts->snapshot && ls_snapshot_close(opts->snapshot) == -1) {
+        if (errno == ETIMEDOUT)
+            dprintf(opts->err_fd, "ls: snapshot %s not written: the listing was cut short\n",
+                    cli->snapshot);
+        else
+            dprintf(opts->err_fd, "ls: cannot write snapshot %s\n", cli->snapshot);
+        rc = -1;
+    }
+    if (opts->since) ls_snapshot_close(opts->since);
+    opts->snapshot = opts->since = NULL;
+    if (opts->export && ls_export_close(opts->export) == -1) {
+        dprintf(opts->err_fd, "ls: cannot write export %s\n", cli->export);
+        rc = -1;
+    }
+    opts->export = NULL;
+    // a listing missing what the deadline or a stat timeout cut off is not
+    // a complete one, and a monitoring job must be able to tell
+    if (!rc && !stats.late_dirs && !stats.stat_timeouts) return 0;
+    // the daemon ignores SIGPIPE, so report it for the client to re-raise
+    return err == EPIPE ? 128 + SIGPIPE : EXIT_FAILURE;
+}
+
+// Serves one request forwarded to the daemon (see lsd.c); getopt's state
+// is global, so requests parse one at a time
+int serve_request(int argc, char *argv[], int out_fd, int err_fd, struct ls_cache *cache) {
+    static pthread_mutex_t parse_lock = PTHREAD_MUTEX_INITIALIZER;
+    struct ls_opts opts;
+    struct CliFlags cli;
+    ls_opts_init(&opts);
+    opts.err_fd = err_fd;
+    pthread_mutex_lock(&parse_lock);
+    opterr = 0;   // getopt's own messages would go to the daemon's stderr
+    int first = parse_args(argc, argv, out_fd, &opts, &cli);
+    pthread_mutex_unlock(&parse_lock);
+    int status = EXIT_FAILURE;
+    if (first == -1) {
+        usage(err_fd, argv[0]);
+    } else if (cli.serve || cli.socket || cli.watch) {
+        dprintf(err_fd, "%s: --serve, --socket and --watch cannot be forwarded\n", argv[0]);
+    } else if (first >= 0) {
+        opts.cache = cache;
+        status = run_listing(argc - first, argv + first, &opts, &cli, out_fd);
+    }
+    ls_opts_free(&opts);
+    return status;
+}
+
+// Copies argv for forwarding to a daemon, minus the --socket option itself.
+// Taken before getopt_long() permutes argv.
+int forward_args(int argc, char *argv[], char *fwd[]) {
+    int n = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            while (i < argc) fwd[n++] = argv[i++];
+            break;
+        }
+        if (strncmp(argv[i], "--socket=", 9) == 0) continue;
+        if (strcmp(argv[i], "--socket") == 0) { i++; continue; }
+        fwd[n++] = argv[i];
+    }
+    fwd[n] = NULL;
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    struct ls_opts opts;
+    struct CliFlags cli;
+    char **fwd = malloc(sizeof(char *) * (argc + 1));
+    int nfwd = forward_args(argc, argv, fwd);
+
+    ls_opts_init(&opts);
+    int first = parse_args(argc, argv, STDOUT_FILENO, &opts, &cli);
+    if (first < 0) {
+        if (first == -1) usage(STDERR_FILENO, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (cli.serve)
+        return lsd_serve(cli.serve, serve_request) == -1 ? EXIT_FAILURE : 0;
+
+    if (cli.watch && (cli.snapshot || cli.since || cli.export || cli.deadline)) {
+        fprintf(stderr, "%s: --watch cannot be combined with --snapshot, --since, --export "
+                        "or --deadline\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    // also bounds a request forwarded to a daemon, which applies the same deadline
+    if (cli.deadline) arm_deadline(cli.deadline);
+    if (cli.watch) {
+        int status = run_watch(argc - first, argv + first, &opts);
+        ls_opts_free(&opts);
+        free(fwd);
+        return status;
+    }
+
+    if (!cli.socket) cli.socket = getenv("LS_SOCKET");
+    if (cli.socket && *cli.socket) {
+        int status;
+        if (lsd_request(cli.socket, nfwd, fwd, &status) == 0) {
+            if (status > 128) {
+                signal(status - 128, SIG_DFL);
+                raise(status - 128);
+            }
+            return status;
+        }
+        // nobody listening: list in-process
+    }
+
+    int status = run_listing(argc - first, argv + first, &opts, &cli, STDOUT_FILENO);
+    ls_opts_free(&opts);
+    free(fwd);
+    return status;
+}
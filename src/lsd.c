@@ -0,0 +1,394 @@
+/*
+ * lsd: resident listing daemon and client (see lsd.h)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "lsd.h"
+
+#define LSD_MAGIC         0x3344534cu  // "LSD3"
+#define LSD_MAX_REQUEST   (1 << 20)
+#define LSD_CACHE_ENTRIES (1 << 19)    // directory entries kept warm
+
+// Sent with the client's cwd, stdout and stderr attached; the payload is the
+// value of each variable in lsd_env ("=VALUE", or "" if unset) followed by
+// argv[1..], all NUL-terminated
+static const char *const lsd_env[] = { "TZ", "LS_COLORS", "LS_FS_PROFILES" };
+#define LSD_NENV (int)(sizeof(lsd_env) / sizeof(lsd_env[0]))
+
+struct lsd_header {
+    uint32_t magic;
+    uint32_t len;
+};
+
+static int socket_addr(const char *path, struct sockaddr_un *sa) {
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(sa->sun_path, path);
+    return 0;
+}
+
+static int write_all(int fd, const void *p, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p = (const char *)p + w;
+        n -= w;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *p, size_t n) {
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p = (char *)p + r;
+        n -= r;
+    }
+    return 0;
+}
+
+// -------------------- Client --------------------
+int lsd_request(const char *path, int argc, char *argv[], int *status) {
+    struct sockaddr_un sa;
+    if (socket_addr(path, &sa) == -1) return -1;
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s == -1) return -1;
+    if (connect(s, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+        close(s);
+        return -1;
+    }
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd == -1) {
+        close(s);
+        return -1;
+    }
+
+    size_t len = 0;
+    for (int i = 0; i < LSD_NENV; i++) {
+        const char *v = getenv(lsd_env[i]);
+        len += v ? strlen(v) + 2 : 1;
+    }
+    for (int i = 1; i < argc; i++) len += strlen(argv[i]) + 1;
+    char *payload = malloc(len);
+    char *p = payload;
+    for (int i = 0; i < LSD_NENV; i++) {
+        const char *v = getenv(lsd_env[i]);
+        if (v) p += sprintf(p, "=%s", v) + 1;
+        else *p++ = '\0';
+    }
+    for (int i = 1; i < argc; i++) p = stpcpy(p, argv[i]) + 1;
+
+    struct lsd_header h = { LSD_MAGIC, (uint32_t)len };
+    int fds[3] = { cwd, STDOUT_FILENO, STDERR_FILENO };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { &h, sizeof(h) };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    int sent = sendmsg(s, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(h);
+    close(cwd);
+    if (!sent) {
+        free(payload);
+        close(s);
+        return -1;
+    }
+    int ok = write_all(s, payload, len) == 0;
+    free(payload);
+
+    // From here on the daemon may have written output, so there is no
+    // falling back to an in-process listing
+    unsigned char reply;
+    if (ok && read_all(s, &reply, 1) == 0) {
+        *status = reply;
+    } else {
+        fprintf(stderr, "%s: listing daemon on %s dropped the request\n", argv[0], path);
+        *status = EXIT_FAILURE;
+    }
+    close(s);
+    return 0;
+}
+
+// -------------------- Daemon --------------------
+// Requests run on threads of their own, so a client that stops reading or a
+// listing stuck on a hung mount holds up only itself. What the listings
+// share process-wide (the variables in lsd_env and the owner name cache) is
+// changed only while none is running: a request that needs other values
+// waits for the running ones to finish.
+#define LSD_MAX_REQUESTS 64    // in flight at once; more wait to be accepted
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t idle;       // running dropped to 0
+    int running;               // listings under the current settings
+    int inflight;              // request threads, running or not
+    struct timespec passwd_mtime, group_mtime;
+} lsd_state = { .lock = PTHREAD_MUTEX_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER };
+
+struct lsd_client {
+    int c;
+    lsd_handler handler;
+    struct ls_cache *cache;
+};
+
+static int same_mtime(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+// Whether a client's value of a variable differs from the daemon's
+static int env_differs(const char *name, const char *field) {
+    const char *cur = getenv(name);
+    return field[0] == '=' ? !cur || strcmp(cur, field + 1) != 0 : cur != NULL;
+}
+
+// Takes on a client's value of a variable. The zone is parsed once and kept
+// until a client asks for another, and the listing reloads LS_COLORS and
+// LS_FS_PROFILES only when they change.
+static void apply_env(const char *name, const char *field) {
+    if (field[0] == '=') setenv(name, field + 1, 1);
+    else unsetenv(name);
+}
+
+// Waits until the request's settings are the ones in force, then counts it
+// as running. Owner and group names are cached for the daemon's lifetime
+// and forgotten whenever the account databases change.
+static void settings_enter(const char *const env[]) {
+    struct stat pw, gr;
+    if (stat("/etc/passwd", &pw) == -1) memset(&pw, 0, sizeof(pw));
+    if (stat("/etc/group", &gr) == -1) memset(&gr, 0, sizeof(gr));
+
+    pthread_mutex_lock(&lsd_state.lock);
+    for (;;) {
+        int ids = !same_mtime(&pw.st_mtim, &lsd_state.passwd_mtime) ||
+                  !same_mtime(&gr.st_mtim, &lsd_state.group_mtime);
+        int differs = 0;
+        for (int i = 0; i < LSD_NENV; i++) differs |= env_differs(lsd_env[i], env[i]);
+        if (!ids && !differs) break;
+        if (lsd_state.running) {
+            pthread_cond_wait(&lsd_state.idle, &lsd_state.lock);
+            continue;
+        }
+        if (env_differs("TZ", env[0])) {
+            apply_env("TZ", env[0]);
+            tzset();
+        }
+        for (int i = 1; i < LSD_NENV; i++) apply_env(lsd_env[i], env[i]);
+        if (ids) ls_id_cache_flush();
+        lsd_state.passwd_mtime = pw.st_mtim;
+        lsd_state.group_mtime = gr.st_mtim;
+        break;
+    }
+    lsd_state.running++;
+    pthread_mutex_unlock(&lsd_state.lock);
+}
+
+static void settings_leave(void) {
+    pthread_mutex_lock(&lsd_state.lock);
+    if (--lsd_state.running == 0) pthread_cond_broadcast(&lsd_state.idle);
+    pthread_mutex_unlock(&lsd_state.lock);
+}
+
+// Reads the header and the three descriptors; returns 0 with fds filled in
+static int receive_header(int c, struct lsd_header *h, int fds[3]) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * 3)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { h, sizeof(*h) };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n = recvmsg(c, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) return -1;
+
+    int got = 0;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        int count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *in = (int *)CMSG_DATA(cm);
+        for (int i = 0; i < count; i++) {
+            if (got < 3) fds[got++] = in[i];
+            else close(in[i]);
+        }
+    }
+    if (got != 3 || (msg.msg_flags & MSG_CTRUNC) ||
+        read_all(c, (char *)h + n, sizeof(*h) - n) == -1) {
+        for (int i = 0; i < got; i++) close(fds[i]);
+        return -1;
+    }
+    return 0;
+}
+
+static void serve_one(int c, lsd_handler handler, struct ls_cache *cache) {
+    // Only the daemon's own user may borrow its view of the filesystem
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(c, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1 || cred.uid != geteuid())
+        return;
+    // a client that never sends its request must not keep a thread
+    struct timeval tv = { 5, 0 };
+    setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    struct lsd_header h;
+    int fds[3];
+    if (receive_header(c, &h, fds) == -1) return;
+
+    unsigned char reply = EXIT_FAILURE;
+    char *payload = NULL;
+    char **argv = NULL;
+    if (h.magic != LSD_MAGIC || h.len == 0 || h.len > LSD_MAX_REQUEST) goto done;
+    payload = malloc(h.len + 1);
+    if (read_all(c, payload, h.len) == -1) goto done;
+    payload[h.len] = '\0';   // a truncated last string still ends
+
+    int argc = 1;
+    for (uint32_t i = 0; i < h.len; i++) argc += payload[i] == '\0';
+    argv = malloc(sizeof(char *) * (argc + 1));
+    argv[0] = "ls";
+    const char *env[LSD_NENV];
+    char *p = payload;
+    for (int i = 0; i < LSD_NENV; i++) {
+        env[i] = p < payload + h.len ? p : "";
+        p += strlen(env[i]) + 1;
+    }
+    argc = 1;
+    while (p < payload + h.len) {
+        argv[argc++] = p;
+        p += strlen(p) + 1;
+    }
+    argv[argc] = NULL;
+
+    // the working directory is this thread's alone (see serve_thread)
+    if (fchdir(fds[0]) == -1) {
+        dprintf(fds[2], "ls: cannot enter working directory: %s\n", strerror(errno));
+        goto done;
+    }
+    settings_enter(env);
+    reply = handler(argc, argv, fds[1], fds[2], cache);
+    settings_leave();
+
+done:
+    write_all(c, &reply, 1);
+    free(argv);
+    free(payload);
+    for (int i = 0; i < 3; i++) close(fds[i]);
+}
+
+static void *serve_thread(void *arg) {
+    struct lsd_client *cl = arg;
+    // a working directory of its own, so requests can run side by side
+    if (unshare(CLONE_FS) == 0) serve_one(cl->c, cl->handler, cl->cache);
+    close(cl->c);
+    free(cl);
+    pthread_mutex_lock(&lsd_state.lock);
+    lsd_state.inflight--;
+    pthread_mutex_unlock(&lsd_state.lock);
+    return NULL;
+}
+
+int lsd_serve(const char *path, lsd_handler handler) {
+    struct sockaddr_un sa;
+    if (socket_addr(path, &sa) == -1) {
+        perror(path);
+        return -1;
+    }
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s == -1) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);   // a socket left behind by an earlier daemon
+    mode_t old_mask = umask(077);
+    int bound = bind(s, (struct sockaddr *)&sa, sizeof(sa));
+    umask(old_mask);
+    if (bound == -1 || listen(s, 64) == -1) {
+        perror(path);
+        close(s);
+        return -1;
+    }
+
+    // a client that goes away mid-listing must not take the daemon with it
+    signal(SIGPIPE, SIG_IGN);
+    struct ls_cache *cache = ls_cache_new(LSD_CACHE_ENTRIES);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (;;) {
+        // draining between requests keeps the inotify queue from overflowing;
+        // with every thread busy, new clients wait in the listen backlog
+        pthread_mutex_lock(&lsd_state.lock);
+        int full = lsd_state.inflight >= LSD_MAX_REQUESTS;
+        pthread_mutex_unlock(&lsd_state.lock);
+        struct pollfd pfd[2] = { { ls_cache_fd(cache), POLLIN, 0 }, { s, POLLIN, 0 } };
+        if (poll(pfd, full ? 1 : 2, full ? 100 : -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if (pfd[0].revents & POLLIN) ls_cache_drain(cache);
+        if (full || !(pfd[1].revents & POLLIN)) continue;
+
+        int c = accept4(s, NULL, NULL, SOCK_CLOEXEC);
+        if (c == -1) continue;
+        struct lsd_client *cl = malloc(sizeof(struct lsd_client));
+        cl->c = c;
+        cl->handler = handler;
+        cl->cache = cache;
+        pthread_mutex_lock(&lsd_state.lock);
+        lsd_state.inflight++;
+        pthread_mutex_unlock(&lsd_state.lock);
+        pthread_t t;
+        if (pthread_create(&t, &attr, serve_thread, cl) != 0) {
+            pthread_mutex_lock(&lsd_state.lock);
+            lsd_state.inflight--;
+            pthread_mutex_unlock(&lsd_state.lock);
+            close(c);
+            free(cl);
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+    ls_cache_free(cache);
+    close(s);
+    return -1;
+}
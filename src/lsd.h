@@ -0,0 +1,33 @@
+/*
+ * lsd: the resident listing daemon (ls --serve) and its client (ls --socket)
+ *
+ * A client connects to the daemon's Unix socket and passes its working
+ * directory, stdout and stderr as descriptors along with its arguments and
+ * TZ. The daemon serves each request on a thread of its own: it switches
+ * that thread to the client's directory, runs the listing into the client's
+ * descriptors with its warm caches (owner names, timezone, directory
+ * tables), and replies with the exit status. A request whose TZ, LS_COLORS
+ * or LS_FS_PROFILES differs from the running ones' waits for them to finish.
+ */
+
+#ifndef LSD_H
+#define LSD_H
+
+#include "lsscan.h"
+
+// Runs one forwarded request (argv as the client passed it, argv[0] = "ls"),
+// writing to the client's stdout and stderr, out_fd and err_fd, with the
+// calling thread's working directory already the client's. Called on
+// several threads at once. Returns the exit status to hand back.
+typedef int (*lsd_handler)(int argc, char *argv[], int out_fd, int err_fd,
+                           struct ls_cache *cache);
+
+// Listens on path until a fatal error; returns -1 after reporting it
+int lsd_serve(const char *path, lsd_handler handler);
+
+// Forwards argv to the daemon on path. Returns -1 if no daemon answered
+// (nothing was sent, so the caller can list in-process), else 0 with the
+// daemon's exit status in *status.
+int lsd_request(const char *path, int argc, char *argv[], int *status);
+
+#endif
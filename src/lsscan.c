@@ -0,0 +1,6134 @@
+/*
+ * liblsscan (v1.7.0): scanning, stat, sort and format core of ls
+ * See lsscan.h for the API; ls-v1.7.0.c is the command-line wrapper.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pwd.h>
+#include <grp.h>
+#include <time.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "lsscan.h"
+
+// ANSI color codes
+#define COLOR_RESET   "\033[0m"
+
+// The scheme bin/ls has always used (blue directories, magenta symlinks,
+// red archives, green executables), in LS_COLORS form
+#define COLOR_BUILTIN "fi=0:di=0;34:ln=0;35:ex=0;32:" \
+                      "*.zip=0;31:*.tar=0;31:*.gz=0;31:*.bz2=0;31:*.xz=0;31:*.tgz=0;31"
+
+// Open-addressing (linear probing) set of (st_dev, st_ino) pairs
+struct dev_ino {
+    dev_t dev;
+    ino_t ino;
+};
+
+struct inode_set {
+    struct dev_ino *slots;    // (0, 0) marks an empty slot
+    size_t cap, count;        // cap is a power of two
+    int has_zero;             // the (0, 0) key itself, kept out of band
+};
+
+// --sizes: cumulative totals of a directory's subtree
+struct dir_totals {
+    unsigned long long apparent;   // sum of st_size
+    unsigned long long allocated;  // sum of st_blocks * 512
+    unsigned long long files;      // non-directory entries
+};
+
+// --memory-limit: a table's listed entries, as sorted runs in a temp file
+struct spill_segment {
+    uint64_t off, len;
+};
+
+struct ls_spill {
+    int fd;                   // unlinked temp file, -1 until the first run
+    uint64_t end;
+    struct spill_segment *runs;
+    int nruns, runs_cap;
+    size_t budget;
+    size_t shown_bytes;       // names of the listed entries still in memory
+    int count;                // entries in the runs, for the column layouts
+    struct dir_totals totals; // --sizes: the spilled singly-linked files
+    int failed;               // a write failed; the rest stays in memory
+    int err_fd;               // the opts' diagnostics fd
+};
+
+// -R walk: worker threads scan directories into dir_nodes ahead of the
+// printer, which consumes them strictly in listing order.
+enum node_state { NODE_QUEUED, NODE_SCANNING, NODE_SCANNED };
+
+struct dir_node {
+    char *path;
+    struct dir_node *parent;
+    enum node_state state;
+    int err;                  // errno from opendir(), reported in output order
+    struct ls_table tab;
+    struct dir_node **children;    // subdirectories to descend, in name order
+    int child_count;
+    int pending;              // own scan + unfinished child subtrees
+    struct dir_totals totals; // final once pending drops to 0
+    struct dir_totals linked; // multiply-linked files, counted by the printer
+    int revisit;              // -L reached a directory already listed
+    int late;                 // not read: --deadline had passed (err is set too)
+    int cache_hit;            // names came from opts->cache or opts->index
+    uint32_t export_id;       // --export: its dictionary id, for its children
+};
+
+// Writes one -l row or record; one is stamped out per combination of the
+// options that shape a row, and a listing picks its own once (see
+// pick_row_emitter)
+typedef void (*row_emitter)(struct ls_out *out, const char *dirname, const struct ls_entry *e,
+                            const char *hash);
+
+// Writes one name of the column layouts, padded to width; stamped out with
+// and without colors and picked once per listing too (see pick_name_cell)
+typedef void (*cell_emitter)(struct ls_out *out, const struct ls_entry *e, int width);
+
+// Scanned-but-unprinted tables a worker may run ahead by
+#define MAX_UNPRINTED 256
+
+struct walker {
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t node_done;
+    struct dir_node **stack;  // LIFO, so scanning follows the print order
+    int stack_len, stack_cap;
+    int unprinted;
+    int shutdown;
+
+    const struct ls_opts *opts;
+    struct ls_out *out;
+    int width;                // terminal width for the column layouts
+    row_emitter emit;         // -l rows or records, for these options
+    cell_emitter cell;        // names of the column layouts
+    dev_t root_dev;           // st_dev of the current operand
+    struct inode_set links;   // multiply-linked inodes already counted
+                              // (printer-only, so first-in-listing-order wins)
+    struct inode_set visited; // directories entered, for -L cycle detection
+    struct ls_stats stats;
+
+    pthread_t *threads;
+    int thread_count;
+    int max_unprinted;        // run-ahead limit, MAX_UNPRINTED unless --memory-limit
+    size_t table_budget;      // --memory-limit share of one table; 0 = no limit
+
+    struct watch *keep;       // --watch: tables are handed over, not printed
+    int aborted;              // output failed: scan and list nothing more
+};
+
+static int compare_names(const void *a, const void *b);
+static uint64_t hash_devino(dev_t dev, ino_t ino);
+struct watch;
+static void watch_keep(struct watch *wt, struct dir_node *node);
+static void spill_run(struct ls_table *tab, const struct ls_opts *opts);
+static void spill_finish(struct ls_table *tab, const struct ls_opts *opts);
+static void spill_free(struct ls_spill *sp);
+
+// -------------------- Buffered Output --------------------
+void ls_out_init_fd(struct ls_out *o, int fd) {
+    memset(o, 0, sizeof(*o));
+    o->fd = fd;
+    o->cap = 1 << 16;
+    o->buf = malloc(o->cap);
+}
+
+void ls_out_init_mem(struct ls_out *o) {
+    memset(o, 0, sizeof(*o));
+    o->fd = -1;
+    o->grow = 1;
+    o->cap = 4096;
+    o->buf = malloc(o->cap);
+}
+
+void ls_out_init_buf(struct ls_out *o, char *buf, size_t cap) {
+    memset(o, 0, sizeof(*o));
+    o->fd = -1;
+    o->buf = buf;
+    o->cap = cap;
+}
+
+void ls_out_flush(struct ls_out *o) {
+    if (o->fd < 0) return;
+    size_t off = 0;
+    while (off < o->len && !o->err) {
+        ssize_t n = write(o->fd, o->buf + off, o->len - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            o->err = errno;
+            break;
+        }
+        off += n;
+    }
+    o->len = 0;
+}
+
+void ls_out_write(struct ls_out *o, const char *p, size_t n) {
+    if (o->len + n > o->cap) {
+        if (o->fd >= 0) {
+            ls_out_flush(o);
+            if (n > o->cap) {
+                // larger than the whole buffer: hand it straight to write()
+                char *saved = o->buf;
+                o->buf = (char *)p;
+                o->len = n;
+                ls_out_flush(o);
+                o->buf = saved;
+                return;
+            }
+        } else if (o->grow) {
+            while (o->len + n > o->cap) o->cap *= 2;
+            o->buf = realloc(o->buf, o->cap);
+        } else {
+            size_t fit = o->cap - o->len;
+            memcpy(o->buf + o->len, p, fit);
+            o->len += fit;
+            o->dropped += n - fit;
+            return;
+        }
+    }
+    memcpy(o->buf + o->len, p, n);
+    o->len += n;
+}
+
+void ls_out_putc(struct ls_out *o, char c) {
+    if (o->len < o->cap) o->buf[o->len++] = c;
+    else ls_out_write(o, &c, 1);
+}
+
+void ls_out_puts(struct ls_out *o, const char *s) {
+    ls_out_write(o, s, strlen(s));
+}
+
+// Formats straight into the buffer; only output that doesn't fit takes a detour
+void ls_out_printf(struct ls_out *o, const char *fmt, ...) {
+    va_list ap;
+    if (o->fd >= 0 && o->cap - o->len < 512) ls_out_flush(o);
+    size_t room = o->cap - o->len;
+    va_start(ap, fmt);
+    int n = vsnprintf(room ? o->buf + o->len : NULL, room, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n < room) {
+        o->len += n;
+        return;
+    }
+    char *tmp = malloc(n + 1);
+    va_start(ap, fmt);
+    vsnprintf(tmp, n + 1, fmt, ap);
+    va_end(ap);
+    ls_out_write(o, tmp, n);
+    free(tmp);
+}
+
+void ls_out_free(struct ls_out *o) {
+    if (o->fd >= 0 || o->grow) free(o->buf);
+    o->buf = NULL;
+    o->len = o->cap = 0;
+}
+
+// -------------------- Name Scan --------------------
+// Each name is read once, as it comes off readdir(), for its length and the
+// LS_NAME_* flags; filters, layouts, colors and record escaping reuse those.
+// The x86 versions take 16 or 32 bytes a step with aligned loads, which
+// never cross into the next page, so reading the block around the start
+// and past the NUL is safe; the widest the CPU has is picked on first use.
+typedef size_t (*name_scan_fn)(const char *s, unsigned *flags);
+
+static size_t name_scan_scalar(const char *s, unsigned *flags) {
+    const unsigned char *p = (const unsigned char *)s;
+    unsigned f = 0;
+    for (; *p; p++) {
+        if (*p < 0x20 || *p == 0x7f) f |= LS_NAME_CTRL;
+        else if (*p >= 0x80) f |= LS_NAME_HIGH;
+        else if (*p == '"' || *p == '\\') f |= LS_NAME_QUOTE;
+    }
+    *flags = f;
+    return p - (const unsigned char *)s;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static size_t name_scan_sse2(const char *s, unsigned *flags) {
+    unsigned skip = (uintptr_t)s & 15;
+    const __m128i *p = (const __m128i *)(s - skip);
+    const __m128i zero = _mm_setzero_si128(), c1f = _mm_set1_epi8(0x1f);
+    const __m128i del = _mm_set1_epi8(0x7f), dq = _mm_set1_epi8('"'), bs = _mm_set1_epi8('\\');
+    unsigned live = 0xffffu << skip, f = 0;
+    for (;; p++, live = 0xffffu) {
+        __m128i v = _mm_load_si128(p);
+        unsigned nul = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & live;
+        unsigned in = nul ? live & ((nul & -nul) - 1) : live;
+        unsigned ctrl = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, c1f), c1f),
+                                                       _mm_cmpeq_epi8(v, del)));
+        unsigned quote = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, dq), _mm_cmpeq_epi8(v, bs)));
+        if (ctrl & in) f |= LS_NAME_CTRL;
+        if (_mm_movemask_epi8(v) & in) f |= LS_NAME_HIGH;
+        if (quote & in) f |= LS_NAME_QUOTE;
+        if (nul) {
+            *flags = f;
+            return (const char *)p + __builtin_ctz(nul) - s;
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static size_t name_scan_avx2(const char *s, unsigned *flags) {
+    unsigned skip = (uintptr_t)s & 31;
+    const __m256i *p = (const __m256i *)(s - skip);
+    const __m256i zero = _mm256_setzero_si256(), c1f = _mm256_set1_epi8(0x1f);
+    const __m256i del = _mm256_set1_epi8(0x7f), dq = _mm256_set1_epi8('"');
+    const __m256i bs = _mm256_set1_epi8('\\');
+    unsigned live = 0xffffffffu << skip, f = 0;
+    for (;; p++, live = 0xffffffffu) {
+        __m256i v = _mm256_load_si256(p);
+        unsigned nul = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)) & live;
+        unsigned in = nul ? live & ((nul & -nul) - 1) : live;
+        unsigned ctrl = _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(v, c1f), c1f), _mm256_cmpeq_epi8(v, del)));
+        unsigned quote = _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, dq), _mm256_cmpeq_epi8(v, bs)));
+        if (ctrl & in) f |= LS_NAME_CTRL;
+        if ((unsigned)_mm256_movemask_epi8(v) & in) f |= LS_NAME_HIGH;
+        if (quote & in) f |= LS_NAME_QUOTE;
+        if (nul) {
+            *flags = f;
+            return (const char *)p + __builtin_ctz(nul) - s;
+        }
+    }
+}
+#endif
+
+static size_t name_scan_pick(const char *s, unsigned *flags);
+static _Atomic(name_scan_fn) name_scan_impl = name_scan_pick;
+
+static size_t name_scan_pick(const char *s, unsigned *flags) {
+    name_scan_fn fn = name_scan_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) fn = name_scan_avx2;
+    else if (__builtin_cpu_supports("sse2")) fn = name_scan_sse2;
+#endif
+    atomic_store_explicit(&name_scan_impl, fn, memory_order_relaxed);
+    return fn(s, flags);
+}
+
+static size_t name_scan(const char *s, unsigned *flags) {
+    return atomic_load_explicit(&name_scan_impl, memory_order_relaxed)(s, flags);
+}
+
+// Fills in name_len and name_flags for an entry whose name was set without
+// a scan; names too long for name_len stay unscanned
+static void entry_scan_name(struct ls_entry *e) {
+    unsigned flags;
+    size_t len = name_scan(e->name, &flags);
+    e->name_len = len <= USHRT_MAX ? len : 0;
+    e->name_flags = flags;
+    e->name_width = 0;
+}
+
+static size_t entry_name_len(const struct ls_entry *e) {
+    return e->name_len ? e->name_len : strlen(e->name);
+}
+
+// -------------------- Display Width --------------------
+// Names are taken to be UTF-8, and the column layouts need their width on
+// the terminal rather than in bytes: CJK and most emoji take two columns,
+// combining marks none. A name the scan found to be plain ASCII (nearly all
+// of them) is as wide as it is long; the rest are decoded once by the
+// layout pass and their width kept in the entry. Control characters and
+// bytes that are not UTF-8 are shown as '?', one column each, so that no
+// name can move the cursor or break the alignment.
+struct width_range {
+    uint32_t first, last;
+};
+
+// Combining marks, zero-width and format characters, Hangul medial and
+// final jamo, variation selectors and tags
+static const struct width_range zero_width[] = {
+    { 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd }, { 0x05bf, 0x05bf },
+    { 0x05c1, 0x05c2 }, { 0x05c4, 0x05c5 }, { 0x05c7, 0x05c7 }, { 0x0600, 0x0605 },
+    { 0x0610, 0x061a }, { 0x061c, 0x061c }, { 0x064b, 0x065f }, { 0x0670, 0x0670 },
+    { 0x06d6, 0x06dd }, { 0x06df, 0x06e4 }, { 0x06e7, 0x06e8 }, { 0x06ea, 0x06ed },
+    { 0x070f, 0x070f }, { 0x0711, 0x0711 }, { 0x0730, 0x074a }, { 0x07a6, 0x07b0 },
+    { 0x07eb, 0x07f3 }, { 0x0816, 0x082d }, { 0x0859, 0x085b }, { 0x08d3, 0x0902 },
+    { 0x093a, 0x093a }, { 0x093c, 0x093c }, { 0x0941, 0x0948 }, { 0x094d, 0x094d },
+    { 0x0951, 0x0957 }, { 0x0962, 0x0963 }, { 0x0981, 0x0981 }, { 0x09bc, 0x09bc },
+    { 0x09c1, 0x09c4 }, { 0x09cd, 0x09cd }, { 0x09e2, 0x09e3 }, { 0x0a01, 0x0a02 },
+    { 0x0a3c, 0x0a3c }, { 0x0a41, 0x0a51 }, { 0x0a70, 0x0a71 }, { 0x0a75, 0x0a75 },
+    { 0x0a81, 0x0a82 }, { 0x0abc, 0x0abc }, { 0x0ac1, 0x0ac8 }, { 0x0acd, 0x0acd },
+    { 0x0ae2, 0x0ae3 }, { 0x0b01, 0x0b01 }, { 0x0b3c, 0x0b3c }, { 0x0b3f, 0x0b3f },
+    { 0x0b41, 0x0b44 }, { 0x0b4d, 0x0b4d }, { 0x0b56, 0x0b56 }, { 0x0b62, 0x0b63 },
+    { 0x0b82, 0x0b82 }, { 0x0bc0, 0x0bc0 }, { 0x0bcd, 0x0bcd }, { 0x0c00, 0x0c00 },
+    { 0x0c3e, 0x0c40 }, { 0x0c46, 0x0c56 }, { 0x0c62, 0x0c63 }, { 0x0cbc, 0x0cbc },
+    { 0x0cbf, 0x0cbf }, { 0x0cc6, 0x0cc6 }, { 0x0ccc, 0x0ccd }, { 0x0ce2, 0x0ce3 },
+    { 0x0d00, 0x0d01 }, { 0x0d41, 0x0d44 }, { 0x0d4d, 0x0d4d }, { 0x0d62, 0x0d63 },
+    { 0x0dca, 0x0dca }, { 0x0dd2, 0x0dd6 }, { 0x0e31, 0x0e31 }, { 0x0e34, 0x0e3a },
+    { 0x0e47, 0x0e4e }, { 0x0eb1, 0x0eb1 }, { 0x0eb4, 0x0ebc }, { 0x0ec8, 0x0ecd },
+    { 0x0f18, 0x0f19 }, { 0x0f35, 0x0f35 }, { 0x0f37, 0x0f37 }, { 0x0f39, 0x0f39 },
+    { 0x0f71, 0x0f7e }, { 0x0f80, 0x0f84 }, { 0x0f86, 0x0f87 }, { 0x0f8d, 0x0fbc },
+    { 0x0fc6, 0x0fc6 }, { 0x102d, 0x1030 }, { 0x1032, 0x1037 }, { 0x1039, 0x103a },
+    { 0x103d, 0x103e }, { 0x1058, 0x1059 }, { 0x105e, 0x1060 }, { 0x1071, 0x1074 },
+    { 0x1082, 0x1082 }, { 0x1085, 0x1086 }, { 0x108d, 0x108d }, { 0x109d, 0x109d },
+    { 0x1160, 0x11ff }, { 0x135d, 0x135f }, { 0x1712, 0x1714 }, { 0x1732, 0x1734 },
+    { 0x1752, 0x1753 }, { 0x1772, 0x1773 }, { 0x17b4, 0x17b5 }, { 0x17b7, 0x17bd },
+    { 0x17c6, 0x17c6 }, { 0x17c9, 0x17d3 }, { 0x17dd, 0x17dd }, { 0x180b, 0x180e },
+    { 0x18a9, 0x18a9 }, { 0x1920, 0x1922 }, { 0x1927, 0x1928 }, { 0x1932, 0x1932 },
+    { 0x1939, 0x193b }, { 0x1a17, 0x1a18 }, { 0x1ab0, 0x1aff }, { 0x1b00, 0x1b03 },
+    { 0x1b34, 0x1b34 }, { 0x1b36, 0x1b3a }, { 0x1b6b, 0x1b73 }, { 0x1dc0, 0x1dff },
+    { 0x200b, 0x200f }, { 0x202a, 0x202e }, { 0x2060, 0x2064 }, { 0x2066, 0x206f },
+    { 0x20d0, 0x20f0 }, { 0x2cef, 0x2cf1 }, { 0x2d7f, 0x2d7f }, { 0x2de0, 0x2dff },
+    { 0x302a, 0x302d }, { 0x3099, 0x309a }, { 0xa66f, 0xa672 }, { 0xa674, 0xa67d },
+    { 0xa69e, 0xa69f }, { 0xa6f0, 0xa6f1 }, { 0xa802, 0xa802 }, { 0xa806, 0xa806 },
+    { 0xa80b, 0xa80b }, { 0xa825, 0xa826 }, { 0xa8c4, 0xa8c5 }, { 0xa8e0, 0xa8f1 },
+    { 0xa926, 0xa92d }, { 0xa947, 0xa951 }, { 0xa980, 0xa982 }, { 0xa9b3, 0xa9b3 },
+    { 0xa9b6, 0xa9b9 }, { 0xa9bc, 0xa9bd }, { 0xaa29, 0xaa2e }, { 0xaab0, 0xaab0 },
+    { 0xaab2, 0xaab4 }, { 0xaab7, 0xaab8 }, { 0xaabe, 0xaabf }, { 0xaac1, 0xaac1 },
+    { 0xabe5, 0xabe5 }, { 0xabe8, 0xabe8 }, { 0xabed, 0xabed }, { 0xd7b0, 0xd7ff },
+    { 0xfb1e, 0xfb1e }, { 0xfe00, 0xfe0f }, { 0xfe20, 0xfe2f }, { 0xfeff, 0xfeff },
+    { 0xfff9, 0xfffb }, { 0x101fd, 0x101fd }, { 0x10a01, 0x10a0f }, { 0x10a38, 0x10a3f },
+    { 0x11001, 0x11001 }, { 0x11038, 0x11046 }, { 0x1107f, 0x11081 }, { 0x110b3, 0x110b6 },
+    { 0x110b9, 0x110ba }, { 0x1d167, 0x1d169 }, { 0x1d173, 0x1d182 }, { 0x1d185, 0x1d18b },
+    { 0x1d1aa, 0x1d1ad }, { 0x1d242, 0x1d244 }, { 0x1e8d0, 0x1e8d6 }, { 0x1e944, 0x1e94a },
+    { 0xe0001, 0xe0001 }, { 0xe0020, 0xe007f }, { 0xe0100, 0xe01ef },
+};
+
+// East Asian Wide and Fullwidth, and the emoji terminals draw wide
+static const struct width_range double_width[] = {
+    { 0x1100, 0x115f }, { 0x231a, 0x231b }, { 0x2329, 0x232a }, { 0x23e9, 0x23ec },
+    { 0x23f0, 0x23f0 }, { 0x23f3, 0x23f3 }, { 0x25fd, 0x25fe }, { 0x2614, 0x2615 },
+    { 0x2648, 0x2653 }, { 0x267f, 0x267f }, { 0x2693, 0x2693 }, { 0x26a1, 0x26a1 },
+    { 0x26aa, 0x26ab }, { 0x26bd, 0x26be }, { 0x26c4, 0x26c5 }, { 0x26ce, 0x26ce },
+    { 0x26d4, 0x26d4 }, { 0x26ea, 0x26ea }, { 0x26f2, 0x26f3 }, { 0x26f5, 0x26f5 },
+    { 0x26fa, 0x26fa }, { 0x26fd, 0x26fd }, { 0x2705, 0x2705 }, { 0x270a, 0x270b },
+    { 0x2728, 0x2728 }, { 0x274c, 0x274c }, { 0x274e, 0x274e }, { 0x2753, 0x2755 },
+    { 0x2757, 0x2757 }, { 0x2795, 0x2797 }, { 0x27b0, 0x27b0 }, { 0x27bf, 0x27bf },
+    { 0x2b1b, 0x2b1c }, { 0x2b50, 0x2b50 }, { 0x2b55, 0x2b55 }, { 0x2e80, 0x303e },
+    { 0x3041, 0x33ff }, { 0x3400, 0x4dbf }, { 0x4e00, 0x9fff }, { 0xa000, 0xa4cf },
+    { 0xa960, 0xa97f }, { 0xac00, 0xd7a3 }, { 0xf900, 0xfaff }, { 0xfe10, 0xfe19 },
+    { 0xfe30, 0xfe6f }, { 0xff00, 0xff60 }, { 0xffe0, 0xffe6 }, { 0x16fe0, 0x16fe4 },
+    { 0x17000, 0x18aff }, { 0x1b000, 0x1b2ff }, { 0x1f004, 0x1f004 }, { 0x1f0cf, 0x1f0cf },
+    { 0x1f18e, 0x1f18e }, { 0x1f191, 0x1f19a }, { 0x1f200, 0x1f202 }, { 0x1f210, 0x1f23b },
+    { 0x1f240, 0x1f248 }, { 0x1f250, 0x1f251 }, { 0x1f260, 0x1f265 }, { 0x1f300, 0x1f320 },
+    { 0x1f32d, 0x1f335 }, { 0x1f337, 0x1f37c }, { 0x1f37e, 0x1f393 }, { 0x1f3a0, 0x1f3ca },
+    { 0x1f3cf, 0x1f3d3 }, { 0x1f3e0, 0x1f3f0 }, { 0x1f3f4, 0x1f3f4 }, { 0x1f3f8, 0x1f43e },
+    { 0x1f440, 0x1f440 }, { 0x1f442, 0x1f4fc }, { 0x1f4ff, 0x1f53d }, { 0x1f54b, 0x1f54e },
+    { 0x1f550, 0x1f567 }, { 0x1f57a, 0x1f57a }, { 0x1f595, 0x1f596 }, { 0x1f5a4, 0x1f5a4 },
+    { 0x1f5fb, 0x1f64f }, { 0x1f680, 0x1f6c5 }, { 0x1f6cc, 0x1f6cc }, { 0x1f6d0, 0x1f6d2 },
+    { 0x1f6d5, 0x1f6d7 }, { 0x1f6eb, 0x1f6ec }, { 0x1f6f4, 0x1f6fc }, { 0x1f7e0, 0x1f7eb },
+    { 0x1f90c, 0x1f93a }, { 0x1f93c, 0x1f945 }, { 0x1f947, 0x1f9ff }, { 0x1fa70, 0x1faff },
+    { 0x20000, 0x2fffd }, { 0x30000, 0x3fffd },
+};
+
+#define NRANGES(r) (sizeof(r) / sizeof((r)[0]))
+
+static int in_ranges(const struct width_range *r, size_t n, uint32_t c) {
+    if (c < r[0].first || c > r[n - 1].last) return 0;
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (c > r[mid].last) lo = mid + 1;
+        else if (c < r[mid].first) hi = mid;
+        else return 1;
+    }
+    return 0;
+}
+
+// Decodes the character at s (n > 0 bytes left) into *c; returns its
+// length, or 0 if s does not start a well-formed sequence
+static int utf8_decode(const unsigned char *s, size_t n, uint32_t *c) {
+    unsigned b = s[0];
+    uint32_t min;
+    int len;
+    if (b < 0x80) {
+        *c = b;
+        return 1;
+    }
+    if (b < 0xc2) return 0;
+    if (b < 0xe0) len = 2, min = 0x80, *c = b & 0x1f;
+    else if (b < 0xf0) len = 3, min = 0x800, *c = b & 0x0f;
+    else if (b < 0xf5) len = 4, min = 0x10000, *c = b & 0x07;
+    else return 0;
+    if ((size_t)len > n) return 0;
+    for (int i = 1; i < len; i++) {
+        if ((s[i] & 0xc0) != 0x80) return 0;
+        *c = *c << 6 | (s[i] & 0x3f);
+    }
+    if (*c < min || *c > 0x10ffff || (*c >= 0xd800 && *c <= 0xdfff)) return 0;
+    return len;
+}
+
+// Columns one character takes; -1 if it is not printable
+static int char_width(uint32_t c) {
+    if (c < 0x20 || (c >= 0x7f && c < 0xa0)) return -1;
+    if (c < 0x300) return 1;
+    if (in_ranges(zero_width, NRANGES(zero_width), c)) return 0;
+    if (in_ranges(double_width, NRANGES(double_width), c)) return 2;
+    return 1;
+}
+
+// Walks a name as it is displayed, writing it to out if given: printable
+// characters as they are, and a '?' for each unprintable character or
+// stray byte. Returns its width in columns.
+static int name_display(const char *name, size_t len, struct ls_out *out) {
+    const unsigned char *s = (const unsigned char *)name;
+    size_t i = 0, run = 0;
+    int width = 0;
+    while (i < len) {
+        uint32_t c;
+        int n, w;
+        if (s[i] >= 0x20 && s[i] < 0x7f) {
+            i++;
+            width++;
+            continue;
+        }
+        if ((n = utf8_decode(s + i, len - i, &c)) == 0 || (w = char_width(c)) < 0) {
+            if (out) {
+                ls_out_write(out, name + run, i - run);
+                ls_out_putc(out, '?');
+            }
+            i += n ? n : 1;
+            run = i;
+            width++;
+            continue;
+        }
+        i += n;
+        width += w;
+    }
+    if (out) ls_out_write(out, name + run, len - run);
+    return width;
+}
+
+static int entry_plain(const struct ls_entry *e) {
+    return e->name_len && !(e->name_flags & (LS_NAME_CTRL | LS_NAME_HIGH));
+}
+
+static int entry_name_width(const struct ls_entry *e) {
+    if (entry_plain(e)) return e->name_len;
+    if (e->name_width) return e->name_width;
+    return name_display(e->name, entry_name_len(e), NULL);
+}
+
+// entry_name_width(), kept in the entry for the row pass that follows
+static int entry_measure(struct ls_entry *e) {
+    int width = entry_name_width(e);
+    if (!entry_plain(e) && width <= USHRT_MAX) e->name_width = width;
+    return width;
+}
+
+static void out_display_name(struct ls_out *out, const struct ls_entry *e) {
+    if (entry_plain(e)) ls_out_write(out, e->name, e->name_len);
+    else name_display(e->name, entry_name_len(e), out);
+}
+
+// -------------------- Colors --------------------
+// A color scheme is compiled once: escape sequences by file type, and the
+// "*suffix" patterns in a trie keyed on the name read backwards, so
+// classifying an entry is one walk from the end of its name however many
+// patterns the scheme has. The longest matching suffix wins, and suffixes
+// match regardless of ASCII case, as in GNU ls. Extensions are checked
+// before ex (the built-in scheme has always colored executable archives
+// as archives).
+enum color_type { COLOR_FILE, COLOR_DIR, COLOR_LINK, COLOR_FIFO, COLOR_SOCK, COLOR_BLK,
+                  COLOR_CHR, COLOR_EXEC, COLOR_SETUID, COLOR_SETGID, COLOR_STICKY,
+                  COLOR_OTHER_WRITABLE, COLOR_STICKY_OTHER_WRITABLE, COLOR_TYPES };
+
+static const char *const color_keys[COLOR_TYPES] = {
+    "fi", "di", "ln", "pi", "so", "bd", "cd", "ex", "su", "sg", "st", "ow", "tw"
+};
+
+struct suffix_node {
+    unsigned char c;
+    int child;                // first child, or -1
+    int sibling;              // next child of the same parent, or -1
+    char *seq;                // set where a suffix ends
+};
+
+struct color_scheme {
+    char *type_seq[COLOR_TYPES];   // whole escape sequences; NULL = uncolored
+    int root[256];                 // trie nodes for a name's last byte, or -1
+    struct suffix_node *nodes;
+    int count, cap;
+};
+
+static struct color_scheme *color_scheme;
+static pthread_once_t color_once = PTHREAD_ONCE_INIT;
+
+static unsigned char ascii_lower(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+static int suffix_node_new(struct color_scheme *cs, unsigned char c) {
+    if (cs->count == cs->cap) {
+        cs->cap = cs->cap ? cs->cap * 2 : 64;
+        cs->nodes = realloc(cs->nodes, sizeof(struct suffix_node) * cs->cap);
+    }
+    struct suffix_node *n = &cs->nodes[cs->count];
+    n->c = c;
+    n->child = n->sibling = -1;
+    n->seq = NULL;
+    return cs->count++;
+}
+
+static void suffix_insert(struct color_scheme *cs, const char *suffix, size_t len, char *seq) {
+    int parent = -1;
+    for (size_t i = len; i > 0; i--) {
+        unsigned char c = ascii_lower(suffix[i - 1]);
+        int k;
+        if (parent < 0) {
+            if ((k = cs->root[c]) < 0) k = cs->root[c] = suffix_node_new(cs, c);
+        } else {
+            k = cs->nodes[parent].child;
+            while (k >= 0 && cs->nodes[k].c != c) k = cs->nodes[k].sibling;
+            if (k < 0) {
+                k = suffix_node_new(cs, c);
+                cs->nodes[k].sibling = cs->nodes[parent].child;
+                cs->nodes[parent].child = k;
+            }
+        }
+        parent = k;
+    }
+    free(cs->nodes[parent].seq);   // a later definition wins
+    cs->nodes[parent].seq = seq;
+}
+
+// Compiles LS_COLORS syntax. Keys other than the type codes above and
+// "*suffix" patterns (rs, lc, or, mi, ...) are ignored, as is ln=target:
+// link targets are never stat'd.
+static struct color_scheme *color_compile(const char *spec) {
+    struct color_scheme *cs = calloc(1, sizeof(struct color_scheme));
+    memset(cs->root, -1, sizeof(cs->root));
+    const char *p = spec;
+    while (*p) {
+        const char *end = strchr(p, ':');
+        if (!end) end = p + strlen(p);
+        const char *eq = memchr(p, '=', end - p);
+        if (eq && eq > p) {
+            size_t klen = eq - p, vlen = end - eq - 1;
+            char *seq = NULL;
+            if (vlen && !(vlen == 6 && memcmp(eq + 1, "target", 6) == 0)) {
+                seq = malloc(vlen + 4);
+                sprintf(seq, "\033[%.*sm", (int)vlen, eq + 1);
+            }
+            if (p[0] == '*' && klen > 1) {
+                if (seq) suffix_insert(cs, p + 1, klen - 1, seq);
+            } else {
+                int t = 0;
+                while (t < COLOR_TYPES && !(klen == 2 && memcmp(p, color_keys[t], 2) == 0)) t++;
+                if (t < COLOR_TYPES) {
+                    free(cs->type_seq[t]);
+                    cs->type_seq[t] = seq;
+                } else {
+                    free(seq);
+                }
+            }
+        }
+        p = *end ? end + 1 : end;
+    }
+    return cs;
+}
+
+static void color_free(struct color_scheme *cs) {
+    if (!cs) return;
+    for (int t = 0; t < COLOR_TYPES; t++) free(cs->type_seq[t]);
+    for (int i = 0; i < cs->count; i++) free(cs->nodes[i].seq);
+    free(cs->nodes);
+    free(cs);
+}
+
+static void color_builtin(void) {
+    if (!color_scheme) color_scheme = color_compile(COLOR_BUILTIN);
+}
+
+void ls_colors_load(const char *spec) {
+    pthread_once(&color_once, color_builtin);
+    struct color_scheme *old = color_scheme;
+    color_scheme = color_compile(spec ? spec : COLOR_BUILTIN);
+    color_free(old);
+}
+
+// Sequence of the longest "*suffix" pattern the name ends with, or NULL
+static const char *suffix_color(const struct color_scheme *cs, const char *name, size_t len) {
+    const unsigned char *s = (const unsigned char *)name;
+    size_t i = len;
+    if (i == 0) return NULL;
+    const char *best = NULL;
+    int n = cs->root[ascii_lower(s[--i])];
+    while (n >= 0) {
+        if (cs->nodes[n].seq) best = cs->nodes[n].seq;
+        if (i == 0) break;
+        unsigned char c = ascii_lower(s[--i]);
+        n = cs->nodes[n].child;
+        while (n >= 0 && cs->nodes[n].c != c) n = cs->nodes[n].sibling;
+    }
+    return best;
+}
+
+// Escape sequence for an entry, or NULL to print it uncolored
+static const char *get_color(const struct ls_entry *e, const struct stat *st) {
+    pthread_once(&color_once, color_builtin);
+    const struct color_scheme *cs = color_scheme;
+    mode_t m = st->st_mode;
+    const char *seq = NULL;
+
+    if (S_ISDIR(m)) {
+        if ((m & S_ISVTX) && (m & S_IWOTH)) seq = cs->type_seq[COLOR_STICKY_OTHER_WRITABLE];
+        else if (m & S_IWOTH) seq = cs->type_seq[COLOR_OTHER_WRITABLE];
+        else if (m & S_ISVTX) seq = cs->type_seq[COLOR_STICKY];
+        return seq ? seq : cs->type_seq[COLOR_DIR];
+    }
+    if (S_ISLNK(m)) return cs->type_seq[COLOR_LINK];
+    // special files without a color of their own are colored as files
+    if (S_ISFIFO(m)) seq = cs->type_seq[COLOR_FIFO];
+    else if (S_ISSOCK(m)) seq = cs->type_seq[COLOR_SOCK];
+    else if (S_ISBLK(m)) seq = cs->type_seq[COLOR_BLK];
+    else if (S_ISCHR(m)) seq = cs->type_seq[COLOR_CHR];
+    if (seq) return seq;
+
+    if ((m & S_ISUID) && (seq = cs->type_seq[COLOR_SETUID])) return seq;
+    if ((m & S_ISGID) && (seq = cs->type_seq[COLOR_SETGID])) return seq;
+    if ((seq = suffix_color(cs, e->name, entry_name_len(e)))) return seq;
+    if ((m & (S_IXUSR | S_IXGRP | S_IXOTH)) && (seq = cs->type_seq[COLOR_EXEC])) return seq;
+    return cs->type_seq[COLOR_FILE];
+}
+
+// mark is the --xattrs suffix (see attr_mark), or 0 for none
+static void print_permissions(struct ls_out *out, mode_t mode, char mark) {
+    char perms[12] = "----------";
+
+    if (S_ISDIR(mode)) perms[0] = 'd';
+    else if (S_ISLNK(mode)) perms[0] = 'l';
+    else if (S_ISCHR(mode)) perms[0] = 'c';
+    else if (S_ISBLK(mode)) perms[0] = 'b';
+    else if (S_ISFIFO(mode)) perms[0] = 'p';
+    else if (S_ISSOCK(mode)) perms[0] = 's';
+
+    if (mode & S_IRUSR) perms[1] = 'r';
+    if (mode & S_IWUSR) perms[2] = 'w';
+    if (mode & S_IXUSR) perms[3] = 'x';
+    if (mode & S_IRGRP) perms[4] = 'r';
+    if (mode & S_IWGRP) perms[5] = 'w';
+    if (mode & S_IXGRP) perms[6] = 'x';
+    if (mode & S_IROTH) perms[7] = 'r';
+    if (mode & S_IWOTH) perms[8] = 'w';
+    if (mode & S_IXOTH) perms[9] = 'x';
+
+    perms[10] = mark;
+    ls_out_write(out, perms, mark ? 11 : 10);
+    ls_out_putc(out, ' ');
+}
+
+// -------------------- Owner/Group Names --------------------
+// getpwuid()/getgrgid() go through NSS on every call; a listing only ever
+// sees a handful of distinct ids, so names are looked up once per process.
+struct id_slot {
+    unsigned id;
+    int used;
+    char *name;
+};
+
+struct id_cache {
+    pthread_mutex_t lock;
+    struct id_slot *slots;
+    size_t cap, count;
+};
+
+static struct id_cache user_cache = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+static struct id_cache group_cache = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+
+static struct id_slot *id_cache_slot(struct id_cache *c, unsigned id) {
+    if (c->count * 2 >= c->cap) {
+        size_t old_cap = c->cap;
+        struct id_slot *old = c->slots;
+        c->cap = old_cap ? old_cap * 2 : 64;
+        c->slots = calloc(c->cap, sizeof(struct id_slot));
+        c->count = 0;
+        for (size_t i = 0; i < old_cap; i++) {
+            if (!old[i].used) continue;
+            *id_cache_slot(c, old[i].id) = old[i];
+            c->count++;
+        }
+        free(old);
+    }
+    size_t mask = c->cap - 1;
+    size_t i = (id * 2654435761u) & mask;
+    while (c->slots[i].used && c->slots[i].id != id) i = (i + 1) & mask;
+    return &c->slots[i];
+}
+
+const char *ls_user_name(uid_t uid) {
+    pthread_mutex_lock(&user_cache.lock);
+    struct id_slot *slot = id_cache_slot(&user_cache, uid);
+    if (!slot->used) {
+        struct passwd *pw = getpwuid(uid);
+        slot->id = uid;
+        slot->used = 1;
+        slot->name = strdup(pw ? pw->pw_name : "unknown");
+        user_cache.count++;
+    }
+    const char *name = slot->name;
+    pthread_mutex_unlock(&user_cache.lock);
+    return name;
+}
+
+const char *ls_group_name(gid_t gid) {
+    pthread_mutex_lock(&group_cache.lock);
+    struct id_slot *slot = id_cache_slot(&group_cache, gid);
+    if (!slot->used) {
+        struct group *gr = getgrgid(gid);
+        slot->id = gid;
+        slot->used = 1;
+        slot->name = strdup(gr ? gr->gr_name : "unknown");
+        group_cache.count++;
+    }
+    const char *name = slot->name;
+    pthread_mutex_unlock(&group_cache.lock);
+    return name;
+}
+
+static void id_cache_flush(struct id_cache *c) {
+    pthread_mutex_lock(&c->lock);
+    for (size_t i = 0; i < c->cap; i++) free(c->slots[i].name);
+    free(c->slots);
+    c->slots = NULL;
+    c->cap = c->count = 0;
+    pthread_mutex_unlock(&c->lock);
+}
+
+void ls_id_cache_flush(void) {
+    id_cache_flush(&user_cache);
+    id_cache_flush(&group_cache);
+}
+
+// -------------------- Name Filters --------------------
+static int has_glob_meta(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\') return 1;
+    return 0;
+}
+
+void ls_matcher_add(struct ls_matcher *m, const char *glob) {
+    if (m->count == m->cap) {
+        m->cap = m->cap ? m->cap * 2 : 8;
+        m->pats = realloc(m->pats, sizeof(struct ls_pattern) * m->cap);
+    }
+    struct ls_pattern *p = &m->pats[m->count++];
+    size_t len = strlen(glob);
+
+    if (!has_glob_meta(glob, len)) {
+        p->kind = LS_PAT_LITERAL; p->text = strdup(glob); p->len = len;
+    } else if (glob[0] == '*' && !has_glob_meta(glob + 1, len - 1)) {
+        p->kind = LS_PAT_SUFFIX; p->text = strdup(glob + 1); p->len = len - 1;
+    } else if (glob[len - 1] == '*' && !has_glob_meta(glob, len - 1)) {
+        p->kind = LS_PAT_PREFIX; p->text = strndup(glob, len - 1); p->len = len - 1;
+    } else {
+        p->kind = LS_PAT_GLOB; p->text = strdup(glob); p->len = len;
+    }
+}
+
+int ls_matcher_match(const struct ls_matcher *m, const char *name, size_t name_len) {
+    for (int i = 0; i < m->count; i++) {
+        const struct ls_pattern *p = &m->pats[i];
+        switch (p->kind) {
+            case LS_PAT_LITERAL:
+                if (name_len == p->len && memcmp(name, p->text, name_len) == 0) return 1;
+                break;
+            case LS_PAT_PREFIX:
+                if (name_len >= p->len && memcmp(name, p->text, p->len) == 0) return 1;
+                break;
+            case LS_PAT_SUFFIX:
+                if (name_len >= p->len && memcmp(name + name_len - p->len, p->text, p->len) == 0) return 1;
+                break;
+            case LS_PAT_GLOB:
+                if (fnmatch(p->text, name, 0) == 0) return 1;
+                break;
+        }
+    }
+    return 0;
+}
+
+void ls_matcher_free(struct ls_matcher *m) {
+    for (int i = 0; i < m->count; i++) free(m->pats[i].text);
+    free(m->pats);
+    memset(m, 0, sizeof(*m));
+}
+
+// -------------------- Options --------------------
+void ls_opts_init(struct ls_opts *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->display = LS_COLUMNS;
+    opts->format = LS_FORMAT_HUMAN;
+    opts->color = 1;
+    // scanning is I/O bound, so more threads than this rarely pay off
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    opts->threads = cpus < 1 ? 1 : cpus > 8 ? 8 : (int)cpus;
+    opts->err_fd = STDERR_FILENO;
+}
+
+void ls_opts_free(struct ls_opts *opts) {
+    ls_matcher_free(&opts->include);
+    ls_matcher_free(&opts->exclude);
+    ls_matcher_free(&opts->prune);
+}
+
+// -------------------- Directory Cache --------------------
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | \
+                    IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct ls_cache_dir {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime, ctime;  // the directory's, when it was read
+    int wd;                   // inotify watch, -1 if none: names only
+    unsigned long since;      // the cache's event count before the watch was added
+    struct ls_entry *raw;     // every non-dot name in name order, stats as taken
+    int count;
+    struct ls_cache_dir *next;     // hash chain
+};
+
+struct ls_cache {
+    pthread_mutex_t lock;
+    struct ls_cache_dir **buckets;  // by (dev, ino)
+    size_t nbuckets, ndirs;
+    size_t entries, max_entries;
+    int inotify_fd;
+    struct ls_cache_dir **by_wd;    // watch descriptor -> record
+    unsigned long *wd_event;        // watch descriptor -> number of its last event
+    int by_wd_cap;
+    unsigned long events;           // events read so far
+    unsigned long overflow;         // number of the last queue overflow
+};
+
+struct ls_cache *ls_cache_new(size_t max_entries) {
+    struct ls_cache *c = calloc(1, sizeof(struct ls_cache));
+    pthread_mutex_init(&c->lock, NULL);
+    c->nbuckets = 1024;
+    c->buckets = calloc(c->nbuckets, sizeof(struct ls_cache_dir *));
+    c->max_entries = max_entries;
+    c->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    return c;
+}
+
+int ls_cache_fd(const struct ls_cache *c) {
+    return c->inotify_fd;
+}
+
+static void cache_dir_free(struct ls_cache_dir *cd) {
+    for (int i = 0; i < cd->count; i++) free(cd->raw[i].name);
+    free(cd->raw);
+    free(cd);
+}
+
+static struct ls_cache_dir **cache_bucket(struct ls_cache *c, dev_t dev, ino_t ino) {
+    return &c->buckets[hash_devino(dev, ino) & (c->nbuckets - 1)];
+}
+
+// Unlinks and frees a record, leaving its watch alone; lock held
+static void cache_drop(struct ls_cache *c, struct ls_cache_dir *cd) {
+    struct ls_cache_dir **pp = cache_bucket(c, cd->dev, cd->ino);
+    while (*pp != cd) pp = &(*pp)->next;
+    *pp = cd->next;
+    if (cd->wd >= 0 && cd->wd < c->by_wd_cap && c->by_wd[cd->wd] == cd) c->by_wd[cd->wd] = NULL;
+    c->entries -= cd->count;
+    c->ndirs--;
+    cache_dir_free(cd);
+}
+
+// Drops every record and watch except keep_wd; lock held
+static void cache_clear_locked(struct ls_cache *c, int keep_wd) {
+    for (size_t i = 0; i < c->nbuckets; i++) {
+        while (c->buckets[i]) {
+            struct ls_cache_dir *cd = c->buckets[i];
+            if (cd->wd >= 0 && cd->wd != keep_wd) inotify_rm_watch(c->inotify_fd, cd->wd);
+            cache_drop(c, cd);
+        }
+    }
+}
+
+void ls_cache_clear(struct ls_cache *c) {
+    pthread_mutex_lock(&c->lock);
+    cache_clear_locked(c, -1);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void ls_cache_free(struct ls_cache *c) {
+    if (!c) return;
+    ls_cache_clear(c);
+    if (c->inotify_fd >= 0) close(c->inotify_fd);
+    free(c->buckets);
+    free(c->by_wd);
+    free(c->wd_event);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+// Makes room for watch descriptor wd in by_wd and wd_event; lock held
+static void cache_grow_wd(struct ls_cache *c, int wd) {
+    if (wd < c->by_wd_cap) return;
+    int old_cap = c->by_wd_cap;
+    c->by_wd_cap = (wd + 1) * 2;
+    c->by_wd = realloc(c->by_wd, sizeof(struct ls_cache_dir *) * c->by_wd_cap);
+    c->wd_event = realloc(c->wd_event, sizeof(unsigned long) * c->by_wd_cap);
+    memset(c->by_wd + old_cap, 0, sizeof(struct ls_cache_dir *) * (c->by_wd_cap - old_cap));
+    memset(c->wd_event + old_cap, 0, sizeof(unsigned long) * (c->by_wd_cap - old_cap));
+}
+
+// Any event on a watched directory retires its record and watch. Records
+// still being filled are not in by_wd yet, so each event is also numbered
+// against its watch for cache_store() to check; lock held.
+static void cache_drain_locked(struct ls_cache *c) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(c->inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            c->events++;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // events were lost, so no record can be vouched for
+                c->overflow = c->events;
+                cache_clear_locked(c, -1);
+                continue;
+            }
+            if (ev->wd < 0) continue;
+            cache_grow_wd(c, ev->wd);
+            c->wd_event[ev->wd] = c->events;
+            if (!c->by_wd[ev->wd]) continue;
+            if (!(ev->mask & IN_IGNORED)) inotify_rm_watch(c->inotify_fd, ev->wd);
+            cache_drop(c, c->by_wd[ev->wd]);
+        }
+    }
+}
+
+void ls_cache_drain(struct ls_cache *c) {
+    if (c->inotify_fd < 0) return;
+    pthread_mutex_lock(&c->lock);
+    cache_drain_locked(c);
+    pthread_mutex_unlock(&c->lock);
+}
+
+static int same_time(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+// A directory changed within a second of being read may change again within
+// the same timestamp tick, so its stamp can't vouch for what was read
+static int stamp_is_recent(const struct timespec *mtime, const struct timespec *ctime) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return mtime->tv_sec >= now.tv_sec - 1 || ctime->tv_sec >= now.tv_sec - 1;
+}
+
+// Fills a table with every name of an unchanged directory and returns 1
+static int cache_fill(struct ls_cache *c, struct ls_table *tab, const struct stat *dst) {
+    pthread_mutex_lock(&c->lock);
+    struct ls_cache_dir *cd = *cache_bucket(c, dst->st_dev, dst->st_ino);
+    while (cd && !(cd->dev == dst->st_dev && cd->ino == dst->st_ino)) cd = cd->next;
+    if (cd && same_time(&cd->mtime, &dst->st_mtim) && same_time(&cd->ctime, &dst->st_ctim)) {
+        tab->entries = malloc(sizeof(struct ls_entry) * (cd->count + 1));
+        tab->cap = cd->count + 1;
+        for (int i = 0; i < cd->count; i++) {
+            struct ls_entry *e = &tab->entries[i];
+            *e = cd->raw[i];
+            e->name = strdup(cd->raw[i].name);
+            // stats are only as good as the watch; -L stats are the targets'
+            if (cd->wd < 0 || tab->follow) e->stat_state = 0;
+        }
+        tab->count = cd->count;
+        pthread_mutex_unlock(&c->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+// Snapshots the names just read into the pending record
+static void cache_capture(struct ls_table *tab) {
+    struct ls_cache_dir *cd = tab->fill;
+    cd->raw = malloc(sizeof(struct ls_entry) * (tab->count + 1));
+    cd->count = tab->count;
+    for (int i = 0; i < tab->count; i++) {
+        cd->raw[i] = tab->entries[i];
+        cd->raw[i].name = strdup(tab->entries[i].name);
+    }
+    qsort(cd->raw, cd->count, sizeof(struct ls_entry), compare_names);
+}
+
+// Completes a pending record with the stats the scan took and publishes
+// it, replacing any stale record for the same directory
+static void cache_store(struct ls_cache *c, struct ls_table *tab, struct ls_cache_dir *cd) {
+    // Events for a file reach only the directory it was reached through, and
+    // a subdirectory's own changes never reach its parent, so only the stats
+    // of singly-linked non-directories can be vouched for by the watch
+    if (!tab->follow && cd->wd >= 0) {
+        for (int i = 0; i < tab->count; i++) {
+            struct ls_entry *e = &tab->entries[i];
+            if (e->stat_state != 1 || S_ISDIR(e->st.st_mode) || e->st.st_nlink != 1) continue;
+            struct ls_entry *r = bsearch(e, cd->raw, cd->count, sizeof(struct ls_entry), compare_names);
+            if (!r) continue;
+            r->st = e->st;
+            r->stat_state = 1;
+        }
+    }
+
+    // Without a watch only the timestamps guard the names
+    if (cd->wd < 0 && stamp_is_recent(&cd->mtime, &cd->ctime)) {
+        cache_dir_free(cd);
+        return;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    // another listing sharing the cache may have read the watch's events
+    // while this record was being filled
+    if (cd->wd >= 0) cache_drain_locked(c);
+    if ((size_t)cd->count > c->max_entries ||
+        (cd->wd >= 0 && (c->overflow > cd->since ||
+                         (cd->wd < c->by_wd_cap && c->wd_event[cd->wd] > cd->since)))) {
+        pthread_mutex_unlock(&c->lock);
+        cache_dir_free(cd);
+        return;
+    }
+    if (c->entries + cd->count > c->max_entries) cache_clear_locked(c, cd->wd);
+
+    struct ls_cache_dir **pp = cache_bucket(c, cd->dev, cd->ino);
+    for (struct ls_cache_dir *old = *pp; old; old = old->next) {
+        if (old->dev == cd->dev && old->ino == cd->ino) {
+            cache_drop(c, old);
+            break;
+        }
+    }
+    cd->next = *pp;
+    *pp = cd;
+    c->entries += cd->count;
+    c->ndirs++;
+    if (cd->wd >= 0) {
+        cache_grow_wd(c, cd->wd);
+        c->by_wd[cd->wd] = cd;
+    }
+
+    // keep chains short as the cache fills
+    if (c->ndirs > c->nbuckets) {
+        size_t old_n = c->nbuckets;
+        struct ls_cache_dir **old = c->buckets;
+        c->nbuckets *= 2;
+        c->buckets = calloc(c->nbuckets, sizeof(struct ls_cache_dir *));
+        for (size_t i = 0; i < old_n; i++) {
+            while (old[i]) {
+                struct ls_cache_dir *d = old[i];
+                old[i] = d->next;
+                struct ls_cache_dir **b = cache_bucket(c, d->dev, d->ino);
+                d->next = *b;
+                *b = d;
+            }
+        }
+        free(old);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+// -------------------- Directory Index --------------------
+// File layout: a header, then each directory's entries as a packed block
+// (8-byte d_ino, d_type, name length, name bytes), then the directory
+// table sorted by (dev, ino) so a mapped index can be searched in place.
+#define INDEX_MAGIC "LSIDX\0\0\1"
+
+struct index_header {
+    char magic[8];
+    uint64_t dirs_off;
+    uint64_t ndirs;
+};
+
+struct index_dir {
+    uint64_t dev, ino;
+    int64_t mtime_sec, mtime_nsec;
+    int64_t ctime_sec, ctime_nsec;
+    uint64_t off, len;        // entry block
+    uint64_t count;
+};
+
+struct ls_index {
+    // the previous run's index, mapped read-only (NULL if none or unusable)
+    const char *map;
+    size_t map_size;
+    const struct index_dir *dirs;
+    size_t ndirs;
+
+    // this run's index, written beside it and renamed over it on close
+    pthread_mutex_t lock;
+    char *path, *tmp_path;
+    FILE *out;
+    uint64_t pos;
+    struct index_dir *new_dirs;
+    size_t new_count, new_cap;
+    int err;
+};
+
+struct ls_index *ls_index_open(const char *path) {
+    struct ls_index *idx = calloc(1, sizeof(struct ls_index));
+    pthread_mutex_init(&idx->lock, NULL);
+    idx->path = strdup(path);
+    idx->tmp_path = malloc(strlen(path) + 32);
+    sprintf(idx->tmp_path, "%s.tmp.%ld", path, (long)getpid());
+
+    idx->out = fopen(idx->tmp_path, "w");
+    if (!idx->out) {
+        int saved = errno;
+        ls_index_close(idx);
+        errno = saved;
+        return NULL;
+    }
+    setvbuf(idx->out, NULL, _IOFBF, 1 << 16);
+    struct index_header h = { INDEX_MAGIC, 0, 0 };
+    fwrite(&h, sizeof(h), 1, idx->out);
+    idx->pos = sizeof(h);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct index_header)) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            const struct index_header *oh = map;
+            size_t size = st.st_size;
+            // anything malformed just means starting over from a fresh scan
+            if (memcmp(oh->magic, INDEX_MAGIC, 8) == 0 && oh->dirs_off % 8 == 0 &&
+                oh->dirs_off <= size && oh->ndirs <= (size - oh->dirs_off) / sizeof(struct index_dir)) {
+                idx->map = map;
+                idx->map_size = size;
+                idx->dirs = (const struct index_dir *)((const char *)map + oh->dirs_off);
+                idx->ndirs = oh->ndirs;
+            } else {
+                munmap(map, size);
+            }
+        }
+    }
+    if (fd >= 0) close(fd);
+    return idx;
+}
+
+static int compare_index_dirs(const void *a, const void *b) {
+    const struct index_dir *x = a, *y = b;
+    if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+    if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+    return 0;
+}
+
+int ls_index_close(struct ls_index *idx) {
+    int rc = 0;
+    if (idx->out) {
+        // one record per directory, even if two operands overlapped
+        qsort(idx->new_dirs, idx->new_count, sizeof(struct index_dir), compare_index_dirs);
+        size_t n = 0;
+        for (size_t i = 0; i < idx->new_count; i++)
+            if (n == 0 || compare_index_dirs(&idx->new_dirs[n - 1], &idx->new_dirs[i]) != 0)
+                idx->new_dirs[n++] = idx->new_dirs[i];
+
+        static const char zeros[8];
+        uint64_t pad = (8 - idx->pos % 8) % 8;
+        struct index_header h = { INDEX_MAGIC, idx->pos + pad, n };
+        fwrite(zeros, 1, pad, idx->out);
+        fwrite(idx->new_dirs, sizeof(struct index_dir), n, idx->out);
+        if (fseek(idx->out, 0, SEEK_SET) == 0) fwrite(&h, sizeof(h), 1, idx->out);
+        if (ferror(idx->out) || idx->err) rc = -1;
+        if (fclose(idx->out) != 0) rc = -1;
+        if (rc == 0 && rename(idx->tmp_path, idx->path) == -1) rc = -1;
+        if (rc == -1) unlink(idx->tmp_path);
+    }
+    if (idx->map) munmap((void *)idx->map, idx->map_size);
+    free(idx->new_dirs);
+    free(idx->tmp_path);
+    free(idx->path);
+    pthread_mutex_destroy(&idx->lock);
+    free(idx);
+    return rc;
+}
+
+// Fills a table from the previous index if the directory is unchanged
+static int index_fill(struct ls_index *idx, struct ls_table *tab, const struct stat *dst) {
+    if (!idx->map) return 0;
+    struct index_dir key = { .dev = dst->st_dev, .ino = dst->st_ino };
+    const struct index_dir *d = bsearch(&key, idx->dirs, idx->ndirs, sizeof(struct index_dir),
+                                        compare_index_dirs);
+    if (!d || d->mtime_sec != dst->st_mtim.tv_sec || d->mtime_nsec != dst->st_mtim.tv_nsec ||
+        d->ctime_sec != dst->st_ctim.tv_sec || d->ctime_nsec != dst->st_ctim.tv_nsec)
+        return 0;
+    if (d->off > idx->map_size || d->len > idx->map_size - d->off) return 0;
+
+    const unsigned char *p = (const unsigned char *)idx->map + d->off, *end = p + d->len;
+    tab->entries = malloc(sizeof(struct ls_entry) * (d->count + 1));
+    tab->cap = d->count + 1;
+    while (p < end && (uint64_t)tab->count < d->count) {
+        if (end - p < 10 || end - p < 10 + p[9]) break;
+        struct ls_entry *e = &tab->entries[tab->count++];
+        uint64_t ino;
+        memcpy(&ino, p, 8);
+        e->ino = ino;
+        e->d_type = p[8];
+        e->name = strndup((const char *)p + 10, p[9]);
+        e->stat_state = 0;
+        e->attrs = 0;
+        entry_scan_name(e);
+        p += 10 + p[9];
+    }
+    if (p != end || (uint64_t)tab->count != d->count) {
+        for (int i = 0; i < tab->count; i++) free(tab->entries[i].name);
+        free(tab->entries);
+        tab->entries = NULL;
+        tab->count = tab->cap = 0;
+        return 0;
+    }
+    return 1;
+}
+
+// Records a directory's names (in name order) in the index being written
+static void index_append(struct ls_index *idx, dev_t dev, ino_t ino, const struct timespec *mtime,
+                         const struct timespec *ctime, const struct ls_entry *raw, int count) {
+    if (stamp_is_recent(mtime, ctime)) return;   // rescanned next time instead
+
+    pthread_mutex_lock(&idx->lock);
+    uint64_t off = idx->pos;
+    for (int i = 0; i < count; i++) {
+        unsigned char head[10];
+        uint64_t e_ino = raw[i].ino;
+        size_t len = strlen(raw[i].name);
+        memcpy(head, &e_ino, 8);
+        head[8] = raw[i].d_type;
+        head[9] = (unsigned char)len;   // NAME_MAX is 255
+        if (fwrite(head, 10, 1, idx->out) != 1 || fwrite(raw[i].name, 1, len, idx->out) != len)
+            idx->err = 1;
+        idx->pos += 10 + len;
+    }
+    if (idx->new_count == idx->new_cap) {
+        idx->new_cap = idx->new_cap ? idx->new_cap * 2 : 256;
+        idx->new_dirs = realloc(idx->new_dirs, sizeof(struct index_dir) * idx->new_cap);
+    }
+    struct index_dir *d = &idx->new_dirs[idx->new_count++];
+    d->dev = dev;
+    d->ino = ino;
+    d->mtime_sec = mtime->tv_sec;
+    d->mtime_nsec = mtime->tv_nsec;
+    d->ctime_sec = ctime->tv_sec;
+    d->ctime_nsec = ctime->tv_nsec;
+    d->off = off;
+    d->len = idx->pos - off;
+    d->count = count;
+    pthread_mutex_unlock(&idx->lock);
+}
+
+// -------------------- Table Reuse --------------------
+// Serves every name of an unchanged directory from opts->cache or
+// opts->index and returns 1. Otherwise starts a record in tab->fill (with
+// the cache's watch taken before the directory is read, so any later
+// change retires the record) and returns 0.
+static int table_fill(const struct ls_opts *opts, struct ls_table *tab) {
+    struct stat dst;
+    if (fstat(dirfd(tab->dir), &dst) == -1) return 0;
+
+    if ((opts->cache && cache_fill(opts->cache, tab, &dst)) ||
+        (opts->index && index_fill(opts->index, tab, &dst))) {
+        if (opts->index)
+            index_append(opts->index, dst.st_dev, dst.st_ino, &dst.st_mtim, &dst.st_ctim,
+                         tab->entries, tab->count);
+        return 1;
+    }
+
+    struct ls_cache_dir *fill = calloc(1, sizeof(struct ls_cache_dir));
+    fill->dev = dst.st_dev;
+    fill->ino = dst.st_ino;
+    fill->mtime = dst.st_mtim;
+    fill->ctime = dst.st_ctim;
+    fill->wd = -1;
+    if (opts->cache && opts->cache->inotify_fd >= 0) {
+        char path[32];
+        // taken first: an event numbered after it may predate the watch, never the reverse
+        pthread_mutex_lock(&opts->cache->lock);
+        fill->since = opts->cache->events;
+        pthread_mutex_unlock(&opts->cache->lock);
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", dirfd(tab->dir));
+        fill->wd = inotify_add_watch(opts->cache->inotify_fd, path, WATCH_MASK);
+    }
+    tab->fill = fill;
+    return 0;
+}
+
+// Hands the record started by table_fill() to the index and the cache
+static void table_store(const struct ls_opts *opts, struct ls_table *tab) {
+    struct ls_cache_dir *cd = tab->fill;
+    if (!cd) return;
+    tab->fill = NULL;
+    if (opts->index)
+        index_append(opts->index, cd->dev, cd->ino, &cd->mtime, &cd->ctime, cd->raw, cd->count);
+    if (opts->cache) cache_store(opts->cache, tab, cd);
+    else cache_dir_free(cd);
+}
+
+// -------------------- Filesystem Profiles --------------------
+// The fastest way to stat a directory's entries depends on what it is
+// stored on. Disk filesystems keep inodes in tables that inode-ordered
+// stats sweep through; tmpfs and procfs answer from memory, where a plain
+// serial pass is cheapest; on network and FUSE mounts every stat is a round
+// trip, so they are overlapped on threads and served from the attributes
+// the client has cached. Each directory is matched by fstatfs() when it is
+// opened, so a -R walk that crosses into another mount switches there.
+struct ls_fs_profile {
+    const char *name;
+    unsigned long magic;      // statfs f_type; 0 for the default, which ends the table
+    int threads;              // stats in flight per directory; 0 or 1 = serial
+    int window;               // entries a streamed listing stats ahead of its output
+    int inode_order;          // take each batch of stats in d_ino order
+    int trust_dtype;          // 0 = ignore readdir()'s d_type and stat for the type
+    int dont_sync;            // statx(AT_STATX_DONT_SYNC): don't revalidate with a server
+    int xattrs;               // --xattrs probes here; 0 where no file can have them
+};
+
+static const struct ls_fs_profile fs_profiles_builtin[] = {
+    { "ext4",    0xef53,     0,  1024, 1, 1, 0, 1 },   // ext2 and ext3 too
+    { "xfs",     0x58465342, 0,  1024, 1, 1, 0, 1 },
+    { "btrfs",   0x9123683e, 0,  1024, 1, 1, 0, 1 },
+    { "tmpfs",   0x01021994, 0,  1024, 0, 1, 0, 1 },
+    { "ramfs",   0x858458f6, 0,  1024, 0, 1, 0, 0 },
+    { "proc",    0x9fa0,     0,  1024, 0, 1, 0, 0 },
+    { "sysfs",   0x62656572, 0,  1024, 0, 1, 0, 0 },
+    { "nfs",     0x6969,     16, 512,  0, 1, 1, 1 },
+    { "cifs",    0xff534d42, 16, 512,  0, 1, 1, 1 },
+    { "smb2",    0xfe534d42, 16, 512,  0, 1, 1, 1 },
+    { "ceph",    0x00c36400, 16, 512,  0, 1, 1, 1 },
+    { "9p",      0x01021997, 8,  512,  0, 1, 0, 1 },
+    { "fuse",    0x65735546, 16, 512,  0, 1, 1, 1 },
+    { "default", 0,          0,  1024, 1, 1, 0, 1 },
+};
+#define FS_PROFILES (int)(sizeof(fs_profiles_builtin) / sizeof(fs_profiles_builtin[0]))
+
+static struct ls_fs_profile fs_profiles[FS_PROFILES];
+static int fs_profiles_loaded;
+
+static const struct ls_fs_profile *fs_profile_of(int fd) {
+    const struct ls_fs_profile *table = fs_profiles_loaded ? fs_profiles : fs_profiles_builtin;
+    struct statfs sfs;
+    if (fstatfs(fd, &sfs) == 0)
+        for (int i = 0; i < FS_PROFILES - 1; i++)
+            if ((unsigned long)sfs.f_type == table[i].magic) return &table[i];
+    return &table[FS_PROFILES - 1];
+}
+
+static const struct ls_fs_profile *table_profile(const struct ls_table *tab) {
+    if (tab->profile) return tab->profile;
+    return fs_profiles_loaded ? &fs_profiles[FS_PROFILES - 1] : &fs_profiles_builtin[FS_PROFILES - 1];
+}
+
+// One "name:key=value,..." item of a profile spec, applied to table
+static int fs_profile_apply(struct ls_fs_profile *table, char *item) {
+    char *keys = strchr(item, ':');
+    if (!keys) return -1;
+    *keys++ = '\0';
+    struct ls_fs_profile *p = NULL;
+    for (int i = 0; i < FS_PROFILES; i++)
+        if (strcmp(item, table[i].name) == 0) p = &table[i];
+    if (!p) return -1;
+
+    char *save, *kv;
+    for (kv = strtok_r(keys, ",", &save); kv; kv = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(kv, '='), *end;
+        if (!eq) return -1;
+        *eq = '\0';
+        long v = strtol(eq + 1, &end, 10);
+        if (end == eq + 1 || *end || v < 0) return -1;
+        if (strcmp(kv, "threads") == 0 && v <= 256) p->threads = v;
+        else if (strcmp(kv, "window") == 0 && v >= 1 && v <= 1 << 20) p->window = v;
+        else if (strcmp(kv, "inode_order") == 0 && v <= 1) p->inode_order = v;
+        else if (strcmp(kv, "trust_dtype") == 0 && v <= 1) p->trust_dtype = v;
+        else if (strcmp(kv, "dont_sync") == 0 && v <= 1) p->dont_sync = v;
+        else if (strcmp(kv, "xattrs") == 0 && v <= 1) p->xattrs = v;
+        else return -1;
+    }
+    return 0;
+}
+
+int ls_fs_profiles_load(const char *spec) {
+    struct ls_fs_profile next[FS_PROFILES];
+    memcpy(next, fs_profiles_builtin, sizeof(next));
+    int rc = 0;
+    if (spec) {
+        char *copy = strdup(spec), *save, *item;
+        for (item = strtok_r(copy, ";", &save); item && rc == 0; item = strtok_r(NULL, ";", &save))
+            rc = fs_profile_apply(next, item);
+        free(copy);
+    }
+    if (rc == -1) {
+        // a spec that doesn't parse changes nothing
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(fs_profiles, next, sizeof(next));
+    fs_profiles_loaded = 1;
+    return 0;
+}
+
+// fstatat() through statx(), so AT_STATX_DONT_SYNC can be passed
+static int statx_at(int fd, const char *name, int flags, struct stat *st) {
+    struct statx sx;
+    if (statx(fd, name, flags | AT_STATX_DONT_SYNC, STATX_BASIC_STATS, &sx) == -1)
+        return errno == ENOSYS ? fstatat(fd, name, st, flags) : -1;
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(sx.stx_dev_major, sx.stx_dev_minor);
+    st->st_ino = sx.stx_ino;
+    st->st_mode = sx.stx_mode;
+    st->st_nlink = sx.stx_nlink;
+    st->st_uid = sx.stx_uid;
+    st->st_gid = sx.stx_gid;
+    st->st_rdev = makedev(sx.stx_rdev_major, sx.stx_rdev_minor);
+    st->st_size = sx.stx_size;
+    st->st_blksize = sx.stx_blksize;
+    st->st_blocks = sx.stx_blocks;
+    st->st_atim = (struct timespec){ sx.stx_atime.tv_sec, sx.stx_atime.tv_nsec };
+    st->st_mtim = (struct timespec){ sx.stx_mtime.tv_sec, sx.stx_mtime.tv_nsec };
+    st->st_ctim = (struct timespec){ sx.stx_ctime.tv_sec, sx.stx_ctime.tv_nsec };
+    return 0;
+}
+
+// -------------------- Bounded Stats --------------------
+// Under --stat-timeout or --deadline a stat is handed to a helper thread and
+// waited for only so long. A stat stuck on a hung mount cannot be cancelled,
+// so its helper is left behind (detached, holding its own dup of the
+// directory fd and copy of the name) and the entry is marked timed out.
+// Helpers that come back are reused; a job whose waiter has given up before
+// any helper took it is dropped unrun.
+#define STAT_HELPERS_MAX 64   // past this, stats queue behind the stuck ones
+
+struct stat_job {
+    struct stat_job *next;
+    int dirfd;
+    int follow, dont_sync;
+    char *name;
+    struct stat st;
+    long calls;
+    int err;                  // errno of a failed stat, or 0
+    int done, abandoned;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;      // on CLOCK_MONOTONIC, set up once
+    struct stat_job *head, *tail;
+    int helpers, idle, queued;
+} stat_helpers = { .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER };
+static pthread_once_t stat_helpers_once = PTHREAD_ONCE_INIT;
+
+static void stat_helpers_init(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&stat_helpers.done, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static int time_before(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static int deadline_passed(const struct timespec *deadline) {
+    if (!deadline->tv_sec) return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return !time_before(&now, deadline);
+}
+
+// lstat, or under -L stat falling back to lstat for dangling links
+static int stat_at(int fd, const char *name, int follow, int dont_sync, struct stat *st, long *calls) {
+    (*calls)++;
+    if (follow) {
+        if ((dont_sync ? statx_at(fd, name, 0, st) : fstatat(fd, name, st, 0)) == 0) return 0;
+        if (errno != ENOENT && errno != ELOOP) return -1;
+        (*calls)++;
+    }
+    return dont_sync ? statx_at(fd, name, AT_SYMLINK_NOFOLLOW, st)
+                     : fstatat(fd, name, st, AT_SYMLINK_NOFOLLOW);
+}
+
+static void stat_job_free(struct stat_job *job) {
+    close(job->dirfd);
+    free(job->name);
+    free(job);
+}
+
+static void *stat_helper(void *arg) {
+    (void)arg;
+    // helpers outlive the listing that started them, so they let go of its
+    // working directory (which a daemon's request thread has to itself)
+    if (unshare(CLONE_FS) == 0 && chdir("/") == -1) {}
+    pthread_mutex_lock(&stat_helpers.lock);
+    for (;;) {
+        while (!stat_helpers.head) pthread_cond_wait(&stat_helpers.work, &stat_helpers.lock);
+        struct stat_job *job = stat_helpers.head;
+        if (!(stat_helpers.head = job->next)) stat_helpers.tail = NULL;
+        stat_helpers.queued--;
+        if (job->abandoned) {
+            stat_job_free(job);
+            continue;
+        }
+        stat_helpers.idle--;
+        pthread_mutex_unlock(&stat_helpers.lock);
+
+        job->err = stat_at(job->dirfd, job->name, job->follow, job->dont_sync, &job->st, &job->calls) == 0 ? 0 : errno;
+
+        pthread_mutex_lock(&stat_helpers.lock);
+        stat_helpers.idle++;
+        if (job->abandoned) {
+            stat_job_free(job);
+        } else {
+            job->done = 1;
+            pthread_cond_broadcast(&stat_helpers.done);
+        }
+    }
+    return NULL;
+}
+
+// Stats name in the table's directory on a helper, waiting until the
+// per-stat timeout or the deadline, whichever is first. Returns 0, -1 with
+// errno set, or 1 if the time ran out.
+static int stat_bounded(struct ls_table *tab, const char *name, struct stat *st) {
+    struct timespec limit;
+    clock_gettime(CLOCK_MONOTONIC, &limit);
+    if (tab->deadline.tv_sec && !time_before(&limit, &tab->deadline)) return 1;
+    if (tab->stat_timeout_ns) {
+        long long ns = limit.tv_nsec + tab->stat_timeout_ns;
+        limit.tv_sec += ns / 1000000000;
+        limit.tv_nsec = ns % 1000000000;
+        if (tab->deadline.tv_sec && time_before(&tab->deadline, &limit)) limit = tab->deadline;
+    } else {
+        limit = tab->deadline;
+    }
+
+    struct stat_job *job = calloc(1, sizeof(struct stat_job));
+    job->dirfd = fcntl(dirfd(tab->dir), F_DUPFD_CLOEXEC, 0);
+    if (job->dirfd == -1) {
+        free(job);
+        return -1;
+    }
+    job->name = strdup(name);
+    job->follow = tab->follow;
+    job->dont_sync = table_profile(tab)->dont_sync;
+
+    pthread_once(&stat_helpers_once, stat_helpers_init);
+    pthread_mutex_lock(&stat_helpers.lock);
+    if (stat_helpers.idle <= stat_helpers.queued && stat_helpers.helpers < STAT_HELPERS_MAX) {
+        pthread_t t;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&t, &attr, stat_helper, NULL) == 0) {
+            stat_helpers.helpers++;
+            stat_helpers.idle++;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    if (stat_helpers.tail) stat_helpers.tail->next = job;
+    else stat_helpers.head = job;
+    stat_helpers.tail = job;
+    stat_helpers.queued++;
+    pthread_cond_signal(&stat_helpers.work);
+
+    while (!job->done)
+        if (pthread_cond_timedwait(&stat_helpers.done, &stat_helpers.lock, &limit) == ETIMEDOUT) break;
+    if (!job->done) {
+        job->abandoned = 1;   // freed by whichever helper holds it
+        pthread_mutex_unlock(&stat_helpers.lock);
+        tab->stat_calls++;
+        return 1;
+    }
+    pthread_mutex_unlock(&stat_helpers.lock);
+
+    *st = job->st;
+    tab->stat_calls += job->calls;
+    int err = job->err;
+    stat_job_free(job);
+    if (!err) return 0;
+    errno = err;
+    return -1;
+}
+
+// -------------------- Attribute Probes --------------------
+// --xattrs marks modes the way GNU ls does: '+' for an ACL, '.' for only a
+// security context. The names of an entry's attributes come from one
+// listxattr() call, taken in the same pass (and on the same threads) as its
+// stat. Nothing is asked of filesystems whose profile says they hold no
+// attributes, nor of a mount that has once answered ENOTSUP.
+#ifndef SYS_listxattrat
+#if defined(__x86_64__) || defined(__aarch64__)
+#define SYS_listxattrat 465   // Linux 6.13
+#endif
+#endif
+
+#define NO_XATTR_MOUNTS 64
+
+static struct {
+    pthread_mutex_t lock;
+    dev_t devs[NO_XATTR_MOUNTS];
+    _Atomic int count;        // devs[0..count) are only ever appended to
+} no_xattr_mounts = { PTHREAD_MUTEX_INITIALIZER, { 0 }, 0 };
+
+static _Atomic int have_listxattrat = 1;
+
+static int mount_has_no_xattrs(dev_t dev) {
+    int n = atomic_load_explicit(&no_xattr_mounts.count, memory_order_acquire);
+    for (int i = 0; i < n; i++)
+        if (no_xattr_mounts.devs[i] == dev) return 1;
+    return 0;
+}
+
+static void mount_set_no_xattrs(dev_t dev) {
+    pthread_mutex_lock(&no_xattr_mounts.lock);
+    int n = atomic_load(&no_xattr_mounts.count);
+    if (!mount_has_no_xattrs(dev) && n < NO_XATTR_MOUNTS) {
+        no_xattr_mounts.devs[n] = dev;
+        atomic_store_explicit(&no_xattr_mounts.count, n + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&no_xattr_mounts.lock);
+}
+
+static ssize_t listxattr_at(int fd, const char *name, int follow, char *list, size_t size) {
+#ifdef SYS_listxattrat
+    if (atomic_load_explicit(&have_listxattrat, memory_order_relaxed)) {
+        ssize_t n = syscall(SYS_listxattrat, fd, name, follow ? 0 : AT_SYMLINK_NOFOLLOW, list, size);
+        if (n >= 0 || errno != ENOSYS) return n;
+        atomic_store(&have_listxattrat, 0);
+    }
+#endif
+    // older kernels: the same name through the directory's /proc link
+    char path[PATH_MAX + 32];
+    if (fd == AT_FDCWD) snprintf(path, sizeof(path), "%s", name);
+    else snprintf(path, sizeof(path), "/proc/self/fd/%d/%s", fd, name);
+    return follow ? listxattr(path, list, size) : llistxattr(path, list, size);
+}
+
+// Probes one stat'd entry; other entries are only marked as probed
+static void probe_attrs(struct ls_table *tab, struct ls_entry *e, long *calls) {
+    e->attrs = LS_ATTR_PROBED;
+    if (e->stat_state != 1 || !table_profile(tab)->xattrs || mount_has_no_xattrs(e->st.st_dev) ||
+        deadline_passed(&tab->deadline))
+        return;
+    // operands are paths of their own, followed as they were stat'd
+    int fd = tab->dir ? dirfd(tab->dir) : AT_FDCWD;
+    int follow = (tab->follow || !tab->dir) && !S_ISLNK(e->st.st_mode);
+    char small[1024], *list = small;
+    (*calls)++;
+    ssize_t n = listxattr_at(fd, e->name, follow, list, sizeof(small));
+    if (n == -1 && errno == ERANGE) {
+        (*calls)++;
+        ssize_t need = listxattr_at(fd, e->name, follow, NULL, 0);
+        if (need > 0) {
+            list = malloc(need);
+            (*calls)++;
+            n = listxattr_at(fd, e->name, follow, list, need);
+        }
+    }
+    if (n == -1 && errno == ENOTSUP) mount_set_no_xattrs(e->st.st_dev);
+    for (ssize_t i = 0; i < n; i += strlen(list + i) + 1) {
+        const char *a = list + i;
+        if (strcmp(a, "system.posix_acl_access") == 0 || strcmp(a, "system.posix_acl_default") == 0 ||
+            strcmp(a, "system.nfs4_acl") == 0)
+            e->attrs |= LS_ATTR_ACL;
+        else if (strcmp(a, "security.selinux") == 0 || strcmp(a, "security.SMACK64") == 0)
+            e->attrs |= LS_ATTR_CONTEXT;
+    }
+    if (list != small) free(list);
+}
+
+// The mode suffix of a probed entry ('+', '.' or ' '); 0 if not probed
+static char attr_mark(const struct ls_entry *e) {
+    if (!e->attrs) return 0;
+    return e->attrs & LS_ATTR_ACL ? '+' : e->attrs & LS_ATTR_CONTEXT ? '.' : ' ';
+}
+
+// -------------------- Entry Table --------------------
+// Cached lstat of an entry (stat under -L, falling back to lstat for
+// dangling links); NULL if it could not be stat'd, or not in time
+const struct stat *ls_entry_stat(struct ls_table *tab, struct ls_entry *e) {
+    if (e->stat_state == 0 && tab->dir) {
+        int rc = tab->stat_timeout_ns || tab->deadline.tv_sec
+                 ? stat_bounded(tab, e->name, &e->st)
+                 : stat_at(dirfd(tab->dir), e->name, tab->follow, table_profile(tab)->dont_sync,
+                           &e->st, &tab->stat_calls);
+        if (rc == 0) {
+            e->stat_state = 1;
+        } else if (rc == 1) {
+            e->stat_state = -2;
+            tab->stat_timeouts++;
+        } else {
+            e->stat_state = -1;
+            dprintf(tab->err_fd, "lstat %s: %s\n", e->name, strerror(errno));
+        }
+    }
+    return e->stat_state == 1 ? &e->st : NULL;
+}
+
+// Listed entries are those that could be stat'd and those that timed out
+static int entry_listed(struct ls_table *tab, struct ls_entry *e) {
+    return ls_entry_stat(tab, e) || e->stat_state == -2;
+}
+
+// On a cold cache each stat reads the block of the inode table holding the
+// inode, and sorted names land all over those tables. Where a run of
+// entries is going to be stat'd anyway, the stats are taken in d_ino order
+// (which follows the on-disk layout on ext4 and XFS) and the output reads
+// the results in its own order afterwards. Profiles for mounts where a stat
+// is a round trip fan the run out over threads instead.
+struct ino_slot {
+    ino_t ino;
+    int index;
+};
+
+static int compare_ino(const void *a, const void *b) {
+    const struct ino_slot *x = a, *y = b;
+    if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+    return x->index - y->index;
+}
+
+struct stat_fanout {
+    struct ls_table *tab;
+    const struct ino_slot *order;
+    int n;
+    int dont_sync;
+    _Atomic int next;
+    _Atomic long calls, probes;
+};
+
+// Takes the next entries off the shared order until none are left. A stat
+// that fails is left untaken, for the serial pass to retry and report.
+static void *stat_fanout_thread(void *arg) {
+    struct stat_fanout *f = arg;
+    struct ls_table *tab = f->tab;
+    long calls = 0, probes = 0;
+    int i;
+    while ((i = atomic_fetch_add(&f->next, 1)) < f->n) {
+        struct ls_entry *e = &tab->entries[f->order[i].index];
+        if (e->stat_state == 0 &&
+            stat_at(dirfd(tab->dir), e->name, tab->follow, f->dont_sync, &e->st, &calls) == 0)
+            e->stat_state = 1;
+        if (tab->xattrs && e->stat_state == 1 && !e->attrs) probe_attrs(tab, e, &probes);
+    }
+    atomic_fetch_add(&f->calls, calls);
+    atomic_fetch_add(&f->probes, probes);
+    return NULL;
+}
+
+static void stat_parallel(struct ls_table *tab, const struct ino_slot *order, int n, int threads) {
+    struct stat_fanout f = { tab, order, n, table_profile(tab)->dont_sync, 0, 0, 0 };
+    pthread_t *tids = malloc(sizeof(pthread_t) * threads);
+    int started = 0;
+    while (started < threads - 1 && pthread_create(&tids[started], NULL, stat_fanout_thread, &f) == 0)
+        started++;
+    stat_fanout_thread(&f);
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    free(tids);
+    tab->stat_calls += f.calls;
+    tab->xattr_calls += f.probes;
+}
+
+// An entry still owed its stat or, under --xattrs, its attribute probe
+static int entry_pending(const struct ls_table *tab, const struct ls_entry *e) {
+    return e->stat_state == 0 || (tab->xattrs && !e->attrs && e->stat_state != -1);
+}
+
+static void entry_settle(struct ls_table *tab, struct ls_entry *e) {
+    ls_entry_stat(tab, e);
+    if (tab->xattrs && !e->attrs) probe_attrs(tab, e, &tab->xattr_calls);
+}
+
+// Stats (and probes) entries [from, to) of a table the way its
+// filesystem's profile says
+static void stat_entries(struct ls_table *tab, int from, int to) {
+    const struct ls_fs_profile *pf = table_profile(tab);
+    int n = 0;
+    for (int i = from; i < to; i++) n += entry_pending(tab, &tab->entries[i]);
+    if (n == 0) return;
+
+    // bounded stats already run on helpers of their own
+    int threads = !tab->dir || tab->stat_timeout_ns || tab->deadline.tv_sec ? 1
+                  : pf->threads < n ? pf->threads : n;
+    if (!pf->inode_order && threads <= 1) {
+        for (int i = from; i < to; i++) entry_settle(tab, &tab->entries[i]);
+        return;
+    }
+    struct ino_slot *order = malloc(sizeof(struct ino_slot) * n);
+    n = 0;
+    for (int i = from; i < to; i++)
+        if (entry_pending(tab, &tab->entries[i])) order[n++] = (struct ino_slot){ tab->entries[i].ino, i };
+    if (pf->inode_order) qsort(order, n, sizeof(struct ino_slot), compare_ino);
+    if (threads > 1) stat_parallel(tab, order, n, threads);
+    for (int i = 0; i < n; i++) entry_settle(tab, &tab->entries[order[i].index]);
+    free(order);
+}
+
+static unsigned type_bit_from_dtype(unsigned char d_type) {
+    switch (d_type) {
+        case DT_REG:  return LS_TYPE_FILE;
+        case DT_DIR:  return LS_TYPE_DIR;
+        case DT_LNK:  return LS_TYPE_LINK;
+        case DT_FIFO: return LS_TYPE_FIFO;
+        case DT_SOCK: return LS_TYPE_SOCK;
+        case DT_CHR:  return LS_TYPE_CHR;
+        case DT_BLK:  return LS_TYPE_BLK;
+        default:      return 0;
+    }
+}
+
+static unsigned type_bit_from_mode(mode_t mode) {
+    if (S_ISREG(mode))  return LS_TYPE_FILE;
+    if (S_ISDIR(mode))  return LS_TYPE_DIR;
+    if (S_ISLNK(mode))  return LS_TYPE_LINK;
+    if (S_ISFIFO(mode)) return LS_TYPE_FIFO;
+    if (S_ISSOCK(mode)) return LS_TYPE_SOCK;
+    if (S_ISCHR(mode))  return LS_TYPE_CHR;
+    if (S_ISBLK(mode))  return LS_TYPE_BLK;
+    return 0;
+}
+
+// File type of an entry, from d_type when the filesystem fills it in
+// (except for symlinks under -L, whose type is the target's)
+static unsigned entry_type(struct ls_table *tab, struct ls_entry *e) {
+    unsigned bit = type_bit_from_dtype(e->d_type);
+    if (bit && !(bit == LS_TYPE_LINK && tab->follow)) return bit;
+    const struct stat *st = ls_entry_stat(tab, e);
+    return st ? type_bit_from_mode(st->st_mode) : 0;
+}
+
+static int needs_metadata(const struct ls_opts *opts) {
+    return opts->size_cmp || opts->has_newer || opts->has_uid;
+}
+
+// Decides whether an entry is listed. Checks run cheapest first: the name
+// globs, then d_type, and only then a stat, and only if a metadata
+// predicate is still left to decide.
+static int entry_matches(struct ls_table *tab, struct ls_entry *e, const struct ls_opts *opts) {
+    size_t len = entry_name_len(e);
+    if (opts->include.count && !ls_matcher_match(&opts->include, e->name, len)) {
+        // directories are kept regardless of --include so the tree stays navigable
+        if (entry_type(tab, e) != LS_TYPE_DIR) return 0;
+    }
+    if (opts->type_mask && !(entry_type(tab, e) & opts->type_mask)) return 0;
+    if (!needs_metadata(opts)) return 1;
+
+    const struct stat *st = ls_entry_stat(tab, e);
+    if (!st) return 0;
+    if (opts->size_cmp == '>' && !(st->st_size > opts->size)) return 0;
+    if (opts->size_cmp == '<' && !(st->st_size < opts->size)) return 0;
+    if (opts->size_cmp == '=' && st->st_size != opts->size) return 0;
+    if (opts->has_uid && st->st_uid != opts->uid) return 0;
+    if (opts->has_newer) {
+        if (st->st_mtim.tv_sec < opts->newer.tv_sec) return 0;
+        if (st->st_mtim.tv_sec == opts->newer.tv_sec && st->st_mtim.tv_nsec <= opts->newer.tv_nsec) return 0;
+    }
+    return 1;
+}
+
+// Files the entry at entries[count]: listed entries are packed at the
+// front, directories kept for -R follow, and everything else is dropped
+static void file_entry(struct ls_table *tab, const struct ls_opts *opts) {
+    struct ls_entry *e = &tab->entries[tab->count];
+    if (entry_matches(tab, e, opts)) {
+        if (tab->count != tab->shown) {
+            struct ls_entry tmp = tab->entries[tab->shown];
+            tab->entries[tab->shown] = *e;
+            *e = tmp;
+        }
+        tab->shown++;
+    } else if (!(opts->recursive && entry_type(tab, e) == LS_TYPE_DIR)) {
+        free(e->name);
+        return;
+    }
+    tab->count++;
+}
+
+// Reads an open directory into a table. --exclude is applied straight off
+// readdir(); entries failing the remaining filters are dropped, except
+// directories under -R, which are parked after entries[shown] for descent.
+// Returns 1 if opts->cache or opts->index supplied the names instead.
+// With a budget, listed entries beyond it are spilled to sorted runs (see
+// Spilled Runs); a cache or index record would hold every name, so those
+// are bypassed.
+static int read_entries(DIR *dir, const struct ls_opts *opts, struct ls_table *tab, size_t budget) {
+    memset(tab, 0, sizeof(*tab));
+    tab->dir = dir;
+    tab->follow = opts->follow == LS_FOLLOW_ALL;
+    tab->xattrs = opts->xattrs;
+    tab->stat_timeout_ns = opts->stat_timeout_ns;
+    tab->deadline = opts->deadline;
+    tab->err_fd = opts->err_fd;
+    tab->profile = fs_profile_of(dirfd(dir));
+    if (budget) {
+        tab->spill = calloc(1, sizeof(struct ls_spill));
+        tab->spill->fd = -1;
+        tab->spill->budget = budget;
+        tab->spill->err_fd = opts->err_fd;
+    }
+
+    int hit = !budget && (opts->cache || opts->index) && table_fill(opts, tab);
+    if (!hit) {
+        struct dirent *d;
+        while ((d = readdir(tab->dir)) != NULL) {
+            tab->read_count++;
+            if (d->d_name[0] == '.') continue;
+            // a cache record keeps every name, so --exclude waits for the pass below
+            if (!tab->fill && opts->exclude.count &&
+                ls_matcher_match(&opts->exclude, d->d_name, strlen(d->d_name)))
+                continue;
+
+            if (tab->count == tab->cap) {
+                tab->cap = tab->cap ? tab->cap * 2 : 64;
+                tab->entries = realloc(tab->entries, sizeof(struct ls_entry) * tab->cap);
+            }
+            struct ls_entry *e = &tab->entries[tab->count];
+            unsigned flags;
+            size_t len = name_scan(d->d_name, &flags);
+            e->name = malloc(len + 1);
+            memcpy(e->name, d->d_name, len + 1);
+            e->name_len = len;
+            e->name_flags = flags;
+            e->name_width = 0;
+            e->attrs = 0;
+            e->ino = d->d_ino;
+            e->d_type = tab->profile->trust_dtype ? d->d_type : DT_UNKNOWN;
+            e->stat_state = 0;
+
+            if (tab->fill) {
+                tab->count++;
+            } else if (!tab->spill) {
+                file_entry(tab, opts);
+            } else {
+                int shown = tab->shown;
+                file_entry(tab, opts);
+                if (tab->shown > shown) tab->spill->shown_bytes += len + 1;
+                // the array grows by doubling, so spill at half the budget
+                if ((tab->shown * sizeof(struct ls_entry) + tab->spill->shown_bytes) * 2 >= budget)
+                    spill_run(tab, opts);
+            }
+        }
+        if (tab->spill) spill_finish(tab, opts);
+        if (!tab->fill) return 0;
+        cache_capture(tab);
+    }
+
+    // Filter the full set of names the cache supplied or is recording
+    int n = tab->count;
+    tab->count = tab->shown = 0;
+    for (int i = 0; i < n; i++) {
+        struct ls_entry e = tab->entries[i];
+        if (opts->exclude.count && ls_matcher_match(&opts->exclude, e.name, entry_name_len(&e))) {
+            free(e.name);
+            continue;
+        }
+        tab->entries[tab->count] = e;
+        file_entry(tab, opts);
+    }
+    return hit;
+}
+
+static void free_entries(struct ls_table *tab) {
+    for (int i = 0; i < tab->count; i++) free(tab->entries[i].name);
+    free(tab->entries);
+    tab->entries = NULL;
+    tab->count = tab->shown = 0;
+    if (tab->dir) closedir(tab->dir);
+    tab->dir = NULL;
+    if (tab->fill) cache_dir_free(tab->fill);
+    tab->fill = NULL;
+    if (tab->spill) spill_free(tab->spill);
+    tab->spill = NULL;
+    free(tab->digests);
+    tab->digests = NULL;
+}
+
+// -------------------- Content Digests --------------------
+// XXH3-64 (seed 0, the default secret) and SHA-256, both streamed, so a
+// file of any size is read once in HASH_CHUNK pieces. Each listed regular
+// file is opened and read front to back, and whatever the read had to
+// fetch from disk is dropped from the page cache again with
+// POSIX_FADV_DONTNEED, while what was cached already stays: an audit of a
+// whole tree must not evict everything else on the machine.
+#define HASH_CHUNK        (1 << 20)
+#define HASH_THREADS      8           // per directory
+#define HASH_THREAD_BYTES (4 << 20)   // a thread is worth it per this much to read
+#define HASH_LOOKAHEAD    (64 << 20)  // past the chunk read; readahead stays within it
+#define HASH_MAX          32          // digest bytes (SHA-256)
+
+struct ls_digest {
+    signed char state;        // 1 = taken, 0 = not a regular file, -1 = not readable
+    unsigned char len;        // digest bytes, for every entry of the table
+    unsigned char bytes[HASH_MAX];
+};
+
+static uint64_t read64le(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;   // x86 and aarch64 (the targets here) are little-endian
+}
+
+static uint32_t read32le(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+#define XXH_PRIME32_1 0x9E3779B1U
+#define XXH_PRIME32_2 0x85EBCA77U
+#define XXH_PRIME32_3 0xC2B2AE3DU
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define XXH_STRIPE    64
+#define XXH_STRIPES   16   // per block, then the accumulators are scrambled
+#define XXH_BUFFER    256
+
+static const unsigned char xxh3_secret[192] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+struct xxh3_state {
+    uint64_t acc[8];
+    unsigned char buf[XXH_BUFFER];
+    unsigned char last[XXH_STRIPE];   // the last stripe consumed, for a short tail
+    size_t buffered;
+    int stripes;                      // into the current block
+    uint64_t total;
+};
+
+static uint64_t mul128_fold64(uint64_t a, uint64_t b) {
+    unsigned __int128 p = (unsigned __int128)a * b;
+    return (uint64_t)p ^ (uint64_t)(p >> 64);
+}
+
+static uint64_t xxh3_avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    return h ^ (h >> 32);
+}
+
+static uint64_t xxh64_avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    return h ^ (h >> 32);
+}
+
+static uint64_t xxh3_mix16(const unsigned char *in, const unsigned char *sec) {
+    return mul128_fold64(read64le(in) ^ read64le(sec), read64le(in + 8) ^ read64le(sec + 8));
+}
+
+// Inputs of up to 240 bytes have hashes of their own, without stripes
+static uint64_t xxh3_short(const unsigned char *in, size_t len) {
+    const unsigned char *sec = xxh3_secret;
+    if (len == 0)
+        return xxh64_avalanche(read64le(sec + 56) ^ read64le(sec + 64));
+    if (len <= 3) {
+        uint32_t combined = ((uint32_t)in[0] << 16) | ((uint32_t)in[len >> 1] << 24) |
+                            in[len - 1] | ((uint32_t)len << 8);
+        return xxh64_avalanche(combined ^ (uint64_t)(read32le(sec) ^ read32le(sec + 4)));
+    }
+    if (len <= 8) {
+        uint64_t v = read32le(in + len - 4) + ((uint64_t)read32le(in) << 32);
+        uint64_t h = v ^ (read64le(sec + 8) ^ read64le(sec + 16));
+        h ^= ((h << 49) | (h >> 15)) ^ ((h << 24) | (h >> 40));
+        h *= 0x9FB21C651E98DF25ULL;
+        h ^= (h >> 35) + len;
+        h *= 0x9FB21C651E98DF25ULL;
+        return h ^ (h >> 28);
+    }
+    if (len <= 16) {
+        uint64_t lo = read64le(in) ^ (read64le(sec + 24) ^ read64le(sec + 32));
+        uint64_t hi = read64le(in + len - 8) ^ (read64le(sec + 40) ^ read64le(sec + 48));
+        return xxh3_avalanche(len + __builtin_bswap64(lo) + hi + mul128_fold64(lo, hi));
+    }
+    uint64_t acc = len * XXH_PRIME64_1;
+    if (len <= 128) {
+        if (len > 32) {
+            if (len > 64) {
+                if (len > 96) {
+                    acc += xxh3_mix16(in + 48, sec + 96);
+                    acc += xxh3_mix16(in + len - 64, sec + 112);
+                }
+                acc += xxh3_mix16(in + 32, sec + 64);
+                acc += xxh3_mix16(in + len - 48, sec + 80);
+            }
+            acc += xxh3_mix16(in + 16, sec + 32);
+            acc += xxh3_mix16(in + len - 32, sec + 48);
+        }
+        acc += xxh3_mix16(in, sec);
+        acc += xxh3_mix16(in + len - 16, sec + 16);
+        return xxh3_avalanche(acc);
+    }
+    for (int i = 0; i < 8; i++) acc += xxh3_mix16(in + 16 * i, sec + 16 * i);
+    acc = xxh3_avalanche(acc);
+    for (int i = 8; i < (int)len / 16; i++) acc += xxh3_mix16(in + 16 * i, sec + 16 * (i - 8) + 3);
+    acc += xxh3_mix16(in + len - 16, sec + 119);
+    return xxh3_avalanche(acc);
+}
+
+static void xxh3_accumulate(uint64_t acc[8], const unsigned char *in, const unsigned char *sec) {
+    for (int i = 0; i < 8; i++) {
+        uint64_t v = read64le(in + 8 * i);
+        uint64_t key = v ^ read64le(sec + 8 * i);
+        acc[i ^ 1] += v;
+        acc[i] += (uint32_t)key * (key >> 32);
+    }
+}
+
+static void xxh3_consume(struct xxh3_state *s, const unsigned char *in, int stripes) {
+    for (int i = 0; i < stripes; i++, in += XXH_STRIPE) {
+        xxh3_accumulate(s->acc, in, xxh3_secret + 8 * s->stripes);
+        if (++s->stripes == XXH_STRIPES) {
+            for (int j = 0; j < 8; j++) {
+                uint64_t a = s->acc[j];
+                a ^= a >> 47;
+                a ^= read64le(xxh3_secret + 128 + 8 * j);
+                s->acc[j] = a * XXH_PRIME32_1;
+            }
+            s->stripes = 0;
+        }
+    }
+}
+
+static void xxh3_init(struct xxh3_state *s) {
+    static const uint64_t init[8] = { XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+                                      XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1 };
+    memcpy(s->acc, init, sizeof(init));
+    s->buffered = 0;
+    s->stripes = 0;
+    s->total = 0;
+}
+
+// Stripes are consumed only once more input follows them: the last stripe
+// of the input is hashed differently, at digest time
+static void xxh3_update(struct xxh3_state *s, const unsigned char *in, size_t n) {
+    s->total += n;
+    if (s->buffered + n <= XXH_BUFFER) {
+        memcpy(s->buf + s->buffered, in, n);
+        s->buffered += n;
+        return;
+    }
+    if (s->buffered) {
+        size_t fill = XXH_BUFFER - s->buffered;
+        memcpy(s->buf + s->buffered, in, fill);
+        in += fill;
+        n -= fill;
+        xxh3_consume(s, s->buf, XXH_BUFFER / XXH_STRIPE);
+        memcpy(s->last, s->buf + XXH_BUFFER - XXH_STRIPE, XXH_STRIPE);
+        s->buffered = 0;
+    }
+    while (n > XXH_BUFFER) {
+        xxh3_consume(s, in, XXH_BUFFER / XXH_STRIPE);
+        memcpy(s->last, in + XXH_BUFFER - XXH_STRIPE, XXH_STRIPE);
+        in += XXH_BUFFER;
+        n -= XXH_BUFFER;
+    }
+    memcpy(s->buf, in, n);
+    s->buffered = n;
+}
+
+static uint64_t xxh3_digest(const struct xxh3_state *s) {
+    if (s->total <= 240) return xxh3_short(s->buf, s->total);
+    struct xxh3_state t = *s;
+    unsigned char tail[XXH_STRIPE];
+    const unsigned char *last = t.buf + t.buffered - XXH_STRIPE;
+    xxh3_consume(&t, t.buf, (int)((t.buffered - 1) / XXH_STRIPE));
+    if (t.buffered < XXH_STRIPE) {
+        // the tail is short: complete it from the data consumed before it
+        memcpy(tail, s->last + t.buffered, XXH_STRIPE - t.buffered);
+        memcpy(tail + XXH_STRIPE - t.buffered, t.buf, t.buffered);
+        last = tail;
+    }
+    xxh3_accumulate(t.acc, last, xxh3_secret + sizeof(xxh3_secret) - XXH_STRIPE - 7);
+
+    uint64_t h = t.total * XXH_PRIME64_1;
+    for (int i = 0; i < 4; i++)
+        h += mul128_fold64(t.acc[2 * i] ^ read64le(xxh3_secret + 11 + 16 * i),
+                           t.acc[2 * i + 1] ^ read64le(xxh3_secret + 19 + 16 * i));
+    return xxh3_avalanche(h);
+}
+
+struct sha256_state {
+    uint32_t h[8];
+    unsigned char buf[64];
+    size_t buffered;
+    uint64_t total;
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t h[8], const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+               (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) +
+                      sha256_k[i] + w[i];
+        uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void sha256_init(struct sha256_state *s) {
+    static const uint32_t init[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    memcpy(s->h, init, sizeof(init));
+    s->buffered = 0;
+    s->total = 0;
+}
+
+static void sha256_update(struct sha256_state *s, const unsigned char *in, size_t n) {
+    s->total += n;
+    if (s->buffered) {
+        size_t fill = 64 - s->buffered < n ? 64 - s->buffered : n;
+        memcpy(s->buf + s->buffered, in, fill);
+        s->buffered += fill;
+        in += fill;
+        n -= fill;
+        if (s->buffered < 64) return;
+        sha256_block(s->h, s->buf);
+        s->buffered = 0;
+    }
+    for (; n >= 64; in += 64, n -= 64) sha256_block(s->h, in);
+    memcpy(s->buf, in, n);
+    s->buffered = n;
+}
+
+static void sha256_final(struct sha256_state *s, unsigned char out[32]) {
+    uint64_t bits = s->total * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t padlen = (s->buffered < 56 ? 56 : 120) - s->buffered;
+    for (int i = 0; i < 8; i++) pad[padlen + i] = (unsigned char)(bits >> (56 - 8 * i));
+    sha256_update(s, pad, padlen + 8);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = s->h[i] >> 24;
+        out[4 * i + 1] = s->h[i] >> 16;
+        out[4 * i + 2] = s->h[i] >> 8;
+        out[4 * i + 3] = s->h[i];
+    }
+}
+
+static int digest_size(enum ls_hash hash) {
+    return hash == LS_HASH_SHA256 ? 32 : 8;
+}
+
+// Marks in vec (bit 0, one byte per page) which pages of [off, off + len)
+// are in the page cache, without reading any of them; 0, or -1 if the file
+// cannot be mapped to tell. off is page-aligned.
+static int cached_pages(int fd, off_t off, size_t len, unsigned char *vec) {
+    void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, off);
+    if (map == MAP_FAILED) return -1;
+    int rc = mincore(map, len, vec);
+    munmap(map, len);
+    return rc;
+}
+
+// Looks up into vec which pages of chunk i (cap bytes from i * cap) are
+// cached, from the chunk's first page on; 0 if it cannot tell or the chunk
+// is past size
+static int chunk_cached(int fd, long long i, size_t cap, long page, off_t size,
+                        unsigned char *vec) {
+    off_t from = i * cap;
+    if (from >= size) return 0;
+    off_t base = from / page * page;
+    return cached_pages(fd, base, from + cap - base, vec) == 0;
+}
+
+// Drops from the page cache what reads of [base, end) had to fetch: the
+// runs of pages vec (see cached_pages) found uncached. A run still open at
+// end is left in *run (its start, else -1) for the next chunk to go on
+// with, as readahead fetches in folios that may straddle the two.
+static void drop_fetched(int fd, off_t base, off_t end, long page, const unsigned char *vec,
+                         off_t *run) {
+    for (long i = 0; base + i * page < end; i++) {
+        off_t at = base + i * page;
+        if (!(vec[i] & 1)) {
+            if (*run == -1) *run = at;
+        } else if (*run != -1) {
+            posix_fadvise(fd, *run, at - *run, POSIX_FADV_DONTNEED);
+            *run = -1;
+        }
+    }
+}
+
+// Reads a file through buf and digests it; returns the bytes read, or -1
+// with errno set. The file must still be the one that was stat'd.
+static long long hash_file(int dirfd, const char *name, int follow, const struct stat *st,
+                           enum ls_hash hash, unsigned char *buf, size_t cap, unsigned char *out) {
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK |
+                                 (follow ? 0 : O_NOFOLLOW));
+    if (fd == -1) return -1;
+    struct stat now;
+    if (fstat(fd, &now) == -1 || !S_ISREG(now.st_mode) ||
+        now.st_dev != st->st_dev || now.st_ino != st->st_ino) {
+        close(fd);
+        errno = ESTALE;
+        return -1;
+    }
+    // Readahead stays on and runs ahead of the reads, so which pages of a
+    // chunk were cached is looked up HASH_LOOKAHEAD before it is read, into
+    // a ring of per-chunk lookups; once read, what was not is dropped
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    long page = sysconf(_SC_PAGESIZE);
+    size_t span = cap / page + 2;   // pages one chunk can touch
+    long long chunks = (now.st_size + cap - 1) / cap, ahead = HASH_LOOKAHEAD / cap + 1;
+    if (ahead > chunks) ahead = chunks;
+    size_t slots = ahead + 1;
+    unsigned char *vec = malloc(slots * (span + 1)), *known = vec ? vec + slots * span : NULL;
+    for (long long i = 0; vec && i < ahead; i++)
+        known[i] = chunk_cached(fd, i, cap, page, now.st_size, vec + i * span);
+
+    struct xxh3_state x;
+    struct sha256_state s;
+    if (hash == LS_HASH_SHA256) sha256_init(&s);
+    else xxh3_init(&x);
+    long long total = 0, k = 0;   // k: the chunk read, while reads come whole
+    off_t run = -1;
+    for (;;) {
+        if (vec && k >= 0) {
+            size_t at = (k + ahead) % slots;
+            known[at] = chunk_cached(fd, k + ahead, cap, page, now.st_size, vec + at * span);
+        }
+        ssize_t r = pread(fd, buf, cap, total);
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            int saved = errno;
+            if (run != -1) posix_fadvise(fd, run, total - run, POSIX_FADV_DONTNEED);
+            free(vec);
+            close(fd);
+            errno = saved;
+            return -1;
+        }
+        if (r == 0) break;
+        if (vec && k >= 0 && known[k % slots]) {
+            drop_fetched(fd, total / page * page, total + r, page, vec + k % slots * span, &run);
+        } else if (run != -1) {
+            posix_fadvise(fd, run, total - run, POSIX_FADV_DONTNEED);
+            run = -1;
+        }
+        if (hash == LS_HASH_SHA256) sha256_update(&s, buf, r);
+        else xxh3_update(&x, buf, r);
+        total += r;
+        // after a short read the chunks looked up no longer line up with the reads
+        k = k >= 0 && (size_t)r == cap ? k + 1 : -1;
+    }
+    if (run != -1) posix_fadvise(fd, run, 0, POSIX_FADV_DONTNEED);   // to the end
+    free(vec);
+    close(fd);
+
+    if (hash == LS_HASH_SHA256) {
+        sha256_final(&s, out);
+    } else {
+        uint64_t h = xxh3_digest(&x);
+        for (int i = 0; i < 8; i++) out[i] = (unsigned char)(h >> (56 - 8 * i));   // canonical
+    }
+    return total;
+}
+
+// Digest cache file layout: a header, then fixed-size records sorted by
+// (dev, ino, hash) so a mapped cache can be searched in place
+#define DIGEST_MAGIC "LSDGST\0\1"
+
+struct digest_header {
+    char magic[8];
+    uint64_t count;
+};
+
+struct digest_record {
+    uint64_t dev, ino;
+    int64_t size, mtime_sec, mtime_nsec;
+    uint8_t hash, len, pad[6];
+    uint8_t bytes[HASH_MAX];
+};
+
+struct ls_digest_cache {
+    // the previous run's digests, mapped read-only (NULL if none or unusable)
+    void *map;
+    size_t map_size;
+    const struct digest_record *old;
+    size_t old_count;
+
+    // this run's, written beside it and renamed over it on close
+    pthread_mutex_t lock;
+    char *path, *tmp_path;
+    FILE *out;
+    struct digest_record *records;
+    size_t count, cap;
+};
+
+struct ls_digest_cache *ls_digest_cache_open(const char *path) {
+    struct ls_digest_cache *c = calloc(1, sizeof(struct ls_digest_cache));
+    pthread_mutex_init(&c->lock, NULL);
+    c->path = strdup(path);
+    c->tmp_path = malloc(strlen(path) + 32);
+    sprintf(c->tmp_path, "%s.tmp.%ld", path, (long)getpid());
+
+    // created now, so that an unwritable cache is reported before the listing
+    c->out = fopen(c->tmp_path, "w");
+    if (!c->out) {
+        int saved = errno;
+        ls_digest_cache_close(c);
+        errno = saved;
+        return NULL;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct digest_header)) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            const struct digest_header *h = map;
+            size_t size = st.st_size;
+            if (memcmp(h->magic, DIGEST_MAGIC, 8) == 0 &&
+                h->count == (size - sizeof(*h)) / sizeof(struct digest_record)) {
+                c->map = map;
+                c->map_size = size;
+                c->old = (const struct digest_record *)(h + 1);
+                c->old_count = h->count;
+            } else {
+                munmap(map, size);
+            }
+        }
+    }
+    if (fd >= 0) close(fd);
+    return c;
+}
+
+static int compare_digest_records(const void *a, const void *b) {
+    const struct digest_record *x = a, *y = b;
+    if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+    if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+    return (int)x->hash - (int)y->hash;
+}
+
+int ls_digest_cache_close(struct ls_digest_cache *c) {
+    int rc = 0;
+    if (c->out) {
+        // one record per file, even if two operands overlapped
+        qsort(c->records, c->count, sizeof(struct digest_record), compare_digest_records);
+        size_t n = 0;
+        for (size_t i = 0; i < c->count; i++)
+            if (n == 0 || compare_digest_records(&c->records[n - 1], &c->records[i]) != 0)
+                c->records[n++] = c->records[i];
+        struct digest_header h = { DIGEST_MAGIC, n };
+        fwrite(&h, sizeof(h), 1, c->out);
+        fwrite(c->records, sizeof(struct digest_record), n, c->out);
+        if (ferror(c->out)) rc = -1;
+        if (fclose(c->out) != 0) rc = -1;
+        if (rc == 0 && rename(c->tmp_path, c->path) == -1) rc = -1;
+        if (rc == -1) unlink(c->tmp_path);
+    }
+    if (c->map) munmap(c->map, c->map_size);
+    free(c->records);
+    free(c->tmp_path);
+    free(c->path);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+    return rc;
+}
+
+static void digest_key(struct digest_record *r, const struct stat *st, enum ls_hash hash) {
+    memset(r, 0, sizeof(*r));
+    r->dev = st->st_dev;
+    r->ino = st->st_ino;
+    r->size = st->st_size;
+    r->mtime_sec = st->st_mtim.tv_sec;
+    r->mtime_nsec = st->st_mtim.tv_nsec;
+    r->hash = hash;
+    r->len = digest_size(hash);
+}
+
+// The previous run's digest of a file, if its size and mtime still match
+static int digest_lookup(const struct ls_digest_cache *c, const struct digest_record *key,
+                         unsigned char *out) {
+    if (!c->old) return 0;
+    const struct digest_record *r = bsearch(key, c->old, c->old_count, sizeof(struct digest_record),
+                                            compare_digest_records);
+    if (!r || r->size != key->size || r->mtime_sec != key->mtime_sec ||
+        r->mtime_nsec != key->mtime_nsec || r->len != key->len)
+        return 0;
+    memcpy(out, r->bytes, r->len);
+    return 1;
+}
+
+static void digest_append(struct ls_digest_cache *c, const struct digest_record *key,
+                          const unsigned char *bytes) {
+    // a file written during the read may change again within the same tick
+    struct timespec mtime = { key->mtime_sec, key->mtime_nsec }, ctime = mtime;
+    if (stamp_is_recent(&mtime, &ctime)) return;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 256;
+        c->records = realloc(c->records, sizeof(struct digest_record) * c->cap);
+    }
+    struct digest_record *r = &c->records[c->count++];
+    *r = *key;
+    memcpy(r->bytes, bytes, key->len);
+    pthread_mutex_unlock(&c->lock);
+}
+
+struct hash_pool {
+    struct ls_table *tab;
+    const struct ls_opts *opts;
+    const int *files;         // entry indices of the regular files
+    int n;
+    size_t chunk;
+    _Atomic int next;
+    _Atomic long hashed, hits;
+    _Atomic long long bytes;
+};
+
+static void *hash_thread(void *arg) {
+    struct hash_pool *p = arg;
+    struct ls_table *tab = p->tab;
+    int fd = tab->dir ? dirfd(tab->dir) : AT_FDCWD;
+    unsigned char *buf = malloc(p->chunk);
+    long hashed = 0, hits = 0;
+    long long bytes = 0;
+    int i;
+    while ((i = atomic_fetch_add(&p->next, 1)) < p->n) {
+        struct ls_entry *e = &tab->entries[p->files[i]];
+        struct ls_digest *d = &tab->digests[p->files[i]];
+        struct digest_record key;
+        digest_key(&key, &e->st, p->opts->hash);
+        if (p->opts->digests && digest_lookup(p->opts->digests, &key, d->bytes)) {
+            d->state = 1;
+            hits++;
+        } else {
+            // operands are paths of their own, followed as they were stat'd
+            long long r = hash_file(fd, e->name, tab->follow || !tab->dir, &e->st,
+                                    p->opts->hash, buf, p->chunk, d->bytes);
+            if (r == -1) {
+                d->state = -1;
+                dprintf(p->opts->err_fd, "hash %s: %s\n", e->name, strerror(errno));
+                continue;
+            }
+            d->state = 1;
+            hashed++;
+            bytes += r;
+        }
+        if (p->opts->digests) digest_append(p->opts->digests, &key, d->bytes);
+    }
+    free(buf);
+    atomic_fetch_add(&p->hashed, hashed);
+    atomic_fetch_add(&p->hits, hits);
+    atomic_fetch_add(&p->bytes, bytes);
+    return NULL;
+}
+
+// Digests the listed regular files of a stat'd table, on up to HASH_THREADS
+// threads: one per HASH_THREAD_BYTES to read, so that a directory of small
+// files is not paying for threads it cannot use
+static void hash_entries(struct ls_table *tab, const struct ls_opts *opts) {
+    if (!opts->hash || tab->digests || tab->spill || !tab->shown) return;
+    tab->digests = calloc(tab->shown, sizeof(struct ls_digest));
+    int *files = malloc(sizeof(int) * tab->shown);
+    int n = 0;
+    long long total = 0;
+    off_t largest = 0;
+    for (int i = 0; i < tab->shown; i++) {
+        struct ls_entry *e = &tab->entries[i];
+        tab->digests[i].len = digest_size(opts->hash);
+        if (e->stat_state != 1 || !S_ISREG(e->st.st_mode)) continue;
+        files[n++] = i;
+        total += e->st.st_size;
+        if (e->st.st_size > largest) largest = e->st.st_size;
+    }
+    if (n) {
+        struct hash_pool p = { tab, opts, files, n, 0, 0, 0, 0, 0 };
+        p.chunk = largest < HASH_CHUNK ? (size_t)largest + 1 : HASH_CHUNK;
+        if (p.chunk < 4096) p.chunk = 4096;
+        long long want = 1 + total / HASH_THREAD_BYTES;
+        int threads = want < HASH_THREADS ? (int)want : HASH_THREADS;
+        if (threads > n) threads = n;
+        pthread_t tids[HASH_THREADS];
+        int started = 0;
+        while (started < threads - 1 && pthread_create(&tids[started], NULL, hash_thread, &p) == 0)
+            started++;
+        hash_thread(&p);
+        for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+        tab->hashed += p.hashed;
+        tab->hash_hits += p.hits;
+        tab->hash_bytes += p.bytes;
+    }
+    free(files);
+}
+
+const char *ls_table_digest(const struct ls_table *t, size_t i, char *buf) {
+    if (!t->digests || i >= (size_t)t->shown || t->digests[i].state != 1) return NULL;
+    const struct ls_digest *d = &t->digests[i];
+    for (int k = 0; k < d->len; k++) sprintf(buf + 2 * k, "%02x", d->bytes[k]);
+    return buf;
+}
+
+// The digest column of entry i: NULL without --hash, else its hex or, for
+// entries without one, "" (records) or '-' and '?' padded to the column (-l)
+static const char *digest_cell(const struct ls_table *tab, int i, int padded, char *buf) {
+    if (!tab->digests) return NULL;
+    if (ls_table_digest(tab, i, buf)) return buf;
+    if (!padded) return "";
+    int width = 2 * tab->digests[i].len;
+    memset(buf, ' ', width);
+    buf[0] = tab->digests[i].state ? '?' : '-';
+    buf[width] = '\0';
+    return buf;
+}
+
+// -------------------- Spilled Runs --------------------
+// Under --memory-limit a directory's listed entries are sorted and written
+// out whenever they reach the table's budget, each batch a run in one
+// unlinked temp file. The printer then k-way merges the runs straight into
+// the output, so no more than a budget's worth of names is ever resident.
+// Records carry the stat fields the output needs, taken while the
+// directory is still open.
+#define SPILL_BUF        (32 << 10)   // per-run read buffer during the merge
+#define SPILL_COLUMN_BUF 4096         // per-column read buffer; holds any one record
+#define SPILL_MAX_WAY    64           // runs merged at once
+#define SPILL_MIN_BUDGET (256 << 10)
+
+struct spill_record {
+    uint64_t dev, ino;
+    int64_t size, blocks;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t mode, nlink, uid, gid;
+    uint8_t name_len;         // NAME_MAX is 255
+    uint8_t d_type;
+    uint8_t timed_out;        // stat_state -2: the fields are empty
+    uint8_t attrs;
+};
+
+static int spill_open(void) {
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !*dir) dir = "/tmp";
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) return fd;
+
+    // filesystems without O_TMPFILE: create, then unlink at once
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/ls-spill.XXXXXX", dir);
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd >= 0) unlink(path);
+    return fd;
+}
+
+static int spill_flush(struct ls_spill *sp, struct ls_out *buf) {
+    size_t done = 0;
+    while (done < buf->len) {
+        ssize_t n = pwrite(sp->fd, buf->buf + done, buf->len - done, sp->end + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    sp->end += buf->len;
+    buf->len = 0;
+    return 0;
+}
+
+static void spill_encode(struct ls_out *buf, const struct ls_entry *e) {
+    struct spill_record r = { 0 };
+    size_t len = entry_name_len(e);
+    r.dev = e->st.st_dev;
+    r.ino = e->st.st_ino;
+    r.size = e->st.st_size;
+    r.blocks = e->st.st_blocks;
+    r.mtime_sec = e->st.st_mtim.tv_sec;
+    r.mtime_nsec = e->st.st_mtim.tv_nsec;
+    r.mode = e->st.st_mode;
+    r.nlink = e->st.st_nlink;
+    r.uid = e->st.st_uid;
+    r.gid = e->st.st_gid;
+    r.name_len = len;
+    r.d_type = e->d_type;
+    r.timed_out = e->stat_state == -2;
+    r.attrs = e->attrs;
+    ls_out_write(buf, (const char *)&r, sizeof(r));
+    ls_out_write(buf, e->name, len);
+}
+
+static void spill_add_run(struct ls_spill *sp, uint64_t off) {
+    if (sp->nruns == sp->runs_cap) {
+        sp->runs_cap = sp->runs_cap ? sp->runs_cap * 2 : 16;
+        sp->runs = realloc(sp->runs, sizeof(struct spill_segment) * sp->runs_cap);
+    }
+    sp->runs[sp->nruns].off = off;
+    sp->runs[sp->nruns].len = sp->end - off;
+    sp->nruns++;
+}
+
+// Sorts, stats and writes out the listed entries held in memory. Listed
+// directories stay behind with the parked ones for -R to descend.
+static void spill_run(struct ls_table *tab, const struct ls_opts *opts) {
+    struct ls_spill *sp = tab->spill;
+    if (sp->failed || tab->shown == 0) return;
+    if (sp->fd == -1 && (sp->fd = spill_open()) == -1) {
+        dprintf(opts->err_fd, "ls: cannot create spill file: %s\n", strerror(errno));
+        sp->failed = 1;
+        return;
+    }
+
+    qsort(tab->entries, tab->shown, sizeof(struct ls_entry), compare_names);
+    stat_entries(tab, 0, tab->shown);
+    struct ls_out buf;
+    ls_out_init_mem(&buf);
+    uint64_t off = sp->end;
+    int ok = 1, count = 0;
+    for (int i = 0; i < tab->shown && ok; i++) {
+        struct ls_entry *e = &tab->entries[i];
+        if (!entry_listed(tab, e)) continue;
+        spill_encode(&buf, e);
+        count++;
+        if (buf.len >= SPILL_BUF) ok = spill_flush(sp, &buf) == 0;
+    }
+    if (ok) ok = spill_flush(sp, &buf) == 0;
+    ls_out_free(&buf);
+    if (!ok) {
+        // the runs already written are intact; this batch stays in memory
+        dprintf(opts->err_fd, "ls: cannot write spill file: %s\n", strerror(errno));
+        sp->end = off;
+        sp->failed = 1;
+        return;
+    }
+    spill_add_run(sp, off);
+    sp->count += count;
+
+    int kept = 0;
+    for (int i = 0; i < tab->shown; i++) {
+        struct ls_entry *e = &tab->entries[i];
+        if (opts->sizes && (e->stat_state == 1 || e->stat_state == -2) &&
+            !S_ISDIR(e->st.st_mode) && e->st.st_nlink == 1) {
+            sp->totals.apparent += e->st.st_size;
+            sp->totals.allocated += (unsigned long long)e->st.st_blocks * 512;
+            sp->totals.files++;
+        }
+        if (opts->recursive && entry_type(tab, e) == LS_TYPE_DIR) tab->entries[kept++] = *e;
+        else free(e->name);
+    }
+    memmove(&tab->entries[kept], &tab->entries[tab->shown],
+            sizeof(struct ls_entry) * (tab->count - tab->shown));
+    tab->count = kept + tab->count - tab->shown;
+    tab->shown = 0;
+    sp->shown_bytes = 0;
+}
+
+// Cursor over one run
+struct spill_cursor {
+    int fd;
+    uint64_t pos, end;
+    char *buf;
+    size_t len, at, cap;
+    struct ls_entry e;
+    char name[NAME_MAX + 1];
+    int err_fd;
+};
+
+static const struct ls_entry *spill_cursor_next(struct spill_cursor *c) {
+    struct spill_record r;
+    for (int pass = 0; pass < 2; pass++) {
+        size_t avail = c->len - c->at;
+        if (avail >= sizeof(r)) {
+            memcpy(&r, c->buf + c->at, sizeof(r));
+            if (avail - sizeof(r) >= r.name_len) {
+                memcpy(c->name, c->buf + c->at + sizeof(r), r.name_len);
+                c->name[r.name_len] = '\0';
+                c->at += sizeof(r) + r.name_len;
+
+                memset(&c->e, 0, sizeof(c->e));
+                c->e.name = c->name;
+                entry_scan_name(&c->e);
+                c->e.ino = r.ino;
+                c->e.d_type = r.d_type;
+                c->e.stat_state = r.timed_out ? -2 : 1;
+                c->e.attrs = r.attrs;
+                c->e.st.st_dev = r.dev;
+                c->e.st.st_ino = r.ino;
+                c->e.st.st_size = r.size;
+                c->e.st.st_blocks = r.blocks;
+                c->e.st.st_mtim.tv_sec = r.mtime_sec;
+                c->e.st.st_mtim.tv_nsec = r.mtime_nsec;
+                c->e.st.st_mode = r.mode;
+                c->e.st.st_nlink = r.nlink;
+                c->e.st.st_uid = r.uid;
+                c->e.st.st_gid = r.gid;
+                return &c->e;
+            }
+        }
+        if (pass || c->pos == c->end) break;
+        // refill behind the partial record left in the buffer
+        memmove(c->buf, c->buf + c->at, avail);
+        c->len = avail;
+        c->at = 0;
+        size_t want = c->cap - avail;
+        if (want > c->end - c->pos) want = c->end - c->pos;
+        ssize_t n;
+        while ((n = pread(c->fd, c->buf + c->len, want, c->pos)) < 0 && errno == EINTR) {}
+        if (n <= 0) {
+            dprintf(c->err_fd, "ls: cannot read spill file: %s\n",
+                    n < 0 ? strerror(errno) : "short file");
+            c->pos = c->end;
+            break;
+        }
+        c->pos += n;
+        c->len += n;
+    }
+    return NULL;
+}
+
+static void spill_cursor_open(struct spill_cursor *c, const struct ls_spill *sp, uint64_t off,
+                              uint64_t end, size_t cap) {
+    memset(c, 0, sizeof(*c));
+    c->fd = sp->fd;
+    c->err_fd = sp->err_fd;
+    c->pos = off;
+    c->end = end;
+    c->cap = cap;
+    c->buf = malloc(cap);
+}
+
+// File offset of the record the next call reads
+static uint64_t spill_cursor_tell(const struct spill_cursor *c) {
+    return c->pos - (c->len - c->at);
+}
+
+// k-way merge of runs through a binary min-heap on the current names
+struct spill_merge {
+    struct spill_cursor *c;
+    int *heap;
+    int n, last;
+};
+
+static int spill_less(struct spill_merge *m, int a, int b) {
+    return strcmp(m->c[m->heap[a]].e.name, m->c[m->heap[b]].e.name) < 0;
+}
+
+static void spill_sift_down(struct spill_merge *m, int i) {
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, min = i;
+        if (l < m->n && spill_less(m, l, min)) min = l;
+        if (r < m->n && spill_less(m, r, min)) min = r;
+        if (min == i) return;
+        int tmp = m->heap[i];
+        m->heap[i] = m->heap[min];
+        m->heap[min] = tmp;
+        i = min;
+    }
+}
+
+static void spill_merge_init(struct spill_merge *m, const struct ls_spill *sp,
+                             const struct spill_segment *runs, int nruns) {
+    m->c = calloc(nruns, sizeof(struct spill_cursor));
+    m->heap = malloc(sizeof(int) * nruns);
+    m->n = 0;
+    m->last = -1;
+    for (int i = 0; i < nruns; i++) {
+        struct spill_cursor *c = &m->c[i];
+        spill_cursor_open(c, sp, runs[i].off, runs[i].off + runs[i].len, SPILL_BUF);
+        if (spill_cursor_next(c)) m->heap[m->n++] = i;
+    }
+    for (int i = m->n / 2 - 1; i >= 0; i--) spill_sift_down(m, i);
+}
+
+// The next entry in name order; valid until the following call
+static const struct ls_entry *spill_merge_next(struct spill_merge *m) {
+    if (m->last >= 0) {
+        if (!spill_cursor_next(&m->c[m->heap[0]])) m->heap[0] = m->heap[--m->n];
+        spill_sift_down(m, 0);
+    }
+    if (m->n == 0) return NULL;
+    m->last = m->heap[0];
+    return &m->c[m->heap[0]].e;
+}
+
+static void spill_merge_free(struct spill_merge *m, int nruns) {
+    for (int i = 0; i < nruns; i++) free(m->c[i].buf);
+    free(m->c);
+    free(m->heap);
+}
+
+// Writes the last batch and merges runs down to SPILL_MAX_WAY, so the
+// final merge's buffers stay bounded; a table that never spilled goes back
+// to being an ordinary one
+static void spill_finish(struct ls_table *tab, const struct ls_opts *opts) {
+    struct ls_spill *sp = tab->spill;
+    if (sp->nruns == 0) {
+        spill_free(sp);
+        tab->spill = NULL;
+        return;
+    }
+    spill_run(tab, opts);
+    if (sp->failed && tab->shown) {
+        // these entries would be listed out of order with the runs
+        dprintf(opts->err_fd, "ls: listing is missing entries that could not be spilled\n");
+        for (int i = 0; i < tab->shown; i++) free(tab->entries[i].name);
+        memmove(&tab->entries[0], &tab->entries[tab->shown],
+                sizeof(struct ls_entry) * (tab->count - tab->shown));
+        tab->count -= tab->shown;
+        tab->shown = 0;
+    }
+
+    while (sp->nruns > SPILL_MAX_WAY) {
+        struct spill_merge m;
+        struct ls_out buf;
+        const struct ls_entry *e;
+        uint64_t off = sp->end;
+        int ok = 1;
+        spill_merge_init(&m, sp, sp->runs, SPILL_MAX_WAY);
+        ls_out_init_mem(&buf);
+        while (ok && (e = spill_merge_next(&m)) != NULL) {
+            spill_encode(&buf, e);
+            if (buf.len >= SPILL_BUF) ok = spill_flush(sp, &buf) == 0;
+        }
+        if (ok) ok = spill_flush(sp, &buf) == 0;
+        ls_out_free(&buf);
+        spill_merge_free(&m, SPILL_MAX_WAY);
+        if (!ok) {
+            // the runs are all still there; the final merge just uses more buffers
+            dprintf(opts->err_fd, "ls: cannot write spill file: %s\n", strerror(errno));
+            sp->end = off;
+            break;
+        }
+        struct spill_segment merged = { off, sp->end - off };
+        memmove(&sp->runs[1], &sp->runs[SPILL_MAX_WAY],
+                sizeof(struct spill_segment) * (sp->nruns - SPILL_MAX_WAY));
+        sp->runs[0] = merged;
+        sp->nruns -= SPILL_MAX_WAY - 1;
+    }
+}
+
+static void spill_free(struct ls_spill *sp) {
+    if (sp->fd >= 0) close(sp->fd);
+    free(sp->runs);
+    free(sp);
+}
+
+// -------------------- Sorting Function --------------------
+static int compare_names(const void *a, const void *b) {
+    const struct ls_entry *entryA = a;
+    const struct ls_entry *entryB = b;
+    return strcmp(entryA->name, entryB->name);
+}
+
+// -------------------- Table API --------------------
+int ls_scan(int dirfd, const struct ls_opts *opts, struct ls_table **out) {
+    // a fresh open file description, so the caller's offset is untouched
+    int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+
+    if (opts->cache) ls_cache_drain(opts->cache);
+    struct ls_table *t = malloc(sizeof(struct ls_table));
+    read_entries(dir, opts, t, 0);
+    qsort(t->entries, t->shown, sizeof(struct ls_entry), compare_names);
+    stat_entries(t, 0, t->shown);
+    hash_entries(t, opts);
+    table_store(opts, t);
+    *out = t;
+    return 0;
+}
+
+void ls_table_free(struct ls_table *t) {
+    if (!t) return;
+    free_entries(t);
+    free(t);
+}
+
+size_t ls_table_count(const struct ls_table *t) {
+    return t->shown;
+}
+
+const struct ls_entry *ls_table_entry(const struct ls_table *t, size_t i) {
+    return i < (size_t)t->shown ? &t->entries[i] : NULL;
+}
+
+void ls_iter_init(struct ls_iter *it, const struct ls_table *t) {
+    it->table = t;
+    it->next = 0;
+}
+
+const struct ls_entry *ls_iter_next(struct ls_iter *it) {
+    return ls_table_entry(it->table, it->next++);
+}
+
+// -------------------- Display Functions --------------------
+static void out_spaces(struct ls_out *out, int n) {
+    static const char spaces[] = "                                ";
+    while (n > 0) {
+        int k = n < (int)sizeof(spaces) - 1 ? n : (int)sizeof(spaces) - 1;
+        ls_out_write(out, spaces, k);
+        n -= k;
+    }
+}
+
+// A number right-aligned in width columns, as printf("%*llu") writes it
+// (with a '-' ahead if negative), minus the format parsing
+static void out_number(struct ls_out *out, unsigned long long v, int negative, int width) {
+    char buf[24], *p = buf + sizeof(buf);
+    do *--p = '0' + v % 10; while (v /= 10);
+    if (negative) *--p = '-';
+    int len = buf + sizeof(buf) - p;
+    out_spaces(out, width - len);
+    ls_out_write(out, p, len);
+}
+
+static void out_signed(struct ls_out *out, long long v, int width) {
+    out_number(out, v < 0 ? -(unsigned long long)v : (unsigned long long)v, v < 0, width);
+}
+
+// The row of an entry whose stat timed out: '?' in the usual columns
+static void long_row_unknown(struct ls_out *out, const struct ls_entry *e, const char *hash) {
+    ls_out_printf(out, "??????????%s %2s ? ? %6s %12s ", e->attrs ? " " : "", "?", "?", "?");
+    if (hash) ls_out_printf(out, "%s ", hash);
+    out_display_name(out, e);
+    ls_out_putc(out, '\n');
+}
+
+// Links, owner, group, size and mtime: the columns every -l row has
+static void long_row_fields(struct ls_out *out, const struct stat *st) {
+    out_number(out, st->st_nlink, 0, 2);
+    ls_out_putc(out, ' ');
+    ls_out_puts(out, ls_user_name(st->st_uid));
+    ls_out_putc(out, ' ');
+    ls_out_puts(out, ls_group_name(st->st_gid));
+    ls_out_putc(out, ' ');
+    out_signed(out, st->st_size, 6);
+    ls_out_putc(out, ' ');
+
+    char time_buf[20];
+    struct tm tm_info;
+    localtime_r(&st->st_mtime, &tm_info);
+    ls_out_write(out, time_buf, strftime(time_buf, sizeof(time_buf), "%b %d %H:%M", &tm_info));
+    ls_out_putc(out, ' ');
+}
+
+// Each -l row emitter is stamped out for one combination of colors (COLOR),
+// a digest column (HASH) and --xattrs marks (MARKS), given as literal 0 or
+// 1, so the tests for the others compile away and a row runs straight
+// through. hash may still be NULL in a HASH emitter, for a table without
+// digests.
+#define DEFINE_LONG_ROW(name, COLOR, HASH, MARKS)                                        \
+    static void name(struct ls_out *out, const char *dirname, const struct ls_entry *e, \
+                     const char *hash) {                                                 \
+        (void)dirname;                                                                   \
+        if (e->stat_state == -2) {                                                       \
+            long_row_unknown(out, e, HASH ? hash : NULL);                                \
+            return;                                                                      \
+        }                                                                                \
+        print_permissions(out, e->st.st_mode, MARKS ? attr_mark(e) : 0);                 \
+        long_row_fields(out, &e->st);                                                    \
+        if (HASH && hash) {                                                              \
+            ls_out_puts(out, hash);                                                      \
+            ls_out_putc(out, ' ');                                                       \
+        }                                                                                \
+        const char *seq = COLOR ? get_color(e, &e->st) : NULL;                           \
+        if (COLOR && seq) ls_out_puts(out, seq);                                         \
+        out_display_name(out, e);                                                        \
+        if (COLOR && seq) ls_out_puts(out, COLOR_RESET);                                 \
+        ls_out_putc(out, '\n');                                                          \
+    }
+
+DEFINE_LONG_ROW(long_row_plain,            0, 0, 0)
+DEFINE_LONG_ROW(long_row_marks,            0, 0, 1)
+DEFINE_LONG_ROW(long_row_hash,             0, 1, 0)
+DEFINE_LONG_ROW(long_row_hash_marks,       0, 1, 1)
+DEFINE_LONG_ROW(long_row_color,            1, 0, 0)
+DEFINE_LONG_ROW(long_row_color_marks,      1, 0, 1)
+DEFINE_LONG_ROW(long_row_color_hash,       1, 1, 0)
+DEFINE_LONG_ROW(long_row_color_hash_marks, 1, 1, 1)
+
+static const row_emitter long_row_emitters[2][2][2] = {   // [color][hash][marks]
+    { { long_row_plain, long_row_marks }, { long_row_hash, long_row_hash_marks } },
+    { { long_row_color, long_row_color_marks }, { long_row_color_hash, long_row_color_hash_marks } },
+};
+
+// One row outside a listing's loop; hash is the --hash column (see
+// digest_cell), or NULL for none
+static void format_long_row(struct ls_out *out, const struct ls_entry *e, int color,
+                            const char *hash) {
+    long_row_emitters[!!color][hash != NULL][e->attrs != 0](out, NULL, e, hash);
+}
+
+int ls_format_long(const struct ls_entry *e, int color, char *buf, size_t cap) {
+    struct ls_out o;
+    ls_out_init_buf(&o, buf, cap ? cap - 1 : 0);
+    if (e->stat_state == 1 || e->stat_state == -2) format_long_row(&o, e, color, NULL);
+    if (cap) buf[o.len] = '\0';
+    return (int)(o.len + o.dropped);
+}
+
+// The row loops stop once a write has failed: nothing more would be seen
+static void long_rows(struct ls_table *tab, int from, int to, row_emitter emit,
+                      struct ls_out *out) {
+    char hash[2 * HASH_MAX + 1];
+    for (int i = from; i < to && !out->err; i++) {
+        struct ls_entry *e = &tab->entries[i];
+        if (!entry_listed(tab, e)) continue;
+        emit(out, NULL, e, digest_cell(tab, i, 1, hash));
+    }
+}
+
+static void list_long(struct ls_table *tab, row_emitter emit, struct ls_out *out) {
+    long_rows(tab, 0, tab->shown, emit, out);
+}
+
+// The name cells, stamped out with and without colors (COLOR, 0 or 1) as
+// the -l rows are; only a stat'd entry has a color
+#define DEFINE_NAME_CELL(name, COLOR)                                                  \
+    static void name(struct ls_out *out, const struct ls_entry *e, int width) {        \
+        const char *seq = COLOR && e->stat_state == 1 ? get_color(e, &e->st) : NULL;   \
+        if (COLOR && seq) ls_out_puts(out, seq);                                       \
+        out_display_name(out, e);                                                      \
+        out_spaces(out, width - entry_name_width(e));                                  \
+        if (COLOR && seq) ls_out_puts(out, COLOR_RESET);                               \
+    }
+
+DEFINE_NAME_CELL(name_cell_plain, 0)
+DEFINE_NAME_CELL(name_cell_color, 1)
+
+static cell_emitter pick_name_cell(const struct ls_opts *opts) {
+    return opts->color ? name_cell_color : name_cell_plain;
+}
+
+// -------------------- Column Layout --------------------
+// GNU ls's layout: each column is as wide as its own longest name plus a
+// two-space gap (none after the last), and a listing takes as many columns
+// as fit in the line. Every candidate column count is sized in the same one
+// pass over the cached name widths, so the cost is the entry count times
+// the columns a line could hold rather than a full retry per count, and a
+// count drops out of the pass as soon as it overflows the line.
+#define MIN_COLUMN_WIDTH 3   // one character and the gap
+
+struct column_layout {
+    int cols, rows;
+    int *widths;              // per column, gap included
+};
+
+// The pass itself, fed one name width at a time in listing order, so a
+// spilled listing can size its columns from a merge of its runs
+struct layout_sizer {
+    int term_width, by_columns;
+    int *arr;                 // candidate k (k + 1 columns) keeps its widths
+                              // at arr + k * (k + 1) / 2
+    int *line_len, *rows;
+    int *live, nlive;         // the candidates still within the line, in no
+                              // order; one column always fits, however long
+};
+
+// by_columns: names run down the columns (the default layout), else
+// across the rows (-x); n is the number of names to come
+static void layout_sizer_init(struct layout_sizer *z, int n, int term_width, int by_columns) {
+    int max_cols = term_width / MIN_COLUMN_WIDTH + (term_width % MIN_COLUMN_WIDTH != 0);
+    if (max_cols > n) max_cols = n;
+    if (max_cols < 1) max_cols = 1;
+    z->term_width = term_width;
+    z->by_columns = by_columns;
+    z->arr = malloc(sizeof(int) * ((size_t)max_cols * (max_cols + 1) / 2));
+    z->line_len = malloc(sizeof(int) * max_cols);
+    z->rows = malloc(sizeof(int) * max_cols);
+    for (int k = 0; k < max_cols; k++) {
+        int *w = z->arr + (size_t)k * (k + 1) / 2;
+        for (int c = 0; c <= k; c++) w[c] = MIN_COLUMN_WIDTH;
+        z->line_len[k] = (k + 1) * MIN_COLUMN_WIDTH;
+        z->rows[k] = (n + k) / (k + 1);
+    }
+    z->live = malloc(sizeof(int) * max_cols);
+    z->nlive = 0;
+    for (int k = 1; k < max_cols; k++) z->live[z->nlive++] = k;
+}
+
+// Takes the width of name i; returns 0 once only one column is left, when
+// the rest of the names no longer matter
+static int layout_sizer_add(struct layout_sizer *z, int i, int len) {
+    for (int j = 0; j < z->nlive; ) {
+        int k = z->live[j];
+        int c = z->by_columns ? i / z->rows[k] : i % (k + 1);
+        int *w = z->arr + (size_t)k * (k + 1) / 2;
+        int real = len + (c == k ? 0 : 2);
+        if (w[c] < real) {
+            z->line_len[k] += real - w[c];
+            w[c] = real;
+            if (z->line_len[k] >= z->term_width) {
+                z->live[j] = z->live[--z->nlive];
+                continue;
+            }
+        }
+        j++;
+    }
+    return z->nlive;
+}
+
+// Picks the most columns that fit out of n names, and frees the sizer
+static void layout_sizer_finish(struct layout_sizer *z, int n, struct column_layout *lay) {
+    int best = 0;
+    for (int j = 0; j < z->nlive; j++)
+        if (z->live[j] > best) best = z->live[j];
+    lay->cols = best + 1;
+    lay->rows = n ? (n + best) / (best + 1) : 0;
+    lay->widths = malloc(sizeof(int) * (best + 1));
+    memcpy(lay->widths, z->arr + (size_t)best * (best + 1) / 2, sizeof(int) * (best + 1));
+    free(z->live);
+    free(z->arr);
+    free(z->line_len);
+    free(z->rows);
+}
+
+static void layout_columns(struct ls_table *tab, int term_width, int by_columns,
+                           struct column_layout *lay) {
+    struct layout_sizer z;
+    int n = tab->shown;
+    layout_sizer_init(&z, n, term_width, by_columns);
+    for (int i = 0; i < n && layout_sizer_add(&z, i, entry_measure(&tab->entries[i])); i++) {}
+    layout_sizer_finish(&z, n, lay);
+}
+
+// One name of a row: the padding owed by the cell before it (in *pad) is
+// written only once another name follows, so rows carry no trailing blanks
+static void layout_name(const struct ls_entry *e, int width, int *pad, cell_emitter cell,
+                        struct ls_out *out) {
+    out_spaces(out, *pad);
+    cell(out, e, 0);
+    *pad = width - entry_name_width(e);
+}
+
+// One cell of a row; a cell whose entry is not listed stays empty
+static void layout_cell(struct ls_table *tab, struct ls_entry *e, int width, int *pad,
+                        cell_emitter cell, struct ls_out *out) {
+    if (!entry_listed(tab, e)) {
+        *pad += width;
+        return;
+    }
+    layout_name(e, width, pad, cell, out);
+}
+
+static void list_columns(struct ls_table *tab, int term_width, cell_emitter cell,
+                         struct ls_out *out) {
+    struct column_layout lay;
+    layout_columns(tab, term_width, 1, &lay);
+    for (int r = 0; r < lay.rows && !out->err; r++) {
+        int pad = 0;
+        for (int c = 0, idx = r; c < lay.cols && idx < tab->shown; c++, idx += lay.rows)
+            layout_cell(tab, &tab->entries[idx], lay.widths[c], &pad, cell, out);
+        ls_out_putc(out, '\n');
+    }
+    free(lay.widths);
+}
+
+// Entries [from, to) of an -x listing; *pad carries the padding over
+static void horizontal_rows(struct ls_table *tab, int from, int to, const struct column_layout *lay,
+                            int *pad, cell_emitter cell, struct ls_out *out) {
+    for (int i = from; i < to && !out->err; i++) {
+        int c = i % lay->cols;
+        if (c == 0 && i > 0) {
+            ls_out_putc(out, '\n');
+            *pad = 0;
+        }
+        layout_cell(tab, &tab->entries[i], lay->widths[c], pad, cell, out);
+    }
+}
+
+static void list_horizontal(struct ls_table *tab, int term_width, cell_emitter cell,
+                            struct ls_out *out) {
+    struct column_layout lay;
+    int pad = 0;
+    layout_columns(tab, term_width, 0, &lay);
+    horizontal_rows(tab, 0, tab->shown, &lay, &pad, cell, out);
+    ls_out_putc(out, '\n');
+    free(lay.widths);
+}
+
+// -------------------- Machine-Readable Records --------------------
+// Fields: dir, name, type, mode, size, mtime_ns, uid, gid, inode. They come
+// straight from the cached stats; no color, terminal size or width pass.
+static char type_letter(mode_t mode) {
+    if (S_ISREG(mode))  return 'f';
+    if (S_ISDIR(mode))  return 'd';
+    if (S_ISLNK(mode))  return 'l';
+    if (S_ISFIFO(mode)) return 'p';
+    if (S_ISSOCK(mode)) return 's';
+    if (S_ISCHR(mode))  return 'c';
+    if (S_ISBLK(mode))  return 'b';
+    return '?';
+}
+
+// TSV: tab, newline, CR and backslash are written as \t \n \r and a doubled backslash
+static void out_tsv_field(struct ls_out *out, const char *s) {
+    const char *run = s;
+    for (; *s; s++) {
+        const char *esc = NULL;
+        switch (*s) {
+            case '\t': esc = "\\t"; break;
+            case '\n': esc = "\\n"; break;
+            case '\r': esc = "\\r"; break;
+            case '\\': esc = "\\\\"; break;
+        }
+        if (!esc) continue;
+        ls_out_write(out, run, s - run);
+        ls_out_write(out, esc, 2);
+        run = s + 1;
+    }
+    ls_out_write(out, run, s - run);
+}
+
+// Length of the valid UTF-8 sequence at s, or 0 if it is malformed
+static int utf8_seq_len(const unsigned char *s) {
+    int n;
+    if (s[0] < 0xC2) return 0;
+    else if (s[0] < 0xE0) n = 2;
+    else if (s[0] < 0xF0) n = 3;
+    else if (s[0] < 0xF5) n = 4;
+    else return 0;
+    for (int i = 1; i < n; i++)
+        if ((s[i] & 0xC0) != 0x80) return 0;
+    if (n == 3 && ((s[0] == 0xE0 && s[1] < 0xA0) || (s[0] == 0xED && s[1] >= 0xA0))) return 0;
+    if (n == 4 && ((s[0] == 0xF0 && s[1] < 0x90) || (s[0] == 0xF4 && s[1] >= 0x90))) return 0;
+    return n;
+}
+
+// A name the scan found nothing to escape in is written as it is
+static void out_tsv_name(struct ls_out *out, const struct ls_entry *e) {
+    if (e->name_len && !(e->name_flags & (LS_NAME_CTRL | LS_NAME_QUOTE)))
+        ls_out_write(out, e->name, e->name_len);
+    else
+        out_tsv_field(out, e->name);
+}
+
+// JSON strings must be UTF-8; bytes that aren't are written as \u00XX
+static void out_json_string(struct ls_out *out, const char *str) {
+    const unsigned char *s = (const unsigned char *)str;
+    const unsigned char *run = s;
+    ls_out_putc(out, '"');
+    while (*s) {
+        if (*s >= 0x20 && *s < 0x80 && *s != '"' && *s != '\\') { s++; continue; }
+        if (*s >= 0x80) {
+            int n = utf8_seq_len(s);
+            if (n) { s += n; continue; }
+        }
+        ls_out_write(out, (const char *)run, s - run);
+        if (*s == '"' || *s == '\\') {
+            ls_out_putc(out, '\\');
+            ls_out_putc(out, *s);
+        } else {
+            ls_out_printf(out, "\\u%04x", *s);
+        }
+        run = ++s;
+    }
+    ls_out_write(out, (const char *)run, s - run);
+    ls_out_putc(out, '"');
+}
+
+static void out_json_name(struct ls_out *out, const struct ls_entry *e) {
+    if (e->name_len && !(e->name_flags & (LS_NAME_CTRL | LS_NAME_HIGH | LS_NAME_QUOTE))) {
+        ls_out_putc(out, '"');
+        ls_out_write(out, e->name, e->name_len);
+        ls_out_putc(out, '"');
+    } else {
+        out_json_string(out, e->name);
+    }
+}
+
+// The record of an entry whose stat timed out: type '?' and the metadata
+// fields empty (null in JSON)
+static void record_unknown(struct ls_out *out, enum ls_format format, const char *dirname,
+                           const struct ls_entry *e) {
+    switch (format) {
+        case LS_FORMAT_NULL:
+            ls_out_write(out, dirname, strlen(dirname) + 1);
+            ls_out_write(out, e->name, entry_name_len(e) + 1);
+            ls_out_write(out, "?\0\0\0\0\0\0\0", 8);
+            break;
+        case LS_FORMAT_JSONL:
+            ls_out_puts(out, "{\"dir\":");
+            out_json_string(out, dirname);
+            ls_out_puts(out, ",\"name\":");
+            out_json_name(out, e);
+            ls_out_puts(out, ",\"type\":\"?\",\"mode\":null,\"size\":null,\"mtime_ns\":null,"
+                             "\"uid\":null,\"gid\":null,\"inode\":null");
+            break;
+        default:
+            out_tsv_field(out, dirname);
+            ls_out_putc(out, '\t');
+            out_tsv_name(out, e);
+            ls_out_puts(out, "\t?\t\t\t\t\t\t");
+    }
+}
+
+static void out_mode_octal(struct ls_out *out, mode_t mode) {
+    char digits[4] = { '0' + (mode >> 9 & 7), '0' + (mode >> 6 & 7), '0' + (mode >> 3 & 7),
+                       '0' + (mode & 7) };
+    ls_out_write(out, digits, 4);
+}
+
+static long long entry_mtime_ns(const struct ls_entry *e) {
+    return (long long)e->st.st_mtim.tv_sec * 1000000000LL + e->st.st_mtim.tv_nsec;
+}
+
+// nine NUL-terminated fields per record (ten with --hash)
+static void record_null(struct ls_out *out, const char *dirname, const struct ls_entry *e) {
+    const struct stat *st = &e->st;
+    ls_out_write(out, dirname, strlen(dirname) + 1);
+    ls_out_write(out, e->name, entry_name_len(e) + 1);
+    ls_out_putc(out, type_letter(st->st_mode));
+    ls_out_putc(out, '\0');
+    out_mode_octal(out, st->st_mode);
+    ls_out_putc(out, '\0');
+    out_signed(out, st->st_size, 0);
+    ls_out_putc(out, '\0');
+    out_signed(out, entry_mtime_ns(e), 0);
+    ls_out_putc(out, '\0');
+    out_number(out, st->st_uid, 0, 0);
+    ls_out_putc(out, '\0');
+    out_number(out, st->st_gid, 0, 0);
+    ls_out_putc(out, '\0');
+    out_number(out, st->st_ino, 0, 0);
+    ls_out_putc(out, '\0');
+}
+
+static void record_jsonl(struct ls_out *out, const char *dirname, const struct ls_entry *e) {
+    const struct stat *st = &e->st;
+    ls_out_puts(out, "{\"dir\":");
+    out_json_string(out, dirname);
+    ls_out_puts(out, ",\"name\":");
+    out_json_name(out, e);
+    ls_out_puts(out, ",\"type\":\"");
+    ls_out_putc(out, type_letter(st->st_mode));
+    ls_out_puts(out, "\",\"mode\":");
+    out_number(out, st->st_mode & 07777, 0, 0);
+    ls_out_puts(out, ",\"size\":");
+    out_signed(out, st->st_size, 0);
+    ls_out_puts(out, ",\"mtime_ns\":");
+    out_signed(out, entry_mtime_ns(e), 0);
+    ls_out_puts(out, ",\"uid\":");
+    out_number(out, st->st_uid, 0, 0);
+    ls_out_puts(out, ",\"gid\":");
+    out_number(out, st->st_gid, 0, 0);
+    ls_out_puts(out, ",\"inode\":");
+    out_number(out, st->st_ino, 0, 0);
+}
+
+static void record_tsv(struct ls_out *out, const char *dirname, const struct ls_entry *e) {
+    const struct stat *st = &e->st;
+    out_tsv_field(out, dirname);
+    ls_out_putc(out, '\t');
+    out_tsv_name(out, e);
+    ls_out_putc(out, '\t');
+    ls_out_putc(out, type_letter(st->st_mode));
+    ls_out_putc(out, '\t');
+    out_mode_octal(out, st->st_mode);
+    ls_out_putc(out, '\t');
+    out_signed(out, st->st_size, 0);
+    ls_out_putc(out, '\t');
+    out_signed(out, entry_mtime_ns(e), 0);
+    ls_out_putc(out, '\t');
+    out_number(out, st->st_uid, 0, 0);
+    ls_out_putc(out, '\t');
+    out_number(out, st->st_gid, 0, 0);
+    ls_out_putc(out, '\t');
+    out_number(out, st->st_ino, 0, 0);
+}
+
+// Record emitters, stamped out per format (FORMAT, a literal ls_format) and
+// digest field (HASH, 0 or 1) as the -l rows are. The hash is hex, so it
+// needs no escaping in any format.
+#define DEFINE_RECORD(name, FORMAT, HASH)                                                \
+    static void name(struct ls_out *out, const char *dirname, const struct ls_entry *e, \
+                     const char *hash) {                                                 \
+        if (e->stat_state == -2) record_unknown(out, FORMAT, dirname, e);                \
+        else if (FORMAT == LS_FORMAT_NULL) record_null(out, dirname, e);                 \
+        else if (FORMAT == LS_FORMAT_JSONL) record_jsonl(out, dirname, e);               \
+        else record_tsv(out, dirname, e);                                                \
+        if (FORMAT == LS_FORMAT_NULL) {                                                  \
+            if (HASH && hash) ls_out_write(out, hash, strlen(hash) + 1);                 \
+        } else if (FORMAT == LS_FORMAT_JSONL) {                                          \
+            if (HASH && hash && *hash) {                                                 \
+                ls_out_puts(out, ",\"hash\":\"");                                        \
+                ls_out_puts(out, hash);                                                  \
+                ls_out_putc(out, '"');                                                   \
+            } else if (HASH && hash) {                                                   \
+                ls_out_puts(out, ",\"hash\":null");                                      \
+            }                                                                            \
+            ls_out_puts(out, "}\n");                                                     \
+        } else {                                                                         \
+            if (HASH && hash) {                                                          \
+                ls_out_putc(out, '\t');                                                  \
+                ls_out_puts(out, hash);                                                  \
+            }                                                                            \
+            ls_out_putc(out, '\n');                                                      \
+        }                                                                                \
+    }
+
+DEFINE_RECORD(record_null_plain,  LS_FORMAT_NULL,  0)
+DEFINE_RECORD(record_null_hash,   LS_FORMAT_NULL,  1)
+DEFINE_RECORD(record_jsonl_plain, LS_FORMAT_JSONL, 0)
+DEFINE_RECORD(record_jsonl_hash,  LS_FORMAT_JSONL, 1)
+DEFINE_RECORD(record_tsv_plain,   LS_FORMAT_TSV,   0)
+DEFINE_RECORD(record_tsv_hash,    LS_FORMAT_TSV,   1)
+
+static const row_emitter record_emitters[][2] = {   // [format][hash]
+    [LS_FORMAT_NULL]  = { record_null_plain,  record_null_hash },
+    [LS_FORMAT_JSONL] = { record_jsonl_plain, record_jsonl_hash },
+    [LS_FORMAT_TSV]   = { record_tsv_plain,   record_tsv_hash },
+};
+
+// One record outside a listing's loop; hash is the --hash field (see
+// digest_cell), appended last; NULL for none
+static void format_record(struct ls_out *out, enum ls_format format, const char *dirname,
+                          const struct ls_entry *e, const char *hash) {
+    record_emitters[format][hash != NULL](out, dirname, e, hash);
+}
+
+int ls_format_record(enum ls_format format, const char *dir, const struct ls_entry *e,
+                     char *buf, size_t cap) {
+    struct ls_out o;
+    ls_out_init_buf(&o, buf, cap ? cap - 1 : 0);
+    if ((e->stat_state == 1 || e->stat_state == -2) && format != LS_FORMAT_HUMAN)
+        format_record(&o, format, dir, e, NULL);
+    if (cap) buf[o.len] = '\0';
+    return (int)(o.len + o.dropped);
+}
+
+static void record_rows(struct ls_table *tab, int from, int to, const char *dirname,
+                        row_emitter emit, struct ls_out *out) {
+    char hash[2 * HASH_MAX + 1];
+    for (int i = from; i < to && !out->err; i++) {
+        struct ls_entry *e = &tab->entries[i];
+        if (!entry_listed(tab, e)) continue;
+        emit(out, dirname, e, digest_cell(tab, i, 0, hash));
+    }
+}
+
+static void list_records(struct ls_table *tab, const char *dirname, row_emitter emit,
+                         struct ls_out *out) {
+    record_rows(tab, 0, tab->shown, dirname, emit, out);
+}
+
+// The emitter for every -l row or record of a listing with these options,
+// picked once per listing; human output other than -l has no rows of this kind
+static row_emitter pick_row_emitter(const struct ls_opts *opts) {
+    int hash = opts->hash != LS_HASH_NONE;
+    if (opts->format != LS_FORMAT_HUMAN) return record_emitters[opts->format][hash];
+    return long_row_emitters[!!opts->color][hash][!!opts->xattrs];
+}
+
+// One change record: the entry's record (or, for human output, its path or
+// its long row with the path as name) prefixed with the event character;
+// emit is the listing's (see pick_row_emitter)
+static void format_change(struct ls_out *out, const struct ls_opts *opts, row_emitter emit,
+                          char event, const char *dirname, const struct ls_entry *e) {
+    if (opts->format == LS_FORMAT_HUMAN) {
+        if (opts->display != LS_LONG) {
+            ls_out_printf(out, "%c %s/%s\n", event, dirname, e->name);
+            return;
+        }
+        struct ls_entry shown = *e;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dirname, e->name);
+        shown.name = path;
+        shown.name_len = 0;
+        shown.name_width = 0;
+        ls_out_printf(out, "%c ", event);
+        emit(out, NULL, &shown, NULL);
+        return;
+    }
+    struct ls_out mem;
+    ls_out_init_mem(&mem);
+    emit(&mem, dirname, e, NULL);
+    switch (opts->format) {
+        case LS_FORMAT_JSONL:
+            ls_out_printf(out, "{\"event\":\"%c\",", event);
+            ls_out_write(out, mem.buf + 1, mem.len - 1);
+            break;
+        case LS_FORMAT_NULL:
+            ls_out_putc(out, event);
+            ls_out_putc(out, '\0');
+            ls_out_write(out, mem.buf, mem.len);
+            break;
+        default:
+            ls_out_printf(out, "%c\t", event);
+            ls_out_write(out, mem.buf, mem.len);
+    }
+    ls_out_free(&mem);
+}
+
+// Whether two stats of one name differ in anything a listing shows
+static int stat_differs(const struct stat *a, const struct stat *b) {
+    return a->st_mode != b->st_mode || a->st_size != b->st_size || a->st_nlink != b->st_nlink ||
+           a->st_uid != b->st_uid || a->st_gid != b->st_gid || a->st_ino != b->st_ino ||
+           a->st_mtim.tv_sec != b->st_mtim.tv_sec || a->st_mtim.tv_nsec != b->st_mtim.tv_nsec;
+}
+
+// -------------------- Snapshots --------------------
+// File layout: a header, then for each listed directory its path (NUL-
+// terminated) and its listed entries in name order, each a snapshot_entry
+// followed by the name bytes, then the directory table sorted by path.
+// --since walks the live tables and the snapshot's blocks side by side.
+#define SNAPSHOT_MAGIC "LSSNAP\0\1"
+
+struct snapshot_header {
+    char magic[8];
+    uint64_t dirs_off;
+    uint64_t ndirs;
+};
+
+struct snapshot_entry {
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t mode, nlink, uid, gid;
+    uint16_t name_len;
+    uint16_t pad;
+};
+
+struct snapshot_dir {
+    uint64_t path_off, path_len;
+    uint64_t off, len;        // entry block
+    uint64_t count;
+};
+
+// A directory written by this run, with its path kept for sorting
+struct snapshot_written {
+    char *path;
+    struct snapshot_dir dir;
+};
+
+struct ls_snapshot {
+    // --since: a previous snapshot, mapped read-only
+    const char *map;
+    size_t map_size;
+    const struct snapshot_dir *dirs;
+    size_t ndirs;
+
+    // --snapshot: written beside its path and renamed over it on close
+    char *path, *tmp_path;
+    FILE *out;
+    uint64_t pos;
+    struct snapshot_written *new_dirs;
+    size_t new_count, new_cap;
+    int err;
+    int incomplete;           // a directory or a stat was cut off by --deadline
+                              // or --stat-timeout: not written at all
+};
+
+struct ls_snapshot *ls_snapshot_create(const char *path) {
+    struct ls_snapshot *s = calloc(1, sizeof(struct ls_snapshot));
+    s->path = strdup(path);
+    s->tmp_path = malloc(strlen(path) + 32);
+    sprintf(s->tmp_path, "%s.tmp.%ld", path, (long)getpid());
+    s->out = fopen(s->tmp_path, "w");
+    if (!s->out) {
+        int saved = errno;
+        ls_snapshot_close(s);
+        errno = saved;
+        return NULL;
+    }
+    setvbuf(s->out, NULL, _IOFBF, 1 << 16);
+    struct snapshot_header h = { SNAPSHOT_MAGIC, 0, 0 };
+    fwrite(&h, sizeof(h), 1, s->out);
+    s->pos = sizeof(h);
+    return s;
+}
+
+struct ls_snapshot *ls_snapshot_load(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct snapshot_header))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // checked once here, so the diff can trust every offset
+    const struct snapshot_header *h = map;
+    size_t size = st.st_size;
+    int ok = memcmp(h->magic, SNAPSHOT_MAGIC, 8) == 0 && h->dirs_off % 8 == 0 &&
+             h->dirs_off <= size && h->ndirs <= (size - h->dirs_off) / sizeof(struct snapshot_dir);
+    const struct snapshot_dir *dirs = (const struct snapshot_dir *)((const char *)map + h->dirs_off);
+    for (uint64_t i = 0; ok && i < h->ndirs; i++) {
+        const struct snapshot_dir *d = &dirs[i];
+        ok = d->path_off < size && d->path_len < size - d->path_off &&
+             ((const char *)map)[d->path_off + d->path_len] == '\0' &&
+             d->off <= size && d->len <= size - d->off;
+    }
+    if (!ok) {
+        munmap(map, size);
+        errno = EINVAL;
+        return NULL;
+    }
+    struct ls_snapshot *s = calloc(1, sizeof(struct ls_snapshot));
+    s->map = map;
+    s->map_size = size;
+    s->dirs = dirs;
+    s->ndirs = h->ndirs;
+    return s;
+}
+
+static const char *snapshot_dir_path(const struct ls_snapshot *s, const struct snapshot_dir *d) {
+    return s->map + d->path_off;
+}
+
+static int compare_written(const void *a, const void *b) {
+    const struct snapshot_written *x = a, *y = b;
+    return strcmp(x->path, y->path);
+}
+
+int ls_snapshot_close(struct ls_snapshot *s) {
+    int rc = 0;
+    if (s->out && s->incomplete) {
+        // what is missing would come back as added in the next report
+        fclose(s->out);
+        unlink(s->tmp_path);
+        rc = -1;
+    } else if (s->out) {
+        qsort(s->new_dirs, s->new_count, sizeof(struct snapshot_written), compare_written);
+        static const char zeros[8];
+        uint64_t pad = (8 - s->pos % 8) % 8;
+        fwrite(zeros, 1, pad, s->out);
+        size_t n = 0;
+        for (size_t i = 0; i < s->new_count; i++) {
+            // one block per path, even if two operands overlapped
+            if (i > 0 && strcmp(s->new_dirs[i].path, s->new_dirs[i - 1].path) == 0) continue;
+            fwrite(&s->new_dirs[i].dir, sizeof(struct snapshot_dir), 1, s->out);
+            n++;
+        }
+        struct snapshot_header h = { SNAPSHOT_MAGIC, s->pos + pad, n };
+        if (fseek(s->out, 0, SEEK_SET) == 0) fwrite(&h, sizeof(h), 1, s->out);
+        if (ferror(s->out) || s->err) rc = -1;
+        if (fclose(s->out) != 0) rc = -1;
+        if (rc == 0 && rename(s->tmp_path, s->path) == -1) rc = -1;
+        if (rc == -1) unlink(s->tmp_path);
+    }
+    if (s->map) munmap((void *)s->map, s->map_size);
+    for (size_t i = 0; i < s->new_count; i++) free(s->new_dirs[i].path);
+    free(s->new_dirs);
+    free(s->tmp_path);
+    free(s->path);
+    if (rc == -1) errno = s->incomplete ? ETIMEDOUT : EIO;
+    free(s);
+    return rc;
+}
+
+// Writes one listed directory's block
+static void snapshot_append(struct ls_snapshot *s, const char *path, const struct ls_table *tab) {
+    size_t path_len = strlen(path);
+    uint64_t path_off = s->pos;
+    if (fwrite(path, 1, path_len + 1, s->out) != path_len + 1) s->err = 1;
+    s->pos += path_len + 1;
+
+    uint64_t off = s->pos, count = 0;
+    for (int i = 0; i < tab->shown; i++) {
+        const struct ls_entry *e = &tab->entries[i];
+        if (e->stat_state == -2) s->incomplete = 1;
+        if (e->stat_state != 1) continue;
+        struct snapshot_entry r = { 0 };
+        size_t len = entry_name_len(e);
+        r.ino = e->st.st_ino;
+        r.size = e->st.st_size;
+        r.mtime_sec = e->st.st_mtim.tv_sec;
+        r.mtime_nsec = e->st.st_mtim.tv_nsec;
+        r.mode = e->st.st_mode;
+        r.nlink = e->st.st_nlink;
+        r.uid = e->st.st_uid;
+        r.gid = e->st.st_gid;
+        r.name_len = len;
+        if (fwrite(&r, sizeof(r), 1, s->out) != 1 || fwrite(e->name, 1, len, s->out) != len)
+            s->err = 1;
+        s->pos += sizeof(r) + len;
+        count++;
+    }
+
+    if (s->new_count == s->new_cap) {
+        s->new_cap = s->new_cap ? s->new_cap * 2 : 256;
+        s->new_dirs = realloc(s->new_dirs, sizeof(struct snapshot_written) * s->new_cap);
+    }
+    s->new_dirs[s->new_count].path = strdup(path);
+    struct snapshot_dir *d = &s->new_dirs[s->new_count++].dir;
+    d->path_off = path_off;
+    d->path_len = path_len;
+    d->off = off;
+    d->len = s->pos - off;
+    d->count = count;
+}
+
+static const struct snapshot_dir *snapshot_find(const struct ls_snapshot *s, const char *path) {
+    size_t lo = 0, hi = s->ndirs;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int cmp = strcmp(snapshot_dir_path(s, &s->dirs[mid]), path);
+        if (cmp == 0) return &s->dirs[mid];
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+// Cursor over one directory block of a snapshot
+struct snapshot_cursor {
+    const char *p, *end;
+    struct ls_entry e;
+    char name[NAME_MAX + 1];
+};
+
+static void snapshot_cursor_init(struct snapshot_cursor *c, const struct ls_snapshot *s,
+                                 const struct snapshot_dir *d) {
+    c->p = d ? s->map + d->off : NULL;
+    c->end = d ? c->p + d->len : NULL;
+}
+
+// The next entry of the block as an ls_entry, or NULL at its end
+static const struct ls_entry *snapshot_cursor_next(struct snapshot_cursor *c) {
+    struct snapshot_entry r;
+    if (!c->p || (size_t)(c->end - c->p) < sizeof(r)) return NULL;
+    memcpy(&r, c->p, sizeof(r));
+    if (r.name_len > NAME_MAX || (size_t)(c->end - c->p) - sizeof(r) < r.name_len) return NULL;
+    memcpy(c->name, c->p + sizeof(r), r.name_len);
+    c->name[r.name_len] = '\0';
+    c->p += sizeof(r) + r.name_len;
+
+    memset(&c->e, 0, sizeof(c->e));
+    c->e.name = c->name;
+    entry_scan_name(&c->e);
+    c->e.ino = r.ino;
+    c->e.d_type = IFTODT(r.mode);
+    c->e.stat_state = 1;
+    c->e.st.st_ino = r.ino;
+    c->e.st.st_size = r.size;
+    c->e.st.st_mtim.tv_sec = r.mtime_sec;
+    c->e.st.st_mtim.tv_nsec = r.mtime_nsec;
+    c->e.st.st_mode = r.mode;
+    c->e.st.st_nlink = r.nlink;
+    c->e.st.st_uid = r.uid;
+    c->e.st.st_gid = r.gid;
+    return &c->e;
+}
+
+// Everything the snapshot had under a directory that is gone now, in the
+// order -R would have listed it
+static void snapshot_removed(const struct ls_snapshot *s, const char *path,
+                             const struct ls_opts *opts, row_emitter emit, struct ls_out *out) {
+    const struct snapshot_dir *d = snapshot_find(s, path);
+    if (!d) return;
+    struct snapshot_cursor c;
+    const struct ls_entry *e;
+    snapshot_cursor_init(&c, s, d);
+    while ((e = snapshot_cursor_next(&c)) != NULL) format_change(out, opts, emit, '-', path, e);
+
+    snapshot_cursor_init(&c, s, d);
+    while ((e = snapshot_cursor_next(&c)) != NULL) {
+        if (!S_ISDIR(e->st.st_mode)) continue;
+        char sub[PATH_MAX];
+        snprintf(sub, sizeof(sub), "%s/%s", path, e->name);
+        snapshot_removed(s, sub, opts, emit, out);
+    }
+}
+
+// --since: merges a directory's sorted table with its snapshot block and
+// writes what was added, removed or modified
+static void snapshot_diff(const struct ls_snapshot *s, const char *path, struct ls_table *tab,
+                          const struct ls_opts *opts, row_emitter emit, struct ls_out *out) {
+    struct snapshot_cursor c;
+    snapshot_cursor_init(&c, s, snapshot_find(s, path));
+    const struct ls_entry *old = snapshot_cursor_next(&c);
+    // subdirectories that vanished are reported after this block, since
+    // -R lists a directory's contents after its own
+    char **gone = NULL;
+    int ngone = 0;
+
+    int i = 0;
+    while (i < tab->shown || old) {
+        struct ls_entry *e = NULL;
+        if (i < tab->shown) {
+            e = &tab->entries[i];
+            if (!entry_listed(tab, e)) {
+                i++;
+                continue;
+            }
+        }
+        int cmp = !e ? 1 : !old ? -1 : strcmp(e->name, old->name);
+        if (cmp < 0) {
+            format_change(out, opts, emit, '+', path, e);
+            i++;
+            continue;
+        }
+        if (cmp > 0) {
+            format_change(out, opts, emit, '-', path, old);
+        } else {
+            // an entry that timed out exists, but whether it changed is unknown
+            if (e->stat_state == 1 && stat_differs(&e->st, &old->st))
+                format_change(out, opts, emit, '~', path, e);
+            i++;
+        }
+        if (opts->recursive && S_ISDIR(old->st.st_mode) &&
+            (cmp > 0 || (e->stat_state == 1 && !S_ISDIR(e->st.st_mode)))) {
+            gone = realloc(gone, sizeof(char *) * (ngone + 1));
+            gone[ngone++] = strdup(old->name);
+        }
+        old = snapshot_cursor_next(&c);
+    }
+
+    for (int k = 0; k < ngone; k++) {
+        char sub[PATH_MAX];
+        snprintf(sub, sizeof(sub), "%s/%s", path, gone[k]);
+        snapshot_removed(s, sub, opts, emit, out);
+        free(gone[k]);
+    }
+    free(gone);
+}
+
+// -------------------- Columnar Export --------------------
+// File layout: a header, then blocks of up to EXPORT_BLOCK_ROWS entries in
+// listing order, then an index of the block offsets and a trailer. A block
+// stores each field as an array of its own (a column), 8-byte aligned, so a
+// mapped file can be scanned one field at a time. Paths are dictionary-
+// encoded: each listed directory is one dictionary entry (its parent's id
+// and the name below it) in the block where it was listed, and each row
+// carries the id of its directory. Only the block being filled is kept in
+// memory, so an export of -R streams out as the walk goes.
+#define EXPORT_MAGIC "LSEXPT\0\1"
+#define EXPORT_END_MAGIC "LSEXEND\1"
+#define EXPORT_BLOCK_ROWS 65536
+
+// Dictionary parents that are not directories: a directory operand (named
+// by its path as given) and the non-directory operands (rows named by theirs)
+#define EXPORT_ROOT  0xffffffffu
+#define EXPORT_FILES 0xfffffffeu
+
+enum export_column {
+    EXPORT_COL_DIR,           // u32 per row: dictionary id of its directory
+    EXPORT_COL_NAME_END,      // u32 per row: where its name ends in EXPORT_COL_NAMES
+    EXPORT_COL_NAMES,         // name bytes, each starting where the last ended
+    EXPORT_COL_SIZE,          // i64
+    EXPORT_COL_MTIME,         // i64, ns since the epoch
+    EXPORT_COL_MODE,          // u32; 0 = the stat timed out (the rest is 0 too)
+    EXPORT_COL_UID,           // u32
+    EXPORT_COL_GID,           // u32
+    EXPORT_COL_NLINK,         // u32
+    EXPORT_COL_INO,           // u64
+    EXPORT_COL_DIR_PARENT,    // u32 per dictionary entry: parent id, or EXPORT_ROOT/FILES
+    EXPORT_COL_DIR_NAME_END,  // u32 per dictionary entry, as EXPORT_COL_NAME_END
+    EXPORT_COL_DIR_NAMES,
+    EXPORT_COLUMNS
+};
+
+// Element size of each column; 1 for the byte columns
+static const unsigned char export_col_size[EXPORT_COLUMNS] = { 4, 4, 1, 8, 8, 4, 4, 4, 4, 8, 4, 4, 1 };
+
+struct export_header {
+    char magic[8];
+    uint32_t block_rows;
+    uint32_t columns;
+};
+
+struct export_block {
+    uint32_t rows;
+    uint32_t dirs;            // dictionary entries it adds
+    uint32_t first_dir;       // id of the first of them
+    uint32_t pad;
+    uint64_t len;             // bytes, this header included
+    uint64_t col[EXPORT_COLUMNS][2];  // offset from the block start, length
+};
+
+// Trailer flags
+#define EXPORT_PARTIAL 1      // --deadline or --stat-timeout cut the listing short
+
+struct export_trailer {
+    uint64_t index_off;       // nblocks u64 file offsets of the blocks
+    uint64_t nblocks;
+    uint64_t rows;
+    uint64_t dirs;
+    uint64_t flags;
+    char magic[8];
+};
+
+struct export_column_buf {
+    char *p;
+    size_t len, cap;
+};
+
+struct ls_export {
+    char *path, *tmp_path;
+    FILE *out;
+    uint64_t pos;
+    struct export_column_buf col[EXPORT_COLUMNS];
+    uint32_t rows, dirs;      // in the block being filled
+    uint32_t next_dir;        // dictionary ids handed out so far
+    uint64_t total_rows;
+    uint64_t *blocks;
+    size_t nblocks, blocks_cap;
+    int err;
+    int partial;              // EXPORT_PARTIAL: a directory or a stat was cut off
+};
+
+static void export_put(struct ls_export *x, enum export_column c, const void *p, size_t n) {
+    struct export_column_buf *b = &x->col[c];
+    if (b->len + n > b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 1 << 12;
+        while (b->cap < b->len + n) b->cap *= 2;
+        b->p = realloc(b->p, b->cap);
+    }
+    memcpy(b->p + b->len, p, n);
+    b->len += n;
+}
+
+static void export_put_u32(struct ls_export *x, enum export_column c, uint32_t v) {
+    export_put(x, c, &v, sizeof(v));
+}
+
+static void export_put_u64(struct ls_export *x, enum export_column c, uint64_t v) {
+    export_put(x, c, &v, sizeof(v));
+}
+
+static void export_write(struct ls_export *x, const void *p, size_t n) {
+    if (n && fwrite(p, 1, n, x->out) != n) x->err = 1;
+    x->pos += n;
+}
+
+static void export_pad(struct ls_export *x) {
+    static const char zeros[8];
+    export_write(x, zeros, (8 - x->pos % 8) % 8);
+}
+
+// Writes out the block being filled and starts an empty one
+static void export_flush(struct ls_export *x) {
+    if (!x->rows && !x->dirs) return;
+    struct export_block b;
+    memset(&b, 0, sizeof(b));
+    b.rows = x->rows;
+    b.dirs = x->dirs;
+    b.first_dir = x->next_dir - x->dirs;
+    uint64_t off = sizeof(b);
+    for (int c = 0; c < EXPORT_COLUMNS; c++) {
+        b.col[c][0] = off;
+        b.col[c][1] = x->col[c].len;
+        off += (x->col[c].len + 7) / 8 * 8;
+    }
+    b.len = off;
+
+    if (x->nblocks == x->blocks_cap) {
+        x->blocks_cap = x->blocks_cap ? x->blocks_cap * 2 : 64;
+        x->blocks = realloc(x->blocks, sizeof(uint64_t) * x->blocks_cap);
+    }
+    x->blocks[x->nblocks++] = x->pos;
+    export_write(x, &b, sizeof(b));
+    for (int c = 0; c < EXPORT_COLUMNS; c++) {
+        export_write(x, x->col[c].p, x->col[c].len);
+        export_pad(x);
+        x->col[c].len = 0;
+    }
+    x->total_rows += x->rows;
+    x->rows = x->dirs = 0;
+}
+
+struct ls_export *ls_export_create(const char *path) {
+    struct ls_export *x = calloc(1, sizeof(struct ls_export));
+    x->path = strdup(path);
+    x->tmp_path = malloc(strlen(path) + 32);
+    sprintf(x->tmp_path, "%s.tmp.%ld", path, (long)getpid());
+    x->out = fopen(x->tmp_path, "w");
+    if (!x->out) {
+        int saved = errno;
+        ls_export_close(x);
+        errno = saved;
+        return NULL;
+    }
+    setvbuf(x->out, NULL, _IOFBF, 1 << 16);
+    struct export_header h = { EXPORT_MAGIC, EXPORT_BLOCK_ROWS, EXPORT_COLUMNS };
+    export_write(x, &h, sizeof(h));
+    return x;
+}
+
+int ls_export_close(struct ls_export *x) {
+    int rc = 0;
+    if (x->out) {
+        export_flush(x);
+        struct export_trailer t = { x->pos, x->nblocks, x->total_rows, x->next_dir,
+                                    x->partial ? EXPORT_PARTIAL : 0, EXPORT_END_MAGIC };
+        export_write(x, x->blocks, sizeof(uint64_t) * x->nblocks);
+        export_write(x, &t, sizeof(t));
+        if (ferror(x->out) || x->err) rc = -1;
+        if (fclose(x->out) != 0) rc = -1;
+        if (rc == 0 && rename(x->tmp_path, x->path) == -1) rc = -1;
+        if (rc == -1) unlink(x->tmp_path);
+    }
+    for (int c = 0; c < EXPORT_COLUMNS; c++) free(x->col[c].p);
+    free(x->blocks);
+    free(x->tmp_path);
+    free(x->path);
+    free(x);
+    return rc;
+}
+
+// Enters a directory into the dictionary and returns its id
+static uint32_t export_dir(struct ls_export *x, uint32_t parent, const char *name) {
+    size_t len = strlen(name);
+    export_put_u32(x, EXPORT_COL_DIR_PARENT, parent);
+    export_put(x, EXPORT_COL_DIR_NAMES, name, len);
+    export_put_u32(x, EXPORT_COL_DIR_NAME_END, (uint32_t)x->col[EXPORT_COL_DIR_NAMES].len);
+    x->dirs++;
+    return x->next_dir++;
+}
+
+static void export_row(struct ls_export *x, uint32_t dir, const struct ls_entry *e) {
+    if (x->rows == EXPORT_BLOCK_ROWS) export_flush(x);
+    const struct stat *st = &e->st;
+    int valid = e->stat_state == 1;
+    if (e->stat_state == -2) x->partial = 1;
+    export_put_u32(x, EXPORT_COL_DIR, dir);
+    export_put(x, EXPORT_COL_NAMES, e->name, entry_name_len(e));
+    export_put_u32(x, EXPORT_COL_NAME_END, (uint32_t)x->col[EXPORT_COL_NAMES].len);
+    export_put_u64(x, EXPORT_COL_SIZE, valid ? (uint64_t)st->st_size : 0);
+    export_put_u64(x, EXPORT_COL_MTIME,
+                   valid ? (uint64_t)(st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec) : 0);
+    export_put_u32(x, EXPORT_COL_MODE, valid ? st->st_mode : 0);
+    export_put_u32(x, EXPORT_COL_UID, valid ? st->st_uid : 0);
+    export_put_u32(x, EXPORT_COL_GID, valid ? st->st_gid : 0);
+    export_put_u32(x, EXPORT_COL_NLINK, valid ? (uint32_t)st->st_nlink : 0);
+    export_put_u64(x, EXPORT_COL_INO, valid ? st->st_ino : 0);
+    x->rows++;
+}
+
+// Enters a listed directory; its rows follow through export_row()
+static void export_node(struct ls_export *x, struct dir_node *node) {
+    const char *name = node->path;
+    uint32_t parent = EXPORT_ROOT;
+    if (node->parent) {
+        size_t n = strlen(node->parent->path);
+        parent = node->parent->export_id;
+        if (strlen(name) > n) name += n + 1;
+    }
+    node->export_id = export_dir(x, parent, name);
+}
+
+// Exports a listed directory and its listed entries
+static void export_table(struct ls_export *x, struct dir_node *node) {
+    if (node->late) x->partial = 1;
+    export_node(x, node);
+    for (int i = 0; i < node->tab.shown; i++) {
+        const struct ls_entry *e = &node->tab.entries[i];
+        if (e->stat_state == 1 || e->stat_state == -2) export_row(x, node->export_id, e);
+    }
+}
+
+// The non-directory operands, as one dictionary entry
+static void export_file_operands(struct ls_export *x, const struct ls_table *tab) {
+    uint32_t id = export_dir(x, EXPORT_FILES, "");
+    for (int i = 0; i < tab->shown; i++) {
+        const struct ls_entry *e = &tab->entries[i];
+        if (e->stat_state == 1 || e->stat_state == -2) export_row(x, id, e);
+    }
+}
+
+// -------------------- Inode Set --------------------
+static uint64_t hash_devino(dev_t dev, ino_t ino) {
+    uint64_t h = (uint64_t)ino * 0x9E3779B97F4A7C15ULL ^ (uint64_t)dev;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    return h ^ (h >> 32);
+}
+
+// Returns 1 if (dev, ino) was newly added, 0 if it was already present
+static int inode_set_insert(struct inode_set *set, dev_t dev, ino_t ino) {
+    if (dev == 0 && ino == 0) {
+        if (set->has_zero) return 0;
+        set->has_zero = 1;
+        return 1;
+    }
+    // grow at 50% load, keeping probe sequences short
+    if (set->count * 2 >= set->cap) {
+        size_t old_cap = set->cap;
+        struct dev_ino *old = set->slots;
+        set->cap = old_cap ? old_cap * 2 : 1024;
+        set->slots = calloc(set->cap, sizeof(struct dev_ino));
+        set->count = 0;
+        for (size_t i = 0; i < old_cap; i++)
+            if (old[i].dev || old[i].ino) inode_set_insert(set, old[i].dev, old[i].ino);
+        free(old);
+    }
+    size_t mask = set->cap - 1;
+    for (size_t i = hash_devino(dev, ino) & mask; ; i = (i + 1) & mask) {
+        struct dev_ino *slot = &set->slots[i];
+        if (slot->dev == dev && slot->ino == ino) return 0;
+        if (slot->dev == 0 && slot->ino == 0) {
+            slot->dev = dev;
+            slot->ino = ino;
+            set->count++;
+            return 1;
+        }
+    }
+}
+
+static void inode_set_free(struct inode_set *set) {
+    free(set->slots);
+    memset(set, 0, sizeof(*set));
+}
+
+// -------------------- Parallel Traversal --------------------
+static struct dir_node *new_node(const char *path, struct dir_node *parent) {
+    struct dir_node *node = calloc(1, sizeof(struct dir_node));
+    node->path = strdup(path);
+    node->parent = parent;
+    node->state = NODE_QUEUED;
+    node->pending = 1;
+    return node;
+}
+
+// Reads, filters and sorts one directory; 0, or -1 with node->err set.
+// Nothing is opened once the deadline has passed.
+static int scan_read(struct walker *w, struct dir_node *node) {
+    const struct ls_opts *opts = w->opts;
+    struct ls_table *tab = &node->tab;
+
+    if (deadline_passed(&opts->deadline)) {
+        node->late = 1;
+        node->err = ETIMEDOUT;
+        return -1;
+    }
+    DIR *dir = opendir(node->path);
+    if (!dir) {
+        node->err = errno;
+        return -1;
+    }
+    // the budget needs every output path to stream from sorted runs
+    size_t budget = w->keep || opts->since || opts->snapshot ? 0 : w->table_budget;
+    node->cache_hit = read_entries(dir, opts, tab, budget);
+
+    // Only the listed entries are sorted and formatted
+    qsort(tab->entries, tab->shown, sizeof(struct ls_entry), compare_names);
+    return 0;
+}
+
+// Stats the listed entries of a table scan_read() left, totals them for
+// --sizes, and creates child nodes for the subdirectories to descend
+static void scan_finish(struct walker *w, struct dir_node *node) {
+    const struct ls_opts *opts = w->opts;
+    struct ls_table *tab = &node->tab;
+
+    // Every output mode needs the stats (for color or fields), so take them
+    // now, while the directory is still open, instead of on the printer;
+    // the same goes for digests, which a worker reads beside the others
+    stat_entries(tab, 0, tab->shown);
+    hash_entries(tab, opts);
+
+    if (opts->sizes) {
+        struct stat dst;
+        if (fstat(dirfd(tab->dir), &dst) == 0) {
+            node->totals.apparent += dst.st_size;
+            node->totals.allocated += (unsigned long long)dst.st_blocks * 512;
+        }
+        if (tab->spill) {
+            node->totals.apparent += tab->spill->totals.apparent;
+            node->totals.allocated += tab->spill->totals.allocated;
+            node->totals.files += tab->spill->totals.files;
+        }
+        // Multiply-linked files are left to the printer, which sees
+        // directories in listing order and so credits each inode to the
+        // same directory on every run
+        for (int i = 0; i < tab->shown; i++) {
+            struct ls_entry *e = &tab->entries[i];
+            if (e->stat_state != 1 || S_ISDIR(e->st.st_mode) || e->st.st_nlink > 1) continue;
+            node->totals.apparent += e->st.st_size;
+            node->totals.allocated += (unsigned long long)e->st.st_blocks * 512;
+            node->totals.files++;
+        }
+    }
+
+    if (opts->recursive) {
+        // Directories that failed the predicates sit after entries[shown];
+        // merge both sorted runs so the descent stays in name order
+        qsort(tab->entries + tab->shown, tab->count - tab->shown, sizeof(struct ls_entry), compare_names);
+        node->children = malloc(sizeof(struct dir_node *) * (tab->count + 1));
+        int a = 0, b = tab->shown;
+        while (a < tab->shown || b < tab->count) {
+            int i;
+            if (b >= tab->count || (a < tab->shown && compare_names(&tab->entries[a], &tab->entries[b]) < 0))
+                i = a++;
+            else
+                i = b++;
+
+            struct ls_entry *e = &tab->entries[i];
+            // --prune needs only the name, so pruned trees cost no lstat
+            if (opts->prune.count && ls_matcher_match(&opts->prune, e->name, entry_name_len(e)))
+                continue;
+            if (entry_type(tab, e) != LS_TYPE_DIR)
+                continue;
+            if (opts->one_fs) {
+                const struct stat *st = ls_entry_stat(tab, e);
+                if (!st || st->st_dev != w->root_dev) continue;
+            }
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", node->path, e->name);
+            struct dir_node *child = new_node(path, node);
+            node->children[node->child_count++] = child;
+
+            // Under -L a directory can be reached through many links, or
+            // through a link back to an ancestor; descend the first time only
+            if (tab->follow) {
+                const struct stat *st = ls_entry_stat(tab, e);
+                pthread_mutex_lock(&w->lock);
+                child->revisit = st && !inode_set_insert(&w->visited, st->st_dev, st->st_ino);
+                pthread_mutex_unlock(&w->lock);
+            }
+        }
+    }
+
+    table_store(opts, tab);
+
+    // Release the descriptor now so depth and run-ahead aren't bounded by fds
+    closedir(tab->dir);
+    tab->dir = NULL;
+}
+
+// Scans one directory completely. Runs without the walker lock held.
+static void scan_node(struct walker *w, struct dir_node *node) {
+    if (scan_read(w, node) == 0) scan_finish(w, node);
+}
+
+// Called with the lock held: a subtree finished, so fold its totals into
+// the parent, bottom-up, for as many levels as that completes.
+static void subtree_done(struct dir_node *node) {
+    while (--node->pending == 0 && node->parent) {
+        struct dir_node *parent = node->parent;
+        parent->totals.apparent += node->totals.apparent;
+        parent->totals.allocated += node->totals.allocated;
+        parent->totals.files += node->totals.files;
+        node = parent;
+    }
+}
+
+// Called with the lock held after scan_node()
+static void node_scanned(struct walker *w, struct dir_node *node) {
+    node->state = NODE_SCANNED;
+    w->unprinted++;
+    w->stats.dirs++;
+    w->stats.entries += node->tab.read_count;
+    w->stats.stat_calls += node->tab.stat_calls;
+    w->stats.xattr_calls += node->tab.xattr_calls;
+    w->stats.stat_timeouts += node->tab.stat_timeouts;
+    w->stats.late_dirs += node->late;
+    w->stats.hashed += node->tab.hashed;
+    w->stats.hash_bytes += node->tab.hash_bytes;
+    w->stats.hash_hits += node->tab.hash_hits;
+    if (w->opts->cache || w->opts->index) {
+        if (node->cache_hit) w->stats.cache_hits++;
+        else w->stats.cache_misses++;
+    }
+
+    node->pending += node->child_count;
+    if (w->stack_len + node->child_count > w->stack_cap) {
+        w->stack_cap = (w->stack_len + node->child_count) * 2;
+        w->stack = realloc(w->stack, sizeof(struct dir_node *) * w->stack_cap);
+    }
+    // push in reverse so the first subdirectory is scanned first;
+    // revisits are settled here and never queued
+    for (int i = node->child_count - 1; i >= 0; i--) {
+        struct dir_node *child = node->children[i];
+        if (child->revisit) {
+            child->state = NODE_SCANNED;
+            w->unprinted++;
+            w->stats.revisits++;
+            subtree_done(child);
+        } else {
+            w->stack[w->stack_len++] = child;
+        }
+    }
+    subtree_done(node);
+    pthread_cond_broadcast(&w->node_done);
+    if (node->child_count) pthread_cond_broadcast(&w->work_ready);
+}
+
+static void *walker_thread(void *arg) {
+    struct walker *w = arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->shutdown && (w->stack_len == 0 || w->unprinted >= w->max_unprinted || w->aborted))
+            pthread_cond_wait(&w->work_ready, &w->lock);
+        if (w->shutdown) break;
+
+        struct dir_node *node = w->stack[--w->stack_len];
+        node->state = NODE_SCANNING;
+        pthread_mutex_unlock(&w->lock);
+        scan_node(w, node);
+        pthread_mutex_lock(&w->lock);
+        node_scanned(w, node);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// Called with the lock held: takes a node no worker has picked up yet off
+// the stack, for the printer to scan itself. Returns 0 if it was taken.
+static int claim_node(struct walker *w, struct dir_node *node) {
+    if (node->state != NODE_QUEUED) return 0;
+    for (int i = w->stack_len - 1; i >= 0; i--) {
+        if (w->stack[i] == node) {
+            memmove(&w->stack[i], &w->stack[i + 1], sizeof(struct dir_node *) * (w->stack_len - i - 1));
+            w->stack_len--;
+            break;
+        }
+    }
+    node->state = NODE_SCANNING;
+    return 1;
+}
+
+// Blocks until a node is scanned. If no worker has picked it up yet the
+// printer scans it itself, so it never waits behind run-ahead work.
+static void wait_scanned(struct walker *w, struct dir_node *node) {
+    pthread_mutex_lock(&w->lock);
+    if (claim_node(w, node)) {
+        pthread_mutex_unlock(&w->lock);
+        if (!w->aborted) scan_node(w, node);
+        pthread_mutex_lock(&w->lock);
+        node_scanned(w, node);
+    }
+    while (node->state != NODE_SCANNED)
+        pthread_cond_wait(&w->node_done, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Called by the printer once a write has failed (EPIPE from a closed head,
+// say): workers stop taking directories, and the rest of the tree is only
+// walked to release what was already scanned
+static void walker_abort(struct walker *w) {
+    pthread_mutex_lock(&w->lock);
+    w->aborted = 1;
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Hard links for --sizes, deduplicated in listing order
+static void count_linked(struct walker *w, struct dir_node *node) {
+    for (int i = 0; i < node->tab.shown; i++) {
+        struct ls_entry *e = &node->tab.entries[i];
+        if (e->stat_state != 1 || S_ISDIR(e->st.st_mode) || e->st.st_nlink < 2) continue;
+        if (!inode_set_insert(&w->links, e->st.st_dev, e->st.st_ino)) continue;
+        node->linked.apparent += e->st.st_size;
+        node->linked.allocated += (unsigned long long)e->st.st_blocks * 512;
+        node->linked.files++;
+    }
+}
+
+// A scanned table in the layout or record format the options ask for
+static void list_table(struct walker *w, struct dir_node *node) {
+    const struct ls_opts *opts = w->opts;
+    stat_entries(&node->tab, 0, node->tab.shown);
+    hash_entries(&node->tab, opts);
+    if (opts->format != LS_FORMAT_HUMAN) {
+        list_records(&node->tab, node->path, w->emit, w->out);
+        return;
+    }
+    switch (opts->display) {
+        case LS_LONG:       list_long(&node->tab, w->emit, w->out); break;
+        case LS_HORIZONTAL: list_horizontal(&node->tab, w->width, w->cell, w->out); break;
+        default:            list_columns(&node->tab, w->width, w->cell, w->out);
+    }
+}
+
+// The default layout of a spilled listing, from its n names in order in
+// one run: a cursor per column starts where the column's first name is, and
+// each row takes the next name from every column
+static void spilled_columns(const struct ls_spill *sp, const struct spill_segment *seg, int n,
+                            const struct column_layout *lay, cell_emitter cell,
+                            struct ls_out *out) {
+    struct spill_cursor *cur = calloc(lay->cols, sizeof(struct spill_cursor));
+    struct spill_cursor scan;
+    spill_cursor_open(&scan, sp, seg->off, seg->off + seg->len, SPILL_BUF);
+    for (int i = 0, c = 0; c < lay->cols; i++) {
+        if (i % lay->rows == 0)
+            spill_cursor_open(&cur[c++], sp, spill_cursor_tell(&scan), seg->off + seg->len,
+                              SPILL_COLUMN_BUF);
+        if (!spill_cursor_next(&scan)) break;
+    }
+    free(scan.buf);
+
+    for (int r = 0; r < lay->rows && !out->err; r++) {
+        int pad = 0;
+        for (int c = 0, idx = r; c < lay->cols && idx < n; c++, idx += lay->rows) {
+            const struct ls_entry *e = spill_cursor_next(&cur[c]);
+            if (!e) break;
+            layout_name(e, lay->widths[c], &pad, cell, out);
+        }
+        ls_out_putc(out, '\n');
+    }
+    for (int c = 0; c < lay->cols; c++) free(cur[c].buf);
+    free(cur);
+}
+
+// Lists a spilled table by merging its runs straight into the output, and
+// counts its hard links for --sizes on the way. The column layouts need
+// every column's width before the first row, so the first merge goes
+// through the column sizer and the rows come after: -x merges again, and
+// the default layout, whose names run down the columns, writes the merged
+// order back to the spill file as one run and reads it a column at a time.
+static void list_spilled(struct walker *w, struct dir_node *node) {
+    const struct ls_opts *opts = w->opts;
+    struct ls_spill *sp = node->tab.spill;
+    int layout = opts->format == LS_FORMAT_HUMAN && opts->display != LS_LONG;
+    int by_columns = layout && opts->display == LS_COLUMNS;
+    int rewrite = by_columns && sp->nruns > 1;   // one run is already in order
+    struct layout_sizer z;
+    struct spill_merge m;
+    struct ls_out buf;
+    const struct ls_entry *e;
+    uint64_t merged = sp->end;
+    int i = 0, sizing = layout, ok = 1;
+
+    if (layout) layout_sizer_init(&z, sp->count, w->width, by_columns);
+    if (rewrite) ls_out_init_mem(&buf);
+    if (opts->export) export_node(opts->export, node);
+    spill_merge_init(&m, sp, sp->runs, sp->nruns);
+    while (!w->out->err && (e = spill_merge_next(&m)) != NULL) {
+        if (opts->export) export_row(opts->export, node->export_id, e);
+        if (opts->sizes && !S_ISDIR(e->st.st_mode) && e->st.st_nlink > 1 &&
+            inode_set_insert(&w->links, e->st.st_dev, e->st.st_ino)) {
+            node->linked.apparent += e->st.st_size;
+            node->linked.allocated += (unsigned long long)e->st.st_blocks * 512;
+            node->linked.files++;
+        }
+        if (!layout) {
+            w->emit(w->out, node->path, e, NULL);
+            continue;
+        }
+        if (sizing) sizing = layout_sizer_add(&z, i, entry_name_width(e));
+        i++;
+        if (rewrite && ok) {
+            spill_encode(&buf, e);
+            if (buf.len >= SPILL_BUF) ok = spill_flush(sp, &buf) == 0;
+        }
+    }
+    spill_merge_free(&m, sp->nruns);
+    if (rewrite) {
+        if (ok) ok = spill_flush(sp, &buf) == 0;
+        ls_out_free(&buf);
+    }
+    if (!layout) return;
+
+    struct column_layout lay;
+    layout_sizer_finish(&z, sp->count, &lay);
+    if (by_columns && ok) {
+        struct spill_segment seg = rewrite ? (struct spill_segment){ merged, sp->end - merged }
+                                           : sp->runs[0];
+        spilled_columns(sp, &seg, sp->count, &lay, w->cell, w->out);
+    } else if (by_columns) {
+        dprintf(opts->err_fd, "ls: cannot write spill file: %s; listing one name per line\n",
+                strerror(errno));
+        sp->end = merged;
+        spill_merge_init(&m, sp, sp->runs, sp->nruns);
+        while (!w->out->err && (e = spill_merge_next(&m)) != NULL) {
+            w->cell(w->out, e, 0);
+            ls_out_putc(w->out, '\n');
+        }
+        spill_merge_free(&m, sp->nruns);
+    } else {
+        int pad = 0;
+        spill_merge_init(&m, sp, sp->runs, sp->nruns);
+        for (i = 0; !w->out->err && (e = spill_merge_next(&m)) != NULL; i++) {
+            int c = i % lay.cols;
+            if (c == 0 && i > 0) {
+                ls_out_putc(w->out, '\n');
+                pad = 0;
+            }
+            layout_name(e, lay.widths[c], &pad, w->cell, w->out);
+        }
+        ls_out_putc(w->out, '\n');
+        spill_merge_free(&m, sp->nruns);
+    }
+    free(lay.widths);
+}
+
+// -------------------- Stat Pipeline --------------------
+// A directory the printer scans itself (every plain listing, and -R nodes
+// no worker got to first) would be stat'd and then formatted strictly one
+// phase after the other. For the layouts that print in table order (-l,
+// -x, --format) a stat thread takes the sorted table instead and hands
+// finished batches to the printer through a single-producer, single-
+// consumer ring, so lstat latency overlaps with formatting and write(2).
+// Each side spins briefly on the other's index (not on a single CPU, where
+// that only delays the other side) and then sleeps on it with a futex; a
+// waiting flag lets the fast path skip the wake syscall. The stat thread
+// works a window at a time (the filesystem profile's, at most the ring), so
+// it stays at most about one window ahead of the output.
+#define PIPE_MIN_ENTRIES 256   // below this the thread costs more than it hides
+#define PIPE_BATCH       32    // entries per ring slot
+#define PIPE_SLOTS       64    // power of two
+#define PIPE_SPINS       200
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() do { } while (0)
+#endif
+
+struct stat_pipe {
+    _Alignas(64) _Atomic uint32_t head;   // slots published by the stat thread
+    _Atomic int consumer_waiting;
+    _Alignas(64) _Atomic uint32_t tail;   // slots taken by the printer
+    _Atomic int producer_waiting;
+    _Alignas(64) int ends[PIPE_SLOTS];    // one past each batch's last entry
+    struct ls_table *tab;
+    int spins;
+    _Atomic int stop;         // the printer's output failed
+};
+
+// Waits until *word moves off seen
+static void pipe_wait(_Atomic uint32_t *word, uint32_t seen, _Atomic int *waiting, int spins) {
+    for (int i = 0; i < spins; i++) {
+        if (atomic_load_explicit(word, memory_order_acquire) != seen) return;
+        cpu_relax();
+    }
+    while (atomic_load(word) == seen) {
+        atomic_store(waiting, 1);
+        // the kernel rechecks the value, so a store after our check still wakes us
+        if (atomic_load(word) == seen)
+            syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+        atomic_store(waiting, 0);
+    }
+}
+
+static void pipe_publish(_Atomic uint32_t *word, uint32_t value, _Atomic int *waiting) {
+    atomic_store(word, value);
+    if (atomic_load(waiting))
+        syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void *pipe_stat_thread(void *arg) {
+    struct stat_pipe *p = arg;
+    struct ls_table *tab = p->tab;
+    int size = table_profile(tab)->window;
+    if (size < PIPE_BATCH) size = PIPE_BATCH;
+    if (size > PIPE_BATCH * PIPE_SLOTS) size = PIPE_BATCH * PIPE_SLOTS;
+    uint32_t head = 0;
+    for (int i = 0; i < tab->shown && !atomic_load(&p->stop); ) {
+        int window = i + size < tab->shown ? i + size : tab->shown;
+        stat_entries(tab, i, window);
+
+        while (i < window && !atomic_load(&p->stop)) {
+            i = i + PIPE_BATCH < window ? i + PIPE_BATCH : window;
+            uint32_t tail;
+            while (head - (tail = atomic_load_explicit(&p->tail, memory_order_acquire)) == PIPE_SLOTS &&
+                   !atomic_load(&p->stop))
+                pipe_wait(&p->tail, tail, &p->producer_waiting, p->spins);
+            p->ends[head % PIPE_SLOTS] = i;
+            pipe_publish(&p->head, ++head, &p->consumer_waiting);
+        }
+    }
+    return NULL;
+}
+
+// Lists a big table in one of the sequential layouts through the stat
+// thread; -1 if the thread could not be started
+static int list_piped(struct walker *w, struct dir_node *node) {
+    const struct ls_opts *opts = w->opts;
+    struct ls_table *tab = &node->tab;
+    int human = opts->format == LS_FORMAT_HUMAN;
+
+    // aligned for the separate cache lines of the two indexes
+    struct stat_pipe *p = aligned_alloc(64, (sizeof(struct stat_pipe) + 63) / 64 * 64);
+    memset(p, 0, sizeof(*p));
+    p->tab = tab;
+    p->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? PIPE_SPINS : 0;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, pipe_stat_thread, p) != 0) {
+        free(p);
+        return -1;
+    }
+
+    struct column_layout lay = { 0 };
+    int pad = 0;
+    if (human && opts->display == LS_HORIZONTAL) layout_columns(tab, w->width, 0, &lay);
+    uint32_t tail = 0, head;
+    for (int done = 0; done < tab->shown && !w->out->err; ) {
+        while ((head = atomic_load_explicit(&p->head, memory_order_acquire)) == tail)
+            pipe_wait(&p->head, head, &p->consumer_waiting, p->spins);
+        int end = p->ends[tail % PIPE_SLOTS];
+        pipe_publish(&p->tail, ++tail, &p->producer_waiting);
+
+        if (!human) record_rows(tab, done, end, node->path, w->emit, w->out);
+        else if (opts->display == LS_LONG) long_rows(tab, done, end, w->emit, w->out);
+        else horizontal_rows(tab, done, end, &lay, &pad, w->cell, w->out);
+        done = end;
+    }
+    if (w->out->err) {
+        // any change to tail wakes a producer waiting for a free slot
+        atomic_store(&p->stop, 1);
+        pipe_publish(&p->tail, tail + 1, &p->producer_waiting);
+    } else if (human && opts->display == LS_HORIZONTAL) {
+        ls_out_putc(w->out, '\n');
+    }
+    pthread_join(thread, NULL);
+    free(lay.widths);
+    free(p);
+    return 0;
+}
+
+// Scans and lists a node the printer claimed, taking stats only as the
+// output gets to them: through the stat thread for big tables in the
+// sequential layouts, and on demand from the still-open directory
+// otherwise. So `ls -l | head` stats about a window past what head shows.
+// scan_finish() follows the listing, unless the output failed, to give -R
+// and --sizes the rest. Returns 1 if the node was listed.
+static int list_claimed(struct walker *w, struct dir_node *node) {
+    const struct ls_opts *opts = w->opts;
+    if (w->keep || opts->since || w->table_budget) return 0;
+
+    pthread_mutex_lock(&w->lock);
+    int claimed = !w->aborted && claim_node(w, node);
+    pthread_mutex_unlock(&w->lock);
+    if (!claimed) return 0;
+
+    struct ls_table *tab = &node->tab;
+    int listed = 0;
+    if (scan_read(w, node) == 0) {
+        // digests are read on a pool of their own once the stats are in
+        int sequential = (opts->format != LS_FORMAT_HUMAN || opts->display != LS_COLUMNS) &&
+                         !opts->hash;
+        if (!sequential || tab->shown < PIPE_MIN_ENTRIES || list_piped(w, node) == -1)
+            list_table(w, node);
+        listed = 1;
+        if (!w->out->err) scan_finish(w, node);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    node_scanned(w, node);
+    pthread_mutex_unlock(&w->lock);
+    return listed;
+}
+
+// -------------------- Core Function (Recursive) --------------------
+static void do_ls(struct walker *w, struct dir_node *node) {
+    const struct ls_opts *opts = w->opts;
+    int headers = opts->format == LS_FORMAT_HUMAN && !w->keep && !opts->since;
+    int listed = list_claimed(w, node);
+    if (!listed) wait_scanned(w, node);
+
+    if (w->aborted) {
+        // nothing more reaches the output; this node is only released
+    } else if (node->revisit || node->err) {
+        // keep diagnostics next to the listing they belong to
+        ls_out_flush(w->out);
+        if (node->revisit)
+            dprintf(opts->err_fd, "%s: not listing already-listed directory\n", node->path);
+        else if (node->late)
+            dprintf(opts->err_fd, "%s: not read, deadline passed\n", node->path);
+        else
+            dprintf(opts->err_fd, "%s: %s\n", node->path, strerror(node->err));
+    } else if (listed) {
+        // already written as its stats came in
+    } else if (w->keep) {
+        watch_keep(w->keep, node);
+    } else if (opts->since) {
+        snapshot_diff(opts->since, node->path, &node->tab, opts, w->emit, w->out);
+    } else if (node->tab.spill) {
+        list_spilled(w, node);
+    } else {
+        list_table(w, node);
+    }
+    // under a deadline every finished directory is out before the next
+    // read, which may be the one that hangs past it
+    if (opts->deadline.tv_sec) ls_out_flush(w->out);
+    if (w->out->err && !w->aborted) walker_abort(w);
+    if (opts->snapshot && node->late) opts->snapshot->incomplete = 1;
+    if (opts->snapshot && !node->revisit && !node->err && !w->keep)
+        snapshot_append(opts->snapshot, node->path, &node->tab);
+    // a spilled table was exported as it merged; one that could not be read
+    // is kept as an empty directory, as its header was still listed
+    if (opts->export && !node->revisit && !w->keep && !w->aborted && !node->tab.spill)
+        export_table(opts->export, node);
+    if (opts->sizes) count_linked(w, node);
+    free_entries(&node->tab);
+
+    pthread_mutex_lock(&w->lock);
+    w->unprinted--;
+    pthread_cond_broadcast(&w->work_ready);
+    pthread_mutex_unlock(&w->lock);
+
+    // Recursive descent
+    for (int i = 0; i < node->child_count; i++) {
+        if (!node->children[i]->revisit && headers)
+            ls_out_printf(w->out, "\n%s:\n", node->children[i]->path);
+        do_ls(w, node->children[i]);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    while (node->pending > 0)
+        pthread_cond_wait(&w->node_done, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+
+    if (opts->sizes && !node->revisit) {
+        struct dir_totals *t = &node->totals, *l = &node->linked;
+        if (headers)
+            ls_out_printf(w->out, "total %s: %llu files, %llu bytes apparent, %llu bytes allocated\n",
+                          node->path, t->files + l->files, t->apparent + l->apparent,
+                          t->allocated + l->allocated);
+        if (node->parent) {
+            node->parent->linked.files += l->files;
+            node->parent->linked.apparent += l->apparent;
+            node->parent->linked.allocated += l->allocated;
+        }
+    }
+
+    free(node->children);
+    free(node->path);
+    free(node);
+}
+
+// Lists the tree under path (just path without -R)
+static void walk_tree(struct walker *w, const char *path) {
+    const struct ls_opts *opts = w->opts;
+    w->shutdown = 0;
+    if (opts->recursive) {
+        for (int i = 0; i < w->thread_count; i++)
+            pthread_create(&w->threads[i], NULL, walker_thread, w);
+    }
+
+    do_ls(w, new_node(path, NULL));
+
+    if (opts->recursive) {
+        pthread_mutex_lock(&w->lock);
+        w->shutdown = 1;
+        pthread_cond_broadcast(&w->work_ready);
+        pthread_mutex_unlock(&w->lock);
+        for (int i = 0; i < w->thread_count; i++)
+            pthread_join(w->threads[i], NULL);
+    }
+    inode_set_free(&w->links);
+    if (w->visited.count > w->stats.visited_count) {
+        w->stats.visited_count = w->visited.count;
+        w->stats.visited_bytes = w->visited.cap * sizeof(struct dev_ino);
+    }
+    inode_set_free(&w->visited);
+}
+
+// Lists one operand, recording its device for --one-file-system
+static void do_ls_operand(struct walker *w, const char *dirname) {
+    struct stat st;
+    int have_root = stat(dirname, &st) == 0;
+    if (have_root) w->root_dev = st.st_dev;
+    if (have_root && w->opts->follow == LS_FOLLOW_ALL) inode_set_insert(&w->visited, st.st_dev, st.st_ino);
+    walk_tree(w, dirname);
+}
+
+static void walker_init(struct walker *w, const struct ls_opts *opts, struct ls_out *out) {
+    memset(w, 0, sizeof(*w));
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work_ready, NULL);
+    pthread_cond_init(&w->node_done, NULL);
+    w->opts = opts;
+    w->out = out;
+    w->emit = pick_row_emitter(opts);
+    w->cell = pick_name_cell(opts);
+
+    w->width = opts->width;
+    if (w->width <= 0) {
+        struct winsize ws;
+        w->width = 80;
+        if (ioctl(out->fd >= 0 ? out->fd : STDOUT_FILENO, TIOCGWINSZ, &ws) != -1)
+            w->width = ws.ws_col;
+    }
+
+    // Workers only run under -R; with threads = 0 the printer scans everything.
+    // Under -L the first path to reach a directory is the one listed. A
+    // single scanner takes directories strictly in listing order, which
+    // keeps that choice (and so the output) the same on every run.
+    w->thread_count = opts->threads < 0 ? 0 : opts->threads;
+    if (opts->follow == LS_FOLLOW_ALL && w->thread_count > 1) w->thread_count = 1;
+
+    // --memory-limit is shared by every table that can be alive at once:
+    // one per scanner, the printer's, and a run-ahead cut to match
+    w->max_unprinted = MAX_UNPRINTED;
+    if (opts->memory_limit) {
+        w->max_unprinted = w->thread_count ? w->thread_count : 1;
+        w->table_budget = opts->memory_limit / (w->thread_count + w->max_unprinted + 1);
+        if (w->table_budget < SPILL_MIN_BUDGET) w->table_budget = SPILL_MIN_BUDGET;
+    }
+    w->threads = malloc(sizeof(pthread_t) * (w->thread_count + 1));
+}
+
+static void walker_destroy(struct walker *w) {
+    free(w->threads);
+    free(w->stack);
+    pthread_cond_destroy(&w->node_done);
+    pthread_cond_destroy(&w->work_ready);
+    pthread_mutex_destroy(&w->lock);
+}
+
+static void stats_add(struct ls_stats *to, const struct ls_stats *from) {
+    to->dirs += from->dirs;
+    to->entries += from->entries;
+    to->stat_calls += from->stat_calls;
+    to->xattr_calls += from->xattr_calls;
+    to->revisits += from->revisits;
+    if (from->visited_count > to->visited_count) {
+        to->visited_count = from->visited_count;
+        to->visited_bytes = from->visited_bytes;
+    }
+    to->cache_hits += from->cache_hits;
+    to->cache_misses += from->cache_misses;
+    to->stat_timeouts += from->stat_timeouts;
+    to->late_dirs += from->late_dirs;
+    to->hashed += from->hashed;
+    to->hash_bytes += from->hash_bytes;
+    to->hash_hits += from->hash_hits;
+}
+
+// -------------------- Operands --------------------
+// Operands that are not directories (or symlinks to them) are listed first,
+// sorted, in one table, as GNU ls does. Their stats are the operand stats
+// themselves: lstat unless -H or -L asks for the target.
+static void add_file_operand(struct ls_table *tab, const char *path, const struct stat *st) {
+    if (tab->count == tab->cap) {
+        tab->cap = tab->cap ? tab->cap * 2 : 16;
+        tab->entries = realloc(tab->entries, sizeof(struct ls_entry) * tab->cap);
+    }
+    struct ls_entry *e = &tab->entries[tab->count++];
+    memset(e, 0, sizeof(*e));
+    e->name = strdup(path);
+    entry_scan_name(e);
+    e->ino = st->st_ino;
+    e->stat_state = 1;
+    e->st = *st;
+    tab->shown = tab->count;
+}
+
+static void list_file_operands(struct walker *w, struct ls_table *tab) {
+    const struct ls_opts *opts = w->opts;
+    qsort(tab->entries, tab->shown, sizeof(struct ls_entry), compare_names);
+    stat_entries(tab, 0, tab->shown);   // operands come stat'd, but not probed
+    hash_entries(tab, opts);
+    if (opts->format == LS_FORMAT_HUMAN) {
+        switch (opts->display) {
+            case LS_LONG:       list_long(tab, w->emit, w->out); break;
+            case LS_HORIZONTAL: list_horizontal(tab, w->width, w->cell, w->out); break;
+            default:            list_columns(tab, w->width, w->cell, w->out);
+        }
+        return;
+    }
+    // records split the operand into its directory and name
+    char hash[2 * HASH_MAX + 1];
+    for (int i = 0; i < tab->shown && !w->out->err; i++) {
+        struct ls_entry e = tab->entries[i];
+        char dir[PATH_MAX];
+        const char *slash = strrchr(e.name, '/');
+        if (!slash) {
+            strcpy(dir, ".");
+        } else {
+            size_t len = slash == e.name ? 1 : (size_t)(slash - e.name);
+            if (len >= sizeof(dir)) len = sizeof(dir) - 1;
+            memcpy(dir, e.name, len);
+            dir[len] = '\0';
+            e.name = (char *)slash + 1;
+            entry_scan_name(&e);
+        }
+        w->emit(w->out, dir, &e, digest_cell(tab, i, 0, hash));
+    }
+}
+
+// -------------------- Operand Pool --------------------
+// Directory operands without -R are listed by a pool the size of the
+// walker's: each pool thread takes the next operand and lists it, header
+// and all, with a walker of its own into a memory buffer, and the caller
+// writes the buffers out in argument order. Run-ahead is bounded as in the
+// -R walker. Diagnostics still go straight to opts->err_fd, so they may come
+// out ahead of the listings they follow.
+struct operand_slot {
+    struct ls_out buf;
+    struct ls_stats stats;
+    int done;
+};
+
+struct operand_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;     // a slot finished, or the printer moved on
+    const struct ls_opts *opts;
+    const char *const *paths;
+    int npaths;
+    int width;
+    int headers;              // "path:" lines, for human output
+    struct operand_slot *slots;
+    int next;                 // next operand to take
+    int printed;              // operands written out so far
+    int stop;                 // writing the output failed
+};
+
+static void *operand_thread(void *arg) {
+    struct operand_pool *p = arg;
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->stop && p->next < p->npaths && p->next - p->printed >= MAX_UNPRINTED)
+            pthread_cond_wait(&p->ready, &p->lock);
+        if (p->stop || p->next >= p->npaths) break;
+        int i = p->next++;
+        pthread_mutex_unlock(&p->lock);
+
+        struct operand_slot *slot = &p->slots[i];
+        struct walker w;
+        ls_out_init_mem(&slot->buf);
+        walker_init(&w, p->opts, &slot->buf);
+        w.width = p->width;
+        if (p->headers) ls_out_printf(&slot->buf, "%s:\n", p->paths[i]);
+        do_ls_operand(&w, p->paths[i]);
+        slot->stats = w.stats;
+        walker_destroy(&w);
+
+        pthread_mutex_lock(&p->lock);
+        slot->done = 1;
+        pthread_cond_broadcast(&p->ready);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void list_operands_pooled(struct walker *w, const char *const *paths, int npaths,
+                                 int headers) {
+    struct operand_pool p;
+    memset(&p, 0, sizeof(p));
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.ready, NULL);
+    p.opts = w->opts;
+    p.paths = paths;
+    p.npaths = npaths;
+    p.width = w->width;
+    p.headers = headers;
+    p.slots = calloc(npaths, sizeof(struct operand_slot));
+
+    int nthreads = w->thread_count < npaths ? w->thread_count : npaths;
+    for (int i = 0; i < nthreads; i++)
+        pthread_create(&w->threads[i], NULL, operand_thread, &p);
+
+    for (int i = 0; i < npaths; i++) {
+        struct operand_slot *slot = &p.slots[i];
+        pthread_mutex_lock(&p.lock);
+        while (!slot->done && !(p.stop && i >= p.next))
+            pthread_cond_wait(&p.ready, &p.lock);
+        pthread_mutex_unlock(&p.lock);
+        if (!slot->done) break;
+
+        ls_out_write(w->out, slot->buf.buf, slot->buf.len);
+        if (headers && i < npaths - 1) ls_out_putc(w->out, '\n');
+        ls_out_free(&slot->buf);
+        stats_add(&w->stats, &slot->stats);
+
+        pthread_mutex_lock(&p.lock);
+        p.printed = i + 1;
+        if (w->out->err) p.stop = 1;
+        pthread_cond_broadcast(&p.ready);
+        pthread_mutex_unlock(&p.lock);
+    }
+
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(w->threads[i], NULL);
+    for (int i = 0; i < npaths; i++)
+        if (p.slots[i].done) ls_out_free(&p.slots[i].buf);
+    free(p.slots);
+    pthread_cond_destroy(&p.ready);
+    pthread_mutex_destroy(&p.lock);
+}
+
+int ls_list(const char *const *paths, int npaths, const struct ls_opts *opts,
+            struct ls_out *out, struct ls_stats *stats) {
+    static const char *const dot[] = { "." };
+    if (npaths == 0) {
+        paths = dot;
+        npaths = 1;
+    }
+
+    struct walker w;
+    walker_init(&w, opts, out);
+    if (opts->cache) ls_cache_drain(opts->cache);
+
+    // a change report is per directory, so there every operand is one
+    int human = opts->format == LS_FORMAT_HUMAN && !opts->since;
+    const char **dirs = malloc(sizeof(char *) * npaths);
+    int ndirs = 0;
+    struct ls_table files;
+    memset(&files, 0, sizeof(files));
+    files.xattrs = opts->xattrs;
+    files.err_fd = opts->err_fd;
+    for (int i = 0; i < npaths; i++) {
+        struct stat st;
+        if (!opts->since && stat(paths[i], &st) == 0 && !S_ISDIR(st.st_mode) &&
+            (opts->follow != LS_FOLLOW_NONE || lstat(paths[i], &st) == 0))
+            add_file_operand(&files, paths[i], &st);
+        else
+            dirs[ndirs++] = paths[i];
+    }
+    if (files.shown) {
+        list_file_operands(&w, &files);
+        if (opts->export) export_file_operands(opts->export, &files);
+        if (human && ndirs) ls_out_putc(out, '\n');
+        w.stats.xattr_calls += files.xattr_calls;
+        w.stats.hashed += files.hashed;
+        w.stats.hash_bytes += files.hash_bytes;
+        w.stats.hash_hits += files.hash_hits;
+    }
+    free_entries(&files);
+
+    // a pooled operand is listed whole into memory, which the limit forbids,
+    // and snapshots and exports are recorded in listing order
+    if (!opts->recursive && ndirs > 1 && w.thread_count > 0 &&
+        !opts->memory_limit && !opts->snapshot && !opts->export) {
+        list_operands_pooled(&w, dirs, ndirs, human);
+    } else {
+        for (int i = 0; i < ndirs && !out->err; i++) {
+            if (human) ls_out_printf(out, "%s:\n", dirs[i]);
+            do_ls_operand(&w, dirs[i]);
+            if (human && i < ndirs - 1) ls_out_putc(out, '\n');
+        }
+    }
+    ls_out_flush(out);
+    free(dirs);
+
+    if (stats) *stats = w.stats;
+    walker_destroy(&w);
+    return out->err ? -1 : 0;
+}
+
+// -------------------- Columnar Export: Reading --------------------
+// An export is listed back block by block from a read-only mapping: each
+// directory's rows become a table, and the table goes through the same
+// layouts and records as a live one, with the headers ls_list() and -R
+// would have written. Only the current table and the path of each
+// directory above it are held, so memory follows the largest directory
+// and the depth, not the export.
+struct export_reader {
+    const char *map;
+    size_t size;
+    const uint64_t *blocks;
+    uint64_t nblocks;
+};
+
+// The block at index i, checked against the file and its own columns; NULL
+// if anything in it is out of bounds
+static const struct export_block *export_block_at(const struct export_reader *r, uint64_t i) {
+    uint64_t off = r->blocks[i];
+    if (off % 8 || off > r->size || r->size - off < sizeof(struct export_block)) return NULL;
+    const struct export_block *b = (const struct export_block *)(r->map + off);
+    if (b->len > r->size - off || b->rows > EXPORT_BLOCK_ROWS) return NULL;
+    for (int c = 0; c < EXPORT_COLUMNS; c++) {
+        uint64_t o = b->col[c][0], n = b->col[c][1];
+        if (o % 8 || o < sizeof(*b) || o > b->len || n > b->len - o) return NULL;
+        uint64_t want = c <= EXPORT_COL_INO ? b->rows : b->dirs;
+        if (export_col_size[c] > 1 && n != want * export_col_size[c]) return NULL;
+    }
+    const uint32_t *ends[2] = {
+        (const uint32_t *)((const char *)b + b->col[EXPORT_COL_NAME_END][0]),
+        (const uint32_t *)((const char *)b + b->col[EXPORT_COL_DIR_NAME_END][0]),
+    };
+    uint64_t counts[2] = { b->rows, b->dirs };
+    uint64_t limits[2] = { b->col[EXPORT_COL_NAMES][1], b->col[EXPORT_COL_DIR_NAMES][1] };
+    for (int k = 0; k < 2; k++) {
+        uint32_t last = 0;
+        for (uint64_t j = 0; j < counts[k]; j++) {
+            if (ends[k][j] < last || ends[k][j] > limits[k] || ends[k][j] - last > NAME_MAX)
+                return NULL;
+            last = ends[k][j];
+        }
+    }
+    return b;
+}
+
+static const void *export_col(const struct export_block *b, enum export_column c) {
+    return (const char *)b + b->col[c][0];
+}
+
+// The name of row (or dictionary entry) j, from its end column
+static const char *export_name(const struct export_block *b, enum export_column ends,
+                               enum export_column names, uint32_t j, size_t *len) {
+    const uint32_t *end = export_col(b, ends);
+    uint32_t start = j ? end[j - 1] : 0;
+    *len = end[j] - start;
+    return (const char *)export_col(b, names) + start;
+}
+
+static void export_add_row(struct ls_table *tab, const struct export_block *b, uint32_t j) {
+    if (tab->count == tab->cap) {
+        tab->cap = tab->cap ? tab->cap * 2 : 64;
+        tab->entries = realloc(tab->entries, sizeof(struct ls_entry) * tab->cap);
+    }
+    struct ls_entry *e = &tab->entries[tab->count++];
+    memset(e, 0, sizeof(*e));
+    size_t len;
+    const char *name = export_name(b, EXPORT_COL_NAME_END, EXPORT_COL_NAMES, j, &len);
+    e->name = strndup(name, len);
+    entry_scan_name(e);
+
+    uint32_t mode = ((const uint32_t *)export_col(b, EXPORT_COL_MODE))[j];
+    if (!mode) {
+        e->stat_state = -2;
+    } else {
+        int64_t mtime = ((const int64_t *)export_col(b, EXPORT_COL_MTIME))[j];
+        e->stat_state = 1;
+        e->d_type = IFTODT(mode);
+        e->st.st_mode = mode;
+        e->st.st_size = ((const int64_t *)export_col(b, EXPORT_COL_SIZE))[j];
+        e->st.st_mtim.tv_sec = mtime / 1000000000;
+        e->st.st_mtim.tv_nsec = mtime % 1000000000;
+        if (e->st.st_mtim.tv_nsec < 0) {
+            e->st.st_mtim.tv_nsec += 1000000000;
+            e->st.st_mtim.tv_sec--;
+        }
+        e->st.st_uid = ((const uint32_t *)export_col(b, EXPORT_COL_UID))[j];
+        e->st.st_gid = ((const uint32_t *)export_col(b, EXPORT_COL_GID))[j];
+        e->st.st_nlink = ((const uint32_t *)export_col(b, EXPORT_COL_NLINK))[j];
+        e->st.st_ino = ((const uint64_t *)export_col(b, EXPORT_COL_INO))[j];
+        e->ino = e->st.st_ino;
+    }
+    tab->shown = tab->count;
+}
+
+// Paths of the directories above the one being listed; the dictionary is
+// in listing order, so a directory's parent is always on the stack
+struct export_path {
+    uint32_t id;
+    char *path;
+};
+
+struct export_listing {
+    struct walker w;
+    int human;
+    int started;              // something was listed: operands are separated
+    struct export_path *stack;
+    int depth, cap;
+    struct dir_node node;     // the directory being collected
+    int have_node;
+    int files;                // it is the non-directory operands
+};
+
+// Lists the collected directory (if any) and lets it go
+static void export_list_node(struct export_listing *l) {
+    if (!l->have_node) return;
+    struct dir_node *node = &l->node;
+    if (l->files) list_file_operands(&l->w, &node->tab);
+    else list_table(&l->w, node);
+    free_entries(&node->tab);
+    l->have_node = 0;
+}
+
+// Starts collecting dictionary entry j of block b; -1 if its parent is unknown
+static int export_begin_dir(struct export_listing *l, const struct export_block *b, uint32_t j) {
+    struct ls_out *out = l->w.out;
+    uint32_t parent = ((const uint32_t *)export_col(b, EXPORT_COL_DIR_PARENT))[j];
+    size_t len;
+    const char *name = export_name(b, EXPORT_COL_DIR_NAME_END, EXPORT_COL_DIR_NAMES, j, &len);
+    char *path;
+
+    export_list_node(l);
+    if (parent == EXPORT_FILES || parent == EXPORT_ROOT) {
+        while (l->depth > 0) free(l->stack[--l->depth].path);
+        path = strndup(name, len);
+    } else {
+        while (l->depth > 0 && l->stack[l->depth - 1].id != parent) free(l->stack[--l->depth].path);
+        if (l->depth == 0) return -1;
+        const char *above = l->stack[l->depth - 1].path;
+        path = malloc(strlen(above) + len + 2);
+        sprintf(path, "%s/%.*s", above, (int)len, name);
+    }
+    if (l->depth == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 16;
+        l->stack = realloc(l->stack, sizeof(struct export_path) * l->cap);
+    }
+    l->stack[l->depth].id = b->first_dir + j;
+    l->stack[l->depth++].path = path;
+
+    if (l->human && parent == EXPORT_ROOT) {
+        if (l->started) ls_out_putc(out, '\n');
+        ls_out_printf(out, "%s:\n", path);
+    } else if (l->human && parent != EXPORT_FILES) {
+        ls_out_printf(out, "\n%s:\n", path);
+    }
+    l->started = 1;
+
+    memset(&l->node, 0, sizeof(l->node));
+    l->node.path = path;
+    l->have_node = 1;
+    l->files = parent == EXPORT_FILES;
+    return 0;
+}
+
+int ls_export_list(const char *path, const struct ls_opts *opts, struct ls_out *out) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    struct stat st;
+    void *map = MAP_FAILED;
+    size_t size = 0;
+    if (fstat(fd, &st) == 0 &&
+        (size_t)st.st_size >= sizeof(struct export_header) + sizeof(struct export_trailer)) {
+        size = st.st_size;
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = EINVAL;
+        return -1;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    struct export_reader r = { map, size, NULL, 0 };
+    const struct export_header *h = map;
+    const struct export_trailer *t =
+        (const struct export_trailer *)(r.map + size - sizeof(struct export_trailer));
+    if (memcmp(h->magic, EXPORT_MAGIC, 8) != 0 || h->columns != EXPORT_COLUMNS ||
+        memcmp(t->magic, EXPORT_END_MAGIC, 8) != 0 || t->index_off % 8 ||
+        t->index_off > size - sizeof(*t) || t->nblocks > (size - sizeof(*t) - t->index_off) / 8) {
+        munmap(map, size);
+        errno = EINVAL;
+        return -1;
+    }
+    r.blocks = (const uint64_t *)(r.map + t->index_off);
+    r.nblocks = t->nblocks;
+
+    // the export holds the stats, so there is nothing to hash or probe
+    struct ls_opts ropts = *opts;
+    ropts.hash = LS_HASH_NONE;
+    ropts.xattrs = 0;
+    struct export_listing l;
+    memset(&l, 0, sizeof(l));
+    walker_init(&l.w, &ropts, out);
+    l.human = opts->format == LS_FORMAT_HUMAN;
+
+    int bad = 0;
+    uint32_t next_dir = 0;    // dictionary entries begun so far
+    for (uint64_t i = 0; i < r.nblocks && !bad && !out->err; i++) {
+        const struct export_block *b = export_block_at(&r, i);
+        if (!b || b->first_dir != next_dir) {
+            bad = 1;
+            break;
+        }
+        const uint32_t *dir = export_col(b, EXPORT_COL_DIR);
+        uint32_t nd = 0;      // this block's dictionary entries begun
+        for (uint32_t j = 0; j < b->rows && !bad && !out->err; j++) {
+            // directories without rows of their own are still listed, header and all
+            while (!bad && dir[j] >= next_dir && nd < b->dirs) {
+                bad = export_begin_dir(&l, b, nd++) == -1;
+                next_dir++;
+            }
+            if (bad || dir[j] != next_dir - 1 || !l.have_node) {
+                bad = 1;
+                break;
+            }
+            export_add_row(&l.node.tab, b, j);
+        }
+        while (!bad && !out->err && nd < b->dirs) {
+            bad = export_begin_dir(&l, b, nd++) == -1;
+            next_dir++;
+        }
+    }
+    if (!bad) export_list_node(&l);
+    if (l.have_node) free_entries(&l.node.tab);
+    ls_out_flush(out);
+
+    while (l.depth > 0) free(l.stack[--l.depth].path);
+    free(l.stack);
+    walker_destroy(&l.w);
+    int partial = (t->flags & EXPORT_PARTIAL) != 0;
+    munmap(map, size);
+    if (bad) {
+        errno = EINVAL;
+        return -1;
+    }
+    return out->err ? -1 : partial;
+}
+
+// -------------------- Watch Mode --------------------
+// The tables of the first listing are kept and patched in place from
+// inotify events: each event re-stats one name and inserts, replaces or
+// removes it by binary search. On a terminal the listing is a line model
+// whose changed rows are redrawn in place (insert/delete-line escapes shift
+// the rest); elsewhere each change is written as a "+", "-" or "~" record.
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+                      IN_ONLYDIR)
+
+struct watch_dir {
+    char *path;
+    struct ls_table tab;      // listed entries, sorted; nothing held open
+    dev_t root_dev;           // the operand's, for --one-file-system
+    dev_t dev;
+    ino_t ino;
+    int wd;                   // -1 once the watch is gone
+    int first_line;           // screen mode: where the block starts
+    int nlines;               // blank separator + header + body
+};
+
+struct watch {
+    const struct ls_opts *opts;
+    struct ls_out *out;
+    int fd;                   // inotify
+    uint32_t mask;
+    int width;                // for the column layouts
+    row_emitter emit;         // -l rows and records
+    cell_emitter cell;        // names of the column layouts
+
+    struct watch_dir **dirs;  // blocks in listing order
+    int ndirs, dirs_cap;
+    struct watch_dir **by_wd;
+    int by_wd_cap;
+
+    // blocks handed over by the walker, spliced in after each walk
+    struct watch_dir **incoming;
+    int nincoming, incoming_cap;
+    dev_t root_dev;
+
+    // screen mode
+    int screen;
+    int rows, cols;
+    char **lines;
+    int nlines, lines_cap;
+};
+
+static void watch_keep(struct watch *wt, struct dir_node *node) {
+    struct watch_dir *d = calloc(1, sizeof(struct watch_dir));
+    d->path = strdup(node->path);
+    d->tab = node->tab;
+    memset(&node->tab, 0, sizeof(node->tab));
+    d->root_dev = wt->root_dev;
+    d->wd = -1;
+
+    // keep only what is displayed: parked -R directories and entries that
+    // could not be stat'd are re-derived from events
+    struct ls_table *t = &d->tab;
+    int n = 0;
+    for (int i = 0; i < t->count; i++) {
+        if (i < t->shown && t->entries[i].stat_state == 1) t->entries[n++] = t->entries[i];
+        else free(t->entries[i].name);
+    }
+    t->count = t->shown = n;
+
+    struct stat st;
+    if (stat(d->path, &st) == 0) {
+        d->dev = st.st_dev;
+        d->ino = st.st_ino;
+    }
+    d->wd = inotify_add_watch(wt->fd, d->path, wt->mask);
+    if (d->wd >= 0) {
+        if (d->wd >= wt->by_wd_cap) {
+            int old_cap = wt->by_wd_cap;
+            wt->by_wd_cap = (d->wd + 1) * 2;
+            wt->by_wd = realloc(wt->by_wd, sizeof(struct watch_dir *) * wt->by_wd_cap);
+            memset(wt->by_wd + old_cap, 0, sizeof(struct watch_dir *) * (wt->by_wd_cap - old_cap));
+        }
+        wt->by_wd[d->wd] = d;
+    }
+
+    if (wt->nincoming == wt->incoming_cap) {
+        wt->incoming_cap = wt->incoming_cap ? wt->incoming_cap * 2 : 16;
+        wt->incoming = realloc(wt->incoming, sizeof(struct watch_dir *) * wt->incoming_cap);
+    }
+    wt->incoming[wt->nincoming++] = d;
+}
+
+static void watch_dir_free(struct watch *wt, struct watch_dir *d) {
+    if (d->wd >= 0) {
+        inotify_rm_watch(wt->fd, d->wd);
+        if (wt->by_wd[d->wd] == d) wt->by_wd[d->wd] = NULL;
+    }
+    free_entries(&d->tab);
+    free(d->path);
+    free(d);
+}
+
+// Walks path (a whole subtree under -R) into wt->incoming
+static void watch_walk(struct watch *wt, const char *path, dev_t root_dev, int operand) {
+    struct walker w;
+    walker_init(&w, wt->opts, wt->out);
+    w.keep = wt;
+    wt->root_dev = root_dev;
+    if (operand) {
+        do_ls_operand(&w, path);
+        for (int i = 0; i < wt->nincoming; i++) wt->incoming[i]->root_dev = w.root_dev;
+    } else {
+        w.root_dev = root_dev;
+        walk_tree(&w, path);
+    }
+    walker_destroy(&w);
+}
+
+// -------------------- Watch Mode: Rendering --------------------
+// Body lines of one block, as the plain listing would print them
+static void watch_render_body(struct watch *wt, struct watch_dir *d, struct ls_out *mem) {
+    const struct ls_opts *opts = wt->opts;
+    switch (opts->display) {
+        case LS_LONG:       list_long(&d->tab, wt->emit, mem); break;
+        case LS_HORIZONTAL: list_horizontal(&d->tab, wt->width, wt->cell, mem); break;
+        default:            list_columns(&d->tab, wt->width, wt->cell, mem);
+    }
+}
+
+// Splits rendered output into lines; returns how many
+static int split_lines(struct ls_out *mem, char ***lines) {
+    int n = 0, cap = 16;
+    char **v = malloc(sizeof(char *) * cap);
+    size_t start = 0;
+    for (size_t i = 0; i < mem->len; i++) {
+        if (mem->buf[i] != '\n') continue;
+        if (n == cap) v = realloc(v, sizeof(char *) * (cap *= 2));
+        v[n++] = strndup(mem->buf + start, i - start);
+        start = i + 1;
+    }
+    *lines = v;
+    return n;
+}
+
+// Writes a row cut to the terminal width; escape sequences take no columns
+static void screen_put(struct watch *wt, const char *text) {
+    const char *p = text;
+    int col = 0;
+    while (*p && col < wt->cols) {
+        if (*p == '\033') {
+            p++;
+            if (*p == '[') {
+                p++;
+                while (*p && !(*p >= 0x40 && *p <= 0x7e)) p++;
+            }
+            if (*p) p++;
+            continue;
+        }
+        if (((unsigned char)*p & 0xC0) != 0x80) col++;
+        p++;
+    }
+    while (*p && ((unsigned char)*p & 0xC0) == 0x80) p++;
+    ls_out_write(wt->out, text, p - text);
+    if (*p) ls_out_puts(wt->out, COLOR_RESET);
+    ls_out_puts(wt->out, "\033[K");
+}
+
+static void screen_draw_row(struct watch *wt, int row) {
+    if (row >= wt->rows || row >= wt->nlines) return;
+    ls_out_printf(wt->out, "\033[%d;1H", row + 1);
+    screen_put(wt, wt->lines[row]);
+}
+
+static void screen_redraw(struct watch *wt) {
+    ls_out_puts(wt->out, "\033[H\033[2J");
+    for (int r = 0; r < wt->rows && r < wt->nlines; r++) screen_draw_row(wt, r);
+}
+
+static void lines_reserve(struct watch *wt, int extra) {
+    if (wt->nlines + extra <= wt->lines_cap) return;
+    wt->lines_cap = (wt->nlines + extra) * 2;
+    wt->lines = realloc(wt->lines, sizeof(char *) * wt->lines_cap);
+}
+
+static void screen_set(struct watch *wt, int row, char *text) {
+    free(wt->lines[row]);
+    wt->lines[row] = text;
+    screen_draw_row(wt, row);
+}
+
+static void screen_insert(struct watch *wt, int row, char *text) {
+    lines_reserve(wt, 1);
+    memmove(&wt->lines[row + 1], &wt->lines[row], sizeof(char *) * (wt->nlines - row));
+    wt->lines[row] = text;
+    wt->nlines++;
+    if (row < wt->rows) {
+        ls_out_printf(wt->out, "\033[%d;1H\033[L", row + 1);
+        screen_put(wt, text);
+    }
+}
+
+static void screen_delete(struct watch *wt, int row) {
+    free(wt->lines[row]);
+    memmove(&wt->lines[row], &wt->lines[row + 1], sizeof(char *) * (wt->nlines - row - 1));
+    wt->nlines--;
+    if (row < wt->rows) {
+        ls_out_printf(wt->out, "\033[%d;1H\033[M", row + 1);
+        screen_draw_row(wt, wt->rows - 1);   // scrolled up into view
+    }
+}
+
+// Lines of a whole block: separator, header, body
+static int block_lines(struct watch *wt, int index, char ***lines) {
+    struct watch_dir *d = wt->dirs[index];
+    struct ls_out mem;
+    ls_out_init_mem(&mem);
+    if (index > 0) ls_out_putc(&mem, '\n');
+    ls_out_printf(&mem, "%s:\n", d->path);
+    watch_render_body(wt, d, &mem);
+    int n = split_lines(&mem, lines);
+    ls_out_free(&mem);
+    return n;
+}
+
+static void screen_rebuild(struct watch *wt) {
+    for (int i = 0; i < wt->nlines; i++) free(wt->lines[i]);
+    wt->nlines = 0;
+    for (int i = 0; i < wt->ndirs; i++) {
+        char **v;
+        int n = block_lines(wt, i, &v);
+        lines_reserve(wt, n);
+        memcpy(&wt->lines[wt->nlines], v, sizeof(char *) * n);
+        free(v);
+        wt->dirs[i]->first_line = wt->nlines;
+        wt->dirs[i]->nlines = n;
+        wt->nlines += n;
+    }
+}
+
+static void shift_blocks(struct watch *wt, int from, int delta) {
+    for (int i = from; i < wt->ndirs; i++) wt->dirs[i]->first_line += delta;
+}
+
+static int dir_index(struct watch *wt, struct watch_dir *d) {
+    for (int i = 0; i < wt->ndirs; i++)
+        if (wt->dirs[i] == d) return i;
+    return -1;
+}
+
+// Re-renders a block whose layout may have moved (the column modes) and
+// redraws only the rows that differ
+static void screen_refresh_block(struct watch *wt, int index) {
+    struct watch_dir *d = wt->dirs[index];
+    char **v;
+    int n = block_lines(wt, index, &v);
+    char **old = &wt->lines[d->first_line];
+    int old_n = d->nlines;
+
+    int pre = 0;
+    while (pre < n && pre < old_n && strcmp(v[pre], old[pre]) == 0) pre++;
+    int suf = 0;
+    while (suf < n - pre && suf < old_n - pre && strcmp(v[n - 1 - suf], old[old_n - 1 - suf]) == 0) suf++;
+
+    int row = d->first_line + pre;
+    int mid_old = old_n - pre - suf, mid_new = n - pre - suf;
+    int i = 0;
+    for (; i < mid_old && i < mid_new; i++) screen_set(wt, row + i, v[pre + i]);
+    for (int j = i; j < mid_new; j++) screen_insert(wt, row + j, v[pre + j]);
+    for (int j = i; j < mid_old; j++) screen_delete(wt, row + i);
+    for (int j = 0; j < pre; j++) free(v[j]);
+    for (int j = n - suf; j < n; j++) free(v[j]);
+    free(v);
+
+    d->nlines = n;
+    shift_blocks(wt, index + 1, mid_new - mid_old);
+}
+
+// -------------------- Watch Mode: Events --------------------
+// Binary search of the sorted table; *pos is where name is or would go
+static int table_find(const struct ls_table *t, const char *name, int *pos) {
+    int lo = 0, hi = t->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(t->entries[mid].name, name);
+        if (cmp == 0) { *pos = mid; return 1; }
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    *pos = lo;
+    return 0;
+}
+
+// Whether a re-stat changes anything the listing shows: the name's color
+// for the plain layouts, otherwise the row or record as written. A -l row
+// shows the time to the minute and a record no link count, so a stat can
+// differ where the output does not (a touch just after a create, say).
+static int entry_changed(struct watch *wt, const char *dirname, const struct ls_entry *old,
+                         const struct ls_entry *fresh) {
+    const struct ls_opts *opts = wt->opts;
+    if (opts->format == LS_FORMAT_HUMAN && opts->display != LS_LONG)
+        return old->st.st_mode != fresh->st.st_mode;
+    if (!stat_differs(&old->st, &fresh->st)) return 0;
+    struct ls_out a, b;
+    ls_out_init_mem(&a);
+    ls_out_init_mem(&b);
+    wt->emit(&a, dirname, old, NULL);
+    wt->emit(&b, dirname, fresh, NULL);
+    int changed = a.len != b.len || memcmp(a.buf, b.buf, a.len) != 0;
+    ls_out_free(&a);
+    ls_out_free(&b);
+    return changed;
+}
+
+// 1 if the block at index is path/name or lies under it
+static int block_under(const char *block, const char *dir, const char *name) {
+    size_t dl = strlen(dir), nl = strlen(name);
+    return strncmp(block, dir, dl) == 0 && block[dl] == '/' &&
+           strncmp(block + dl + 1, name, nl) == 0 && (block[dl + 1 + nl] == '\0' || block[dl + 1 + nl] == '/');
+}
+
+// Where a new subtree named name goes among the blocks after its parent:
+// past every descendant of an earlier-sorting sibling
+static int block_insert_pos(struct watch *wt, int parent, const char *name) {
+    const char *pp = wt->dirs[parent]->path;
+    size_t pl = strlen(pp);
+    int i = parent + 1;
+    for (; i < wt->ndirs; i++) {
+        const char *q = wt->dirs[i]->path;
+        if (strncmp(q, pp, pl) != 0 || q[pl] != '/') break;
+        const char *comp = q + pl + 1;
+        size_t cl = strcspn(comp, "/");
+        char first[NAME_MAX + 1];
+        snprintf(first, sizeof(first), "%.*s", (int)cl, comp);
+        if (strcmp(first, name) >= 0) break;
+    }
+    return i;
+}
+
+static void remove_subtree(struct watch *wt, int parent, const char *name) {
+    const char *pp = wt->dirs[parent]->path;
+    int i = block_insert_pos(wt, parent, name);
+    int j = i;
+    while (j < wt->ndirs && block_under(wt->dirs[j]->path, pp, name)) j++;
+    if (j == i) return;
+
+    if (wt->screen) {
+        int first = wt->dirs[i]->first_line;
+        int count = wt->dirs[j - 1]->first_line + wt->dirs[j - 1]->nlines - first;
+        for (int k = 0; k < count; k++) screen_delete(wt, first);
+        shift_blocks(wt, j, -count);
+    }
+    for (int k = i; k < j; k++) watch_dir_free(wt, wt->dirs[k]);
+    memmove(&wt->dirs[i], &wt->dirs[j], sizeof(struct watch_dir *) * (wt->ndirs - j));
+    wt->ndirs -= j - i;
+}
+
+static void splice_incoming(struct watch *wt, int at) {
+    int n = wt->nincoming;
+    if (wt->ndirs + n > wt->dirs_cap) {
+        wt->dirs_cap = (wt->ndirs + n) * 2;
+        wt->dirs = realloc(wt->dirs, sizeof(struct watch_dir *) * wt->dirs_cap);
+    }
+    memmove(&wt->dirs[at + n], &wt->dirs[at], sizeof(struct watch_dir *) * (wt->ndirs - at));
+    memcpy(&wt->dirs[at], wt->incoming, sizeof(struct watch_dir *) * n);
+    wt->ndirs += n;
+    wt->nincoming = 0;
+
+    if (wt->screen) {
+        int row = at > 0 ? wt->dirs[at - 1]->first_line + wt->dirs[at - 1]->nlines : 0;
+        int added = 0;
+        for (int i = at; i < at + n; i++) {
+            char **v;
+            int nl = block_lines(wt, i, &v);
+            wt->dirs[i]->first_line = row + added;
+            wt->dirs[i]->nlines = nl;
+            for (int k = 0; k < nl; k++) screen_insert(wt, row + added + k, v[k]);
+            free(v);
+            added += nl;
+        }
+        shift_blocks(wt, at + n, added);
+    } else {
+        for (int i = at; i < at + n; i++)
+            for (int k = 0; k < wt->dirs[i]->tab.count; k++)
+                format_change(wt->out, wt->opts, wt->emit, '+', wt->dirs[i]->path,
+                              &wt->dirs[i]->tab.entries[k]);
+    }
+}
+
+// Brings one name of a watched directory up to date: whatever the event
+// was, the name is re-stat'd and the table and the screen follow
+static void watch_refresh(struct watch *wt, struct watch_dir *d, const char *name) {
+    const struct ls_opts *opts = wt->opts;
+    struct ls_table *t = &d->tab;
+    if (name[0] == '.') return;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", d->path, name);
+    struct ls_entry fresh = { 0 };
+    fresh.name = (char *)name;
+    entry_scan_name(&fresh);
+    int exists = 0;
+    if (!(opts->exclude.count && ls_matcher_match(&opts->exclude, name, strlen(name)))) {
+        exists = (t->follow && stat(path, &fresh.st) == 0) || lstat(path, &fresh.st) == 0;
+        if (exists) {
+            fresh.stat_state = 1;
+            fresh.ino = fresh.st.st_ino;
+            fresh.d_type = IFTODT(fresh.st.st_mode);
+        }
+    }
+    int listed = exists && entry_matches(t, &fresh, opts);
+
+    int pos;
+    int present = table_find(t, name, &pos);
+    int index = wt->screen || opts->recursive ? dir_index(wt, d) : -1;
+    int body = wt->screen ? d->first_line + (index > 0 ? 2 : 1) : 0;
+    int row_patch = wt->screen && opts->display == LS_LONG;
+
+    int unchanged = present && listed && !entry_changed(wt, d->path, &t->entries[pos], &fresh);
+
+    if (unchanged) {
+        // an event that touched nothing on display (a touch under -x, say)
+    } else if (present && listed) {
+        t->entries[pos].st = fresh.st;
+        t->entries[pos].ino = fresh.ino;
+        t->entries[pos].d_type = fresh.d_type;
+        if (row_patch) {
+            struct ls_out mem;
+            ls_out_init_mem(&mem);
+            wt->emit(&mem, NULL, &t->entries[pos], NULL);
+            screen_set(wt, body + pos, strndup(mem.buf, mem.len - 1));
+            ls_out_free(&mem);
+        } else if (!wt->screen) {
+            format_change(wt->out, opts, wt->emit, '~', d->path, &t->entries[pos]);
+        }
+    } else if (present) {
+        if (!wt->screen) format_change(wt->out, opts, wt->emit, '-', d->path, &t->entries[pos]);
+        free(t->entries[pos].name);
+        memmove(&t->entries[pos], &t->entries[pos + 1], sizeof(struct ls_entry) * (t->count - pos - 1));
+        t->count--;
+        t->shown--;
+        if (row_patch) {
+            screen_delete(wt, body + pos);
+            d->nlines--;
+            shift_blocks(wt, index + 1, -1);
+        }
+    } else if (listed) {
+        if (t->count == t->cap) {
+            t->cap = t->cap ? t->cap * 2 : 16;
+            t->entries = realloc(t->entries, sizeof(struct ls_entry) * t->cap);
+        }
+        memmove(&t->entries[pos + 1], &t->entries[pos], sizeof(struct ls_entry) * (t->count - pos));
+        t->entries[pos] = fresh;
+        t->entries[pos].name = strdup(name);
+        t->count++;
+        t->shown++;
+        if (row_patch) {
+            struct ls_out mem;
+            ls_out_init_mem(&mem);
+            wt->emit(&mem, NULL, &t->entries[pos], NULL);
+            screen_insert(wt, body + pos, strndup(mem.buf, mem.len - 1));
+            ls_out_free(&mem);
+            d->nlines++;
+            shift_blocks(wt, index + 1, 1);
+        } else if (!wt->screen) {
+            format_change(wt->out, opts, wt->emit, '+', d->path, &t->entries[pos]);
+        }
+    }
+    if (wt->screen && !row_patch && !unchanged && (present || listed)) screen_refresh_block(wt, index);
+
+    // Under -R a directory gets its own blocks whether or not it is listed
+    if (opts->recursive) {
+        int descend = exists && S_ISDIR(fresh.st.st_mode) &&
+                      !(opts->prune.count && ls_matcher_match(&opts->prune, name, strlen(name))) &&
+                      !(opts->one_fs && fresh.st.st_dev != d->root_dev);
+        if (descend && t->follow) {
+            for (int i = 0; i < wt->ndirs; i++)
+                if (wt->dirs[i]->dev == fresh.st.st_dev && wt->dirs[i]->ino == fresh.st.st_ino) descend = 0;
+        }
+        int at = block_insert_pos(wt, index, name);
+        int has_block = at < wt->ndirs && block_under(wt->dirs[at]->path, d->path, name);
+        if (has_block && (!descend || wt->dirs[at]->ino != fresh.st.st_ino)) {
+            remove_subtree(wt, index, name);
+            has_block = 0;
+        }
+        if (descend && !has_block) {
+            watch_walk(wt, path, d->root_dev, 0);
+            splice_incoming(wt, at);
+        }
+    }
+}
+
+static void watch_rescan(struct watch *wt, const char *const *paths, int npaths) {
+    for (int i = 0; i < wt->ndirs; i++) watch_dir_free(wt, wt->dirs[i]);
+    wt->ndirs = 0;
+    for (int i = 0; i < npaths; i++) {
+        watch_walk(wt, paths[i], 0, 1);
+        int at = wt->ndirs;
+        int n = wt->nincoming;
+        if (wt->ndirs + n > wt->dirs_cap) {
+            wt->dirs_cap = (wt->ndirs + n) * 2;
+            wt->dirs = realloc(wt->dirs, sizeof(struct watch_dir *) * wt->dirs_cap);
+        }
+        memcpy(&wt->dirs[at], wt->incoming, sizeof(struct watch_dir *) * n);
+        wt->ndirs += n;
+        wt->nincoming = 0;
+    }
+}
+
+// Writes the whole listing, as ls_list() would without --sizes
+static void watch_print_all(struct watch *wt) {
+    const struct ls_opts *opts = wt->opts;
+    if (wt->screen) {
+        screen_rebuild(wt);
+        screen_redraw(wt);
+        return;
+    }
+    for (int i = 0; i < wt->ndirs; i++) {
+        struct watch_dir *d = wt->dirs[i];
+        if (opts->format != LS_FORMAT_HUMAN) {
+            list_records(&d->tab, d->path, wt->emit, wt->out);
+            continue;
+        }
+        if (i > 0) ls_out_putc(wt->out, '\n');
+        ls_out_printf(wt->out, "%s:\n", d->path);
+        watch_render_body(wt, d, wt->out);
+    }
+}
+
+static void watch_winsize(struct watch *wt, int *rows, int *cols) {
+    struct winsize ws;
+    *rows = 24;
+    *cols = wt->width;
+    if (ioctl(wt->out->fd, TIOCGWINSZ, &ws) != -1 && ws.ws_row > 0) {
+        *rows = ws.ws_row;
+        *cols = ws.ws_col;
+    }
+}
+
+int ls_watch(const char *const *paths, int npaths, const struct ls_opts *opts,
+             struct ls_out *out, volatile sig_atomic_t *stop) {
+    static const char *const dot[] = { "." };
+    if (npaths == 0) {
+        paths = dot;
+        npaths = 1;
+    }
+
+    struct watch wt;
+    memset(&wt, 0, sizeof(wt));
+    wt.opts = opts;
+    wt.emit = pick_row_emitter(opts);
+    wt.cell = pick_name_cell(opts);
+    wt.out = out;
+    wt.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (wt.fd == -1) return -1;
+    // writes to a file only matter where its size or times are shown
+    wt.mask = WATCH_EVENTS;
+    if (opts->display == LS_LONG || opts->format != LS_FORMAT_HUMAN || opts->size_cmp || opts->has_newer)
+        wt.mask |= IN_MODIFY;
+    if (opts->follow != LS_FOLLOW_ALL) wt.mask |= IN_DONT_FOLLOW;
+
+    struct walker probe;
+    walker_init(&probe, opts, out);
+    wt.width = probe.width;
+    walker_destroy(&probe);
+
+    wt.screen = out->fd >= 0 && isatty(out->fd) && opts->format == LS_FORMAT_HUMAN;
+    if (wt.screen) {
+        watch_winsize(&wt, &wt.rows, &wt.cols);
+        wt.width = wt.cols;
+        ls_out_puts(out, "\033[?1049h\033[?25l");   // alternate screen, no cursor
+    }
+
+    watch_rescan(&wt, paths, npaths);
+    watch_print_all(&wt);
+    ls_out_flush(out);
+
+    char buf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (!*stop && !out->err) {
+        struct pollfd pfd = { wt.fd, POLLIN, 0 };
+        int n = poll(&pfd, 1, -1);
+        if (n == -1 && errno != EINTR) break;
+
+        if (wt.screen) {
+            int rows, cols;
+            watch_winsize(&wt, &rows, &cols);
+            if (rows != wt.rows || cols != wt.cols) {
+                wt.rows = rows;
+                wt.cols = wt.width = cols;
+                screen_rebuild(&wt);
+                screen_redraw(&wt);
+            }
+        }
+
+        ssize_t len;
+        int prev_wd = -1;
+        char prev_name[NAME_MAX + 1] = "";
+        while (n > 0 && (len = read(wt.fd, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + len; ) {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                p += sizeof(struct inotify_event) + ev->len;
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    // events were lost: start over from a full scan
+                    watch_rescan(&wt, paths, npaths);
+                    watch_print_all(&wt);
+                    prev_wd = -1;
+                    continue;
+                }
+                if (ev->wd < 0 || ev->wd >= wt.by_wd_cap || !wt.by_wd[ev->wd]) continue;
+                struct watch_dir *d = wt.by_wd[ev->wd];
+                if (ev->mask & IN_IGNORED) {
+                    wt.by_wd[ev->wd] = NULL;
+                    d->wd = -1;
+                    continue;
+                }
+                if (!ev->len) continue;
+                // a burst of writes to one file is one refresh
+                if (ev->wd == prev_wd && strcmp(ev->name, prev_name) == 0) continue;
+                prev_wd = ev->wd;
+                snprintf(prev_name, sizeof(prev_name), "%s", ev->name);
+                watch_refresh(&wt, d, ev->name);
+            }
+        }
+        ls_out_flush(out);
+    }
+
+    if (wt.screen) {
+        ls_out_puts(out, "\033[?25h\033[?1049l");
+        ls_out_flush(out);
+    }
+    for (int i = 0; i < wt.ndirs; i++) watch_dir_free(&wt, wt.dirs[i]);
+    for (int i = 0; i < wt.nlines; i++) free(wt.lines[i]);
+    free(wt.lines);
+    free(wt.dirs);
+    free(wt.incoming);
+    free(wt.by_wd);
+    close(wt.fd);
+    return out->err ? -1 : 0;
+}
@@ -0,0 +1,352 @@
+/*
+ * liblsscan: the scanning, stat, sort and format core of ls (v1.7.0)
+ *
+ * bin/ls is a thin wrapper over this library; services can link
+ * liblsscan.a or liblsscan.so and list directories in-process instead of
+ * spawning bin/ls and parsing its output.
+ *
+ * Typical use:
+ *
+ *     struct ls_opts opts;
+ *     struct ls_table *t;
+ *     ls_opts_init(&opts);
+ *     if (ls_scan(dirfd, &opts, &t) == 0) {
+ *         struct ls_iter it;
+ *         const struct ls_entry *e;
+ *         char row[4096];
+ *         ls_iter_init(&it, t);
+ *         while ((e = ls_iter_next(&it)) != NULL)
+ *             if (ls_format_long(e, 0, row, sizeof(row)) < (int)sizeof(row)) ...;
+ *         ls_table_free(t);
+ *     }
+ *
+ * or, for whole listings (headers, -R, --sizes) rendered into memory:
+ *
+ *     struct ls_out out;
+ *     ls_out_init_mem(&out);
+ *     ls_list(paths, npaths, &opts, &out, NULL);
+ *     ... out.buf / out.len ...
+ *     free(out.buf);
+ */
+
+#ifndef LSSCAN_H
+#define LSSCAN_H
+
+#include <stddef.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+enum ls_display { LS_COLUMNS, LS_LONG, LS_HORIZONTAL };
+
+// --format: HUMAN is the -l/-x/column output; the rest are raw records
+enum ls_format { LS_FORMAT_HUMAN, LS_FORMAT_NULL, LS_FORMAT_JSONL, LS_FORMAT_TSV };
+
+// Symlink handling: none (lstat everything), -H (operands only), -L (all)
+enum ls_follow { LS_FOLLOW_NONE, LS_FOLLOW_OPERANDS, LS_FOLLOW_ALL };
+
+// --type letters, in the order find(1) documents them
+enum { LS_TYPE_FILE = 1, LS_TYPE_DIR = 2, LS_TYPE_LINK = 4, LS_TYPE_FIFO = 8,
+       LS_TYPE_SOCK = 16, LS_TYPE_CHR = 32, LS_TYPE_BLK = 64 };
+
+// -------------------- Name Patterns --------------------
+// Glob patterns are classified once when added, so the common shapes
+// ("node_modules", "*.o", "tmp*") are a memcmp instead of an fnmatch call.
+enum ls_pattern_kind { LS_PAT_LITERAL, LS_PAT_PREFIX, LS_PAT_SUFFIX, LS_PAT_GLOB };
+
+struct ls_pattern {
+    enum ls_pattern_kind kind;
+    char *text;               // literal part, or the whole glob for LS_PAT_GLOB
+    size_t len;
+};
+
+struct ls_matcher {
+    struct ls_pattern *pats;
+    int count, cap;
+};
+
+void ls_matcher_add(struct ls_matcher *m, const char *glob);
+int ls_matcher_match(const struct ls_matcher *m, const char *name, size_t name_len);
+void ls_matcher_free(struct ls_matcher *m);
+
+// -------------------- Directory Cache --------------------
+// A long-lived process can keep directory tables between listings. A cached
+// table is reused while the directory's mtime and ctime are unchanged; entry
+// stats are reused only while an inotify watch on the directory has seen no
+// event (and never under -L, whose targets live elsewhere). Listings on
+// several threads may share one cache.
+struct ls_cache;
+
+struct ls_cache *ls_cache_new(size_t max_entries);
+void ls_cache_free(struct ls_cache *c);
+int ls_cache_fd(const struct ls_cache *c);   // inotify fd to poll, or -1
+void ls_cache_drain(struct ls_cache *c);     // apply queued inotify events
+void ls_cache_clear(struct ls_cache *c);
+
+// -------------------- Directory Index --------------------
+// An on-disk cache for repeated listings of a slow-changing tree. Opening it
+// maps the previous run's index, and a directory whose (dev, ino, mtime,
+// ctime) is unchanged is served from the map instead of readdir(). Entries
+// are still stat'd, so output is identical to a fresh scan. Closing it
+// replaces the file with an index of the directories this run listed.
+struct ls_index;
+
+struct ls_index *ls_index_open(const char *path);   // NULL with errno set
+int ls_index_close(struct ls_index *idx);            // -1 if writing failed
+
+// -------------------- Snapshots --------------------
+// A compact record of every listed entry (path, type, mode, size, mtime,
+// owner, inode), for reporting later what was added, removed or modified.
+// A created snapshot is filled by the listings it is passed to and written
+// out on close; a loaded one is only read. A listing cut short by a
+// deadline or stat timeout is not written (close fails with ETIMEDOUT), as
+// what it missed would be reported as added next time.
+struct ls_snapshot;
+
+struct ls_snapshot *ls_snapshot_create(const char *path);   // NULL with errno set
+struct ls_snapshot *ls_snapshot_load(const char *path);     // NULL with errno set
+int ls_snapshot_close(struct ls_snapshot *s);               // -1 with errno set if
+                                                            // not written
+
+// -------------------- Columnar Export --------------------
+// Every listed entry (path, size, mtime, mode, owner, links, inode) as a
+// columnar file for analysis: blocks of per-field arrays, with directory
+// paths dictionary-encoded, readable through mmap. An export is filled by
+// the listings it is passed to, written out block by block as they go, and
+// completed on close; ls_export_list() lists one back. An export of a
+// listing cut short by a deadline or stat timeout is marked partial.
+struct ls_export;
+
+struct ls_export *ls_export_create(const char *path);   // NULL with errno set
+int ls_export_close(struct ls_export *x);               // -1 if writing failed
+
+// -------------------- Colors --------------------
+// Names are colored by a scheme in LS_COLORS syntax ("di=01;34:*.tar=01;31"),
+// compiled once; without a call the built-in scheme is used. Process-wide,
+// so not to be called while a listing is running.
+void ls_colors_load(const char *spec);   // NULL = the built-in scheme
+
+// -------------------- Filesystem Profiles --------------------
+// Each directory is stat'd the way a profile for its filesystem type says:
+// stats in flight, how far a streamed listing stats ahead, inode order,
+// whether d_type is trusted, AT_STATX_DONT_SYNC, and whether --xattrs
+// probes there at all. The built-in table can be adjusted with a spec of
+// "fstype:key=value,...;..." items, e.g. "nfs:threads=32,window=256;
+// ext4:inode_order=0" (types: ext4 xfs btrfs tmpfs ramfs proc sysfs nfs
+// cifs smb2 ceph 9p fuse default; keys: threads window inode_order
+// trust_dtype dont_sync xattrs). Process-wide like the colors.
+int ls_fs_profiles_load(const char *spec);   // NULL = built-ins; -1 (EINVAL) if
+                                             // spec is malformed, which changes nothing
+
+// -------------------- Content Digests --------------------
+// --hash: a digest of each listed regular file's contents, read on a pool
+// of threads per directory. A digest cache keeps digests between runs,
+// keyed by (dev, ino) and reused while the size and mtime are unchanged;
+// closing it replaces the file with the digests this run listed.
+enum ls_hash { LS_HASH_NONE, LS_HASH_XXH3, LS_HASH_SHA256 };
+
+struct ls_digest_cache;
+
+struct ls_digest_cache *ls_digest_cache_open(const char *path);   // NULL with errno set
+int ls_digest_cache_close(struct ls_digest_cache *c);              // -1 if writing failed
+
+// -------------------- Options --------------------
+struct ls_opts {
+    enum ls_display display;
+    enum ls_format format;
+    int color;                // ANSI colors in human output (see ls_colors_load)
+    int width;                // columns for -x/default layout; 0 = ask the terminal
+                              // written to (fd 1 for a memory writer)
+    int recursive;            // -R
+    int sizes;                // --sizes totals
+    int threads;              // -R scanner threads; 0 = the lister scans alone
+    enum ls_follow follow;
+    struct ls_cache *cache;   // NULL = always read the directories
+    struct ls_index *index;   // NULL = no on-disk index
+    struct ls_snapshot *snapshot;  // --snapshot: record this listing
+    struct ls_snapshot *since;     // --since: list only changes against this
+    struct ls_export *export;      // --export: record this listing, column-wise
+    size_t memory_limit;      // --memory-limit: bytes of entry tables before
+                              // spilling sorted runs to $TMPDIR; 0 = no limit
+    long long stat_timeout_ns;  // --stat-timeout: give up on one stat after this; 0 = wait
+    struct timespec deadline;   // --deadline: CLOCK_MONOTONIC time after which no
+                                // stat or directory read is started; tv_sec 0 = none
+    int xattrs;               // --xattrs: mark -l modes '+' (ACL) or '.' (security
+                              // context), probed along with the stats
+    enum ls_hash hash;        // --hash: a digest column in -l and the records
+                              // (not for spilled tables, --since or watch)
+    struct ls_digest_cache *digests;  // --hash-cache: NULL = read every file
+    int err_fd;               // diagnostics go here; ls_opts_init() sets fd 2
+
+    // Name filters
+    struct ls_matcher include;  // --include: non-directories must match one
+    struct ls_matcher exclude;  // --exclude: dropped before stat or descent
+    struct ls_matcher prune;    // --prune: listed, but never descended into
+    int one_fs;                 // --one-file-system
+
+    // Metadata predicates; an entry is listed only if all given ones hold
+    unsigned type_mask;       // --type, LS_TYPE_* bits; 0 = any type
+    int size_cmp;             // --size: 0 = unset, '>' '<' or '='
+    off_t size;
+    int has_newer;            // --newer
+    struct timespec newer;
+    int has_uid;              // --uid
+    uid_t uid;
+};
+
+void ls_opts_init(struct ls_opts *opts);
+void ls_opts_free(struct ls_opts *opts);
+
+// -------------------- Entry Tables --------------------
+// One record per directory entry. d_type and d_ino come free with readdir();
+// the stat is only taken the first time something needs metadata.
+struct ls_entry {
+    char *name;
+    ino_t ino;
+    unsigned char d_type;
+    signed char stat_state;   // 0 = not taken yet, 1 = valid, -1 = failed,
+                              // -2 = timed out (listed with '?' fields)
+    unsigned char name_flags; // LS_NAME_* bits, valid while name_len is set
+    unsigned char attrs;      // LS_ATTR_* bits from the --xattrs probe; 0 = not probed
+    unsigned short name_len;  // strlen(name) from the scan on reading; 0 = unscanned
+    unsigned short name_width;  // terminal columns, cached by the layout pass for
+                                // non-ASCII names; 0 = not yet measured
+    struct stat st;
+};
+
+// What the one pass over a name found, so that later stages can skip
+// escaping and width work for the plain names that make up most listings
+enum { LS_NAME_CTRL = 1,      // bytes below 0x20, or 0x7f
+       LS_NAME_HIGH = 2,      // bytes 0x80 and up (UTF-8 or not)
+       LS_NAME_QUOTE = 4 };   // '"' or '\\'
+
+enum { LS_ATTR_PROBED = 1,
+       LS_ATTR_ACL = 2,       // an access or default ACL: '+'
+       LS_ATTR_CONTEXT = 4 }; // a security context (SELinux, Smack): '.'
+
+struct ls_table {
+    DIR *dir;                 // open until released, so stats use fstatat()
+    int follow;               // stat() through symlinks (-L)
+    struct ls_entry *entries;
+    int count, cap;
+    int shown;                // entries[0..shown) are listed and sorted; the
+                              // rest are non-matching directories kept for -R
+    long read_count;          // readdir() entries, for --stats
+    long stat_calls;
+    long stat_timeouts;       // stats given up on (-2 entries)
+    int xattrs;               // probe attributes along with the stats (--xattrs)
+    long xattr_calls;
+    long long stat_timeout_ns;  // the opts' limits, for ls_entry_stat()
+    struct timespec deadline;
+    int err_fd;               // and where it reports a failed lstat
+    struct ls_cache_dir *fill;  // cache record to complete after the scan
+    struct ls_spill *spill;     // runs holding the listed entries, if spilled
+    const struct ls_fs_profile *profile;  // how to stat on this directory's filesystem
+    struct ls_digest *digests;  // --hash: one per listed entry (see ls_table_digest)
+    long hashed;              // files read for digests, and the bytes read
+    long long hash_bytes;
+    long hash_hits;           // digests taken from opts->digests instead
+};
+
+// Reads, filters and sorts the directory open on dirfd (which stays owned by
+// the caller) and stats the listed entries. Returns 0, or -1 with errno set.
+int ls_scan(int dirfd, const struct ls_opts *opts, struct ls_table **out);
+void ls_table_free(struct ls_table *t);
+
+size_t ls_table_count(const struct ls_table *t);
+const struct ls_entry *ls_table_entry(const struct ls_table *t, size_t i);
+
+// Hex digest of entry i under --hash into buf (at least 65 bytes); NULL if
+// the entry is not a regular file or could not be read
+const char *ls_table_digest(const struct ls_table *t, size_t i, char *buf);
+
+// Cached lstat (stat under -L) of an entry; NULL if it could not be taken
+// (or, under a stat timeout or deadline, not in time)
+const struct stat *ls_entry_stat(struct ls_table *t, struct ls_entry *e);
+
+struct ls_iter {
+    const struct ls_table *table;
+    size_t next;
+};
+
+void ls_iter_init(struct ls_iter *it, const struct ls_table *t);
+const struct ls_entry *ls_iter_next(struct ls_iter *it);
+
+// -------------------- Formatters --------------------
+// snprintf() semantics: at most cap bytes including the NUL are written,
+// and the return value is the full length the row needed.
+int ls_format_long(const struct ls_entry *e, int color, char *buf, size_t cap);
+int ls_format_record(enum ls_format format, const char *dir, const struct ls_entry *e,
+                     char *buf, size_t cap);
+
+// -------------------- Output --------------------
+// All listing output goes through one of these. An fd-backed writer flushes
+// with write(2); a memory writer grows (caller frees buf); a fixed writer
+// fills a caller buffer and counts what did not fit in `dropped`.
+struct ls_out {
+    int fd;                   // -1 for the memory-backed kinds
+    char *buf;
+    size_t len, cap;
+    int grow;
+    size_t dropped;
+    int err;                  // errno of the first failed write()
+};
+
+void ls_out_init_fd(struct ls_out *o, int fd);
+void ls_out_init_mem(struct ls_out *o);
+void ls_out_init_buf(struct ls_out *o, char *buf, size_t cap);
+void ls_out_flush(struct ls_out *o);
+void ls_out_write(struct ls_out *o, const char *p, size_t n);
+void ls_out_putc(struct ls_out *o, char c);
+void ls_out_puts(struct ls_out *o, const char *s);
+void ls_out_printf(struct ls_out *o, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void ls_out_free(struct ls_out *o);
+
+// -------------------- Listing --------------------
+struct ls_stats {
+    long dirs;
+    long entries;
+    long stat_calls;
+    long xattr_calls;         // listxattr() calls for --xattrs
+    long revisits;
+    size_t visited_count;     // largest -L visited set over all operands
+    size_t visited_bytes;
+    long cache_hits;          // directories served from opts->cache or opts->index
+    long cache_misses;
+    long stat_timeouts;       // entries listed with '?' fields
+    long late_dirs;           // directories not read because the deadline passed
+    long hashed;              // --hash: files read, bytes read, and cache hits
+    long long hash_bytes;
+    long hash_hits;
+};
+
+// Lists each path with a "path:" header, exactly as bin/ls prints it. With
+// opts->since set it writes one change record per added ("+"), removed
+// ("-") or modified ("~") entry instead, and no headers.
+// Returns 0, or -1 if writing the output failed (see out->err).
+int ls_list(const char *const *paths, int npaths, const struct ls_opts *opts,
+            struct ls_out *out, struct ls_stats *stats);
+
+// Lists like ls_list() (without --sizes), then keeps the listing current
+// from inotify events until *stop is set. On a terminal the changed rows
+// are redrawn in place; otherwise each change is written as a record
+// prefixed with "+" (appeared), "-" (gone) or "~" (changed).
+int ls_watch(const char *const *paths, int npaths, const struct ls_opts *opts,
+             struct ls_out *out, volatile sig_atomic_t *stop);
+
+// Lists an export file (see ls_export_create) the way ls_list() listed it,
+// in the layout or record format of opts; --sizes totals, digests and
+// --xattrs marks are not recorded. Returns 0, 1 if the export is marked
+// partial (it is listed all the same), or -1 with errno set (EINVAL if the
+// file is not a complete export) or out->err set.
+int ls_export_list(const char *path, const struct ls_opts *opts, struct ls_out *out);
+
+// Owner and group names through a process-wide cache
+const char *ls_user_name(uid_t uid);
+const char *ls_group_name(gid_t gid);
+void ls_id_cache_flush(void);   // after /etc/passwd or /etc/group change
+
+#endif
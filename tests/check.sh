@@ -0,0 +1,196 @@
+#!/bin/sh
+# Output and hung-filesystem checks for ls ("make check" runs them):
+#
+#   sh tests/check.sh [--update] LS [SHIM]
+#
+# A fixed tree is built in a temporary directory and every human and record
+# format of it is diffed against tests/fixtures; --update rewrites those
+# instead. Then SHIM (tests/delay_shim.c, LD_PRELOAD) stalls the stats of
+# some names, to check the ? rows, the exit status, and that a listing the
+# deadline cut short neither replaces its snapshot nor passes for a whole
+# export. Owner, group, inode and directory sizes vary between machines and
+# filesystems, so they are masked before the diff.
+update=0
+if [ "$1" = "--update" ]; then
+    update=1
+    shift
+fi
+if [ $# -lt 1 ]; then
+    echo "usage: $0 [--update] LS [SHIM]" >&2
+    exit 2
+fi
+here=$(cd "$(dirname "$0")" && pwd)
+fixtures=$here/fixtures
+ls=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shim=
+[ -n "$2" ] && shim=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT INT TERM
+cd "$work" || exit 1
+export TZ=UTC LC_ALL=C
+export LS_COLORS='di=01;34:ln=01;36:ex=01;32:*.txt=00;33'
+unset COLUMNS LS_FS_PROFILES
+failed=0
+
+pass() {
+    echo "ok   $*"
+}
+
+fail() {
+    echo "FAIL $*"
+    failed=$((failed + 1))
+}
+
+# -------------------- The Tree --------------------
+stamp='2024-01-02 03:04:05'
+mkdir -p tree/sub/deeper tree/empty
+printf 'hello' > tree/alpha.txt
+printf 'a longer line of text\n' > tree/beta.txt
+: > 'tree/with space'
+printf '#!/bin/sh\n' > tree/run.sh
+ln -s alpha.txt tree/link
+i=1
+while [ $i -le 36 ]; do
+    name=$(printf 'n%02d' $i)
+    j=$((i % 7))
+    while [ $j -gt 0 ]; do
+        name=${name}x
+        j=$((j - 1))
+    done
+    printf '%*s' $i '' > "tree/$name"
+    i=$((i + 1))
+done
+printf '1234567890' > tree/sub/one
+: > tree/sub/deeper/two
+chmod 644 tree/*.txt tree/n* 'tree/with space' tree/sub/one tree/sub/deeper/two
+chmod 755 tree/run.sh tree tree/sub tree/sub/deeper tree/empty
+find tree -depth -exec touch -h -d "$stamp" {} +
+
+# -------------------- Fixtures --------------------
+user=$(id -un)
+group=$(id -gn)
+
+norm_human() {
+    sed -e "s/^\([-dl?][^ ]*  *[0-9?]*\) $user $group /\1 OWNER GROUP /" \
+        -e 's/^\(d[^ ]*\)  *[0-9]* OWNER GROUP  *[0-9]* /\1  N OWNER GROUP   SIZE /'
+}
+
+norm_tsv() {
+    awk -F '\t' -v OFS='\t' '{ if ($3 == "d") $5 = "SIZE"; $7 = "U"; $8 = "G"; $9 = "I"; print }'
+}
+
+norm_jsonl() {
+    sed -E -e '/"type":"d"/ s/"size":[0-9]+/"size":SIZE/' \
+        -e 's/"uid":[0-9]+/"uid":U/' -e 's/"gid":[0-9]+/"gid":G/' -e 's/"inode":[0-9]+/"inode":I/'
+}
+
+norm_null() {
+    tr '\0' '\n' | paste - - - - - - - - - | norm_tsv
+}
+
+# fixture NAME NORMALIZER ARGS...: lists the tree with ARGS
+fixture() {
+    name=$1 norm=$2
+    shift 2
+    "$ls" "$@" tree > "$name.raw" 2>&1
+    echo "exit $?" >> "$name.raw"
+    $norm < "$name.raw" > "$name.out"
+    if [ $update = 1 ]; then
+        cp "$name.out" "$fixtures/$name.out"
+        echo "wrote fixtures/$name.out"
+    elif diff -u "$fixtures/$name.out" "$name.out" > "$name.diff"; then
+        pass "$name: ls $*"
+    else
+        fail "$name: ls $*"
+        cat "$name.diff"
+    fi
+}
+
+[ $update = 1 ] && mkdir -p "$fixtures"
+fixture columns     norm_human
+fixture across      norm_human -x
+fixture long        norm_human -l
+fixture long-color  norm_human -l --color=always
+fixture color       norm_human --color=always
+fixture recursive   norm_human -R
+fixture across-R    norm_human -xR
+fixture long-R      norm_human -lR
+fixture spilled     norm_human -R --memory-limit=1
+fixture spilled-x   norm_human -xR --memory-limit=1
+fixture tsv         norm_tsv   -R --format=tsv
+fixture jsonl       norm_jsonl -R --format=jsonl
+fixture null        norm_null  -R --format=null
+[ $update = 1 ] && exit 0
+
+# a whole export lists back as the tree does
+"$ls" -lR --export=whole.lsx tree > direct.out 2>&1
+"$ls" -lR --read-export=whole.lsx > read.out 2>&1
+rc=$?
+if [ $rc = 0 ] && cmp -s direct.out read.out; then
+    pass "export: -lR --read-export lists what -lR did"
+else
+    fail "export: -lR --read-export (exit $rc) differs from -lR"
+    diff -u direct.out read.out
+fi
+
+# -------------------- Hung Filesystems --------------------
+if [ -z "$shim" ] || [ ! -f "$shim" ]; then
+    echo "skip hung-filesystem checks: no delay shim given"
+    [ $failed = 0 ] && exit 0
+    echo "$failed check(s) failed"
+    exit 1
+fi
+
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+# stalled ARGS...: runs ls with the stats of names holding "slow" stalled
+# for 5 s; sets rc and ms
+stalled() {
+    t0=$(now_ms)
+    LD_PRELOAD=$shim LS_TEST_SLOW=slow LS_TEST_DELAY_MS=5000 "$ls" "$@" > out 2> err
+    rc=$?
+    ms=$(($(now_ms) - t0))
+}
+
+mkdir -p hung/d1 hung/d2 hung/d3
+for d in hung hung/d1 hung/d2 hung/d3; do
+    : > $d/fine
+    : > $d/slow
+done
+
+stalled -l --stat-timeout=0.2 --stats hung/d1
+if [ $rc != 0 ] && grep -q '^?????????? .* slow$' out && grep -q '^-.* fine$' out &&
+   grep -q 'stats: 1 stats timed out' err && [ $ms -lt 3000 ]; then
+    pass "stat-timeout: ? row, counted, exit $rc, ${ms} ms"
+else
+    fail "stat-timeout: exit $rc in ${ms} ms"
+    cat out err
+fi
+
+"$ls" -R --snapshot=hung.snap hung > /dev/null 2>&1
+cp hung.snap kept.snap
+stalled -lR --deadline=0.5 --snapshot=hung.snap --export=hung.lsx hung
+if [ $rc != 0 ] && grep -q 'not read, deadline passed' err && grep -q 'not written' err &&
+   cmp -s hung.snap kept.snap && [ $ms -lt 3000 ]; then
+    pass "deadline: exit $rc, ${ms} ms, previous snapshot kept"
+else
+    fail "deadline: exit $rc in ${ms} ms"
+    cat out err
+    cmp hung.snap kept.snap
+fi
+
+"$ls" --read-export=hung.lsx > out 2> err
+rc=$?
+if [ $rc != 0 ] && grep -q 'partial' err; then
+    pass "deadline: export marked partial, --read-export exit $rc"
+else
+    fail "deadline: --read-export of the cut export exit $rc"
+    cat err
+fi
+
+[ $failed = 0 ] && exit 0
+echo "$failed check(s) failed"
+exit 1
@@ -0,0 +1,49 @@
+/*
+ * An LD_PRELOAD stand-in for a hung filesystem: every stat of a name that
+ * contains LS_TEST_SLOW sleeps LS_TEST_DELAY_MS (default 2000) first, so
+ * --stat-timeout and --deadline can be checked without a real NFS or FUSE
+ * mount. Built by "make check" and used by tests/check.sh.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+static void maybe_stall(const char *name) {
+    const char *slow = getenv("LS_TEST_SLOW");
+    if (!slow || !*slow || !name || !strstr(name, slow)) return;
+    const char *ms = getenv("LS_TEST_DELAY_MS");
+    long delay = ms ? atol(ms) : 2000;
+    struct timespec ts = { delay / 1000, delay % 1000 * 1000000L };
+    while (nanosleep(&ts, &ts) == -1) {}
+}
+
+#define NEXT(sym) ((__typeof__(&sym))dlsym(RTLD_NEXT, #sym))
+
+int fstatat(int fd, const char *name, struct stat *st, int flags) {
+    maybe_stall(name);
+    return NEXT(fstatat)(fd, name, st, flags);
+}
+
+int fstatat64(int fd, const char *name, struct stat64 *st, int flags) {
+    maybe_stall(name);
+    return NEXT(fstatat64)(fd, name, st, flags);
+}
+
+int statx(int fd, const char *name, int flags, unsigned int mask, struct statx *sx) {
+    maybe_stall(name);
+    return NEXT(statx)(fd, name, flags, mask, sx);
+}
+
+int lstat(const char *name, struct stat *st) {
+    maybe_stall(name);
+    return NEXT(lstat)(name, st);
+}
+
+int stat(const char *name, struct stat *st) {
+    maybe_stall(name);
+    return NEXT(stat)(name, st);
+}